@@ -0,0 +1,426 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // struct ucred, memfd_create
+#endif
+
+#include "xengfx_driver.h"
+#include "xengfx_capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define XENGFX_CAPTURE_RING_ENTRIES 4096
+
+struct xengfx_capture
+{
+    ScrnInfoPtr scrn;
+    char *path;
+    int listen_fd;
+
+    int ring_fd;
+    int ring_ro_fd;             // what clients get, they must not write
+    size_t ring_size;
+    struct xengfx_capture_ring *ring;
+
+    // Never read back from the ring, clients can write to it
+    uint64_t head;
+    uint32_t generation;
+};
+
+
+static int
+xengfx_capture_create_ring_fd(size_t size)
+{
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("xengfx-capture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    char template[] = "/dev/shm/xengfx-capture-XXXXXX";
+
+    fd = mkstemp(template);
+    if (fd >= 0)
+        unlink(template);
+#endif
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, size))
+    {
+        close(fd);
+        return -1;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    // A client shrinking the file would fault the server on the next flush
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW))
+    {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    return fd;
+}
+
+
+// A read-only descriptor of the same file, through procfs
+static int
+xengfx_capture_reopen_read_only(int fd)
+{
+    char path[32];
+
+    snprintf(path, sizeof (path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+
+static void
+xengfx_capture_describe(struct xengfx_capture_buffer *buffer, int crtc,
+                        struct xengfx_bo *bo, int x, int y, Rotation rotation,
+                        int width, int height)
+{
+    buffer->crtc = crtc;
+    buffer->x = x;
+    buffer->y = y;
+    buffer->rotation = rotation;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->pitch = bo->pitch;
+    buffer->bpp = bo->bpp;
+    buffer->size = bo->size;
+}
+
+
+static void
+xengfx_capture_send(struct xengfx_capture *capture, int client)
+{
+    ScrnInfoPtr scrn = capture->scrn;
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    struct xengfx_capture_info info;
+    int fds[XENGFX_CAPTURE_MAX_BUFFERS + 1];
+    char control[CMSG_SPACE(sizeof (fds))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int i, fd, num_fds = 0;
+
+    memset(&info, 0, sizeof (info));
+    info.magic = XENGFX_CAPTURE_MAGIC;
+    info.version = XENGFX_CAPTURE_VERSION;
+    info.generation = capture->generation;
+    info.depth = scrn->depth;
+
+    fds[num_fds++] = capture->ring_ro_fd;
+
+    fd = xengfx_drm_export_bo(&xengfx->mode, xengfx->mode.front_bo, FALSE);
+    if (fd < 0)
+        return;
+    xengfx_capture_describe(&info.buffers[info.num_buffers++], -1,
+                            xengfx->mode.front_bo, 0, 0, RR_Rotate_0,
+                            scrn->virtualX, scrn->virtualY);
+    fds[num_fds++] = fd;
+
+    // Rotated CRTCs scan out their own shadow instead of the front buffer
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+        if (info.num_buffers == XENGFX_CAPTURE_MAX_BUFFERS)
+            break;
+        if (!crtc->enabled || !xengfx_crtc->rotate_bo)
+            continue;
+
+        fd = xengfx_drm_export_bo(&xengfx->mode, xengfx_crtc->rotate_bo, FALSE);
+        if (fd < 0)
+            continue;
+        xengfx_capture_describe(&info.buffers[info.num_buffers++], i,
+                                xengfx_crtc->rotate_bo, crtc->x, crtc->y,
+                                crtc->rotation, crtc->mode.HDisplay,
+                                crtc->mode.VDisplay);
+        fds[num_fds++] = fd;
+    }
+
+    iov.iov_base = &info;
+    iov.iov_len = sizeof (info);
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof (int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof (int));
+
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0)
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+                   "capture: failed to send buffers: %s\n", strerror(errno));
+
+    // The ring stays ours, the dma-bufs now belong to the client
+    for (i = 1; i < num_fds; ++i)
+        close(fds[i]);
+}
+
+
+static void
+xengfx_capture_accept(struct xengfx_capture *capture)
+{
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    int client;
+
+    client = accept(capture->listen_fd, NULL, NULL);
+    if (client < 0)
+        return;
+
+    // Only root and the user running the server may read the screen
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        (cred.uid == 0 || cred.uid == geteuid()))
+        xengfx_capture_send(capture, client);
+    else
+        xf86DrvMsg(capture->scrn->scrnIndex, X_WARNING,
+                   "capture: rejected unprivileged client\n");
+
+    close(client);
+}
+
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+static void
+xengfx_capture_notify(int fd, int ready, void *data)
+{
+    xengfx_capture_accept(data);
+}
+#else
+static void
+xengfx_capture_block_handler(pointer data, OSTimePtr timeout, pointer read_mask)
+{
+}
+
+
+static void
+xengfx_capture_wakeup_handler(pointer data, int err, pointer read_mask)
+{
+    struct xengfx_capture *capture = data;
+
+    if (err < 0 || !FD_ISSET(capture->listen_fd, (fd_set *) read_mask))
+        return;
+
+    xengfx_capture_accept(capture);
+}
+#endif
+
+
+Bool
+xengfx_capture_init(ScreenPtr screen, const char *path)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_capture *capture;
+    struct sockaddr_un addr;
+    mode_t old_umask;
+    int ret;
+
+    if (strlen(path) >= sizeof (addr.sun_path))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_ERROR, "capture: socket path too long\n");
+        return FALSE;
+    }
+
+    capture = calloc(1, sizeof (*capture));
+    if (!capture)
+        return FALSE;
+    capture->scrn = scrn;
+    capture->listen_fd = -1;
+    capture->ring_fd = -1;
+    capture->ring_ro_fd = -1;
+
+    capture->path = strdup(path);
+    if (!capture->path)
+        goto fail;
+
+    capture->ring_size = sizeof (struct xengfx_capture_ring) +
+                         XENGFX_CAPTURE_RING_ENTRIES * sizeof (struct xengfx_capture_box);
+    capture->ring_fd = xengfx_capture_create_ring_fd(capture->ring_size);
+    if (capture->ring_fd < 0)
+        goto fail;
+    capture->ring_ro_fd = xengfx_capture_reopen_read_only(capture->ring_fd);
+    if (capture->ring_ro_fd < 0)
+        goto fail;
+
+    capture->ring = mmap(NULL, capture->ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, capture->ring_fd, 0);
+    if (capture->ring == MAP_FAILED)
+    {
+        capture->ring = NULL;
+        goto fail;
+    }
+    capture->ring->magic = XENGFX_CAPTURE_MAGIC;
+    capture->ring->version = XENGFX_CAPTURE_VERSION;
+    capture->ring->size = XENGFX_CAPTURE_RING_ENTRIES;
+
+    capture->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (capture->listen_fd < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    old_umask = umask(0177);
+    ret = bind(capture->listen_fd, (struct sockaddr *) &addr, sizeof (addr));
+    umask(old_umask);
+    if (ret || listen(capture->listen_fd, 4))
+        goto fail;
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+    if (!SetNotifyFd(capture->listen_fd, xengfx_capture_notify, X_NOTIFY_READ, capture))
+        goto fail;
+#else
+    AddGeneralSocket(capture->listen_fd);
+    if (!RegisterBlockAndWakeupHandlers(xengfx_capture_block_handler,
+                                        xengfx_capture_wakeup_handler,
+                                        capture))
+    {
+        RemoveGeneralSocket(capture->listen_fd);
+        goto fail;
+    }
+#endif
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "capture: listening on %s\n", path);
+    xengfx->capture = capture;
+    return TRUE;
+
+fail:
+    xf86DrvMsg(scrn->scrnIndex, X_ERROR, "capture: setup failed: %s\n",
+               strerror(errno));
+    if (capture->listen_fd >= 0)
+    {
+        close(capture->listen_fd);
+        unlink(path);
+    }
+    if (capture->ring)
+        munmap(capture->ring, capture->ring_size);
+    if (capture->ring_ro_fd >= 0)
+        close(capture->ring_ro_fd);
+    if (capture->ring_fd >= 0)
+        close(capture->ring_fd);
+    free(capture->path);
+    free(capture);
+    return FALSE;
+}
+
+
+void
+xengfx_capture_fini(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_capture *capture = xengfx->capture;
+
+    if (!capture)
+        return;
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+    RemoveNotifyFd(capture->listen_fd);
+#else
+    RemoveBlockAndWakeupHandlers(xengfx_capture_block_handler,
+                                 xengfx_capture_wakeup_handler,
+                                 capture);
+    RemoveGeneralSocket(capture->listen_fd);
+#endif
+    close(capture->listen_fd);
+    unlink(capture->path);
+
+    munmap(capture->ring, capture->ring_size);
+    close(capture->ring_ro_fd);
+    close(capture->ring_fd);
+
+    free(capture->path);
+    free(capture);
+    xengfx->capture = NULL;
+}
+
+
+void
+xengfx_capture_damage(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_capture *capture = xengfx->capture;
+    struct xengfx_capture_ring *ring;
+    uint64_t head;
+    int i;
+
+    if (!capture)
+        return;
+
+    ring = capture->ring;
+    head = capture->head;
+    for (i = 0; i < num_boxes; ++i)
+    {
+        struct xengfx_capture_box *box = &ring->boxes[(head + i) % XENGFX_CAPTURE_RING_ENTRIES];
+
+        box->x1 = boxes[i].x1;
+        box->y1 = boxes[i].y1;
+        box->x2 = boxes[i].x2;
+        box->y2 = boxes[i].y2;
+    }
+
+    // Publish the boxes only once they are all written
+    capture->head = head + num_boxes;
+    __atomic_store_n(&ring->head, capture->head, __ATOMIC_RELEASE);
+}
+
+
+void
+xengfx_capture_invalidate(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    if (!xengfx->capture)
+        return;
+
+    __atomic_store_n(&xengfx->capture->ring->generation, ++xengfx->capture->generation,
+                     __ATOMIC_RELEASE);
+}
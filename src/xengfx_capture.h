@@ -0,0 +1,100 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#ifndef XENGFX_CAPTURE_H_
+#define XENGFX_CAPTURE_H_
+
+// This is shared with capture clients (screen recorders, remoting agents)
+// Please keep the layout stable and bump the version on any change
+//
+// A client connects to the CaptureSocket unix socket and receives one
+// struct xengfx_capture_info message carrying, as SCM_RIGHTS, a read-only
+// file descriptor of the damage ring memory followed by one dma-buf per
+// buffer. The server then closes the connection.
+//
+// The ring is written by the server on every flush. A client remembers
+// the last head it has seen, and after mapping the buffers reads the
+// boxes in [tail, head). If more than size boxes were written since,
+// it missed some damage and has to read the whole screen. The generation
+// changes when the buffers are replaced (resize, rotation): the client
+// must then reconnect to receive the new ones.
+
+#include <stdint.h>
+
+#define XENGFX_CAPTURE_MAGIC        0x50414358  // "XCAP"
+#define XENGFX_CAPTURE_VERSION      1
+#define XENGFX_CAPTURE_MAX_BUFFERS  8
+
+struct xengfx_capture_box
+{
+    int16_t x1;
+    int16_t y1;
+    int16_t x2;
+    int16_t y2;
+};
+
+
+struct xengfx_capture_ring
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // number of entries in boxes
+    uint32_t generation;
+    uint64_t head;          // number of boxes ever written, updated last
+    struct xengfx_capture_box boxes[];
+};
+
+
+struct xengfx_capture_buffer
+{
+    int32_t crtc;           // -1 for the front buffer
+    int32_t x;              // position of the CRTC viewport in the screen
+    int32_t y;
+    uint32_t rotation;      // RandR rotation of the CRTC scanout
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    uint32_t bpp;
+    uint64_t size;
+};
+
+
+struct xengfx_capture_info
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;
+    uint32_t num_buffers;
+    uint32_t depth;
+    uint32_t pad;
+    struct xengfx_capture_buffer buffers[XENGFX_CAPTURE_MAX_BUFFERS];
+};
+
+#endif /* XENGFX_CAPTURE_H_ */
@@ -0,0 +1,241 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+// Commands are recorded during a main loop iteration in a persistently
+// mapped GEM object, then handed to the backend once per flush.
+#define XENGFX_CMD_BUFFER_SIZE  (64 * 1024)
+
+// Largest command that still fits the 16 bits length
+#define XENGFX_CMD_MAX_BOXES    8000
+
+
+Bool
+xengfx_cmd_init(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct drm_xengfx_submit arg;
+    struct xengfx_bo *bo;
+
+    bo = xengfx_drm_create_bo(&xengfx->mode, XENGFX_BO_COMMAND,
+                              XENGFX_CMD_BUFFER_SIZE, 1, 8, DRM_XENGFX_GEM_CACHED);
+    if (!bo)
+        return FALSE;
+
+    if (xengfx_drm_map_bo(xengfx->fd, bo))
+        goto fail;
+
+    // An empty submission tells whether the backend knows about it
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = bo->handle;
+    arg.fb_id = xengfx->mode.fb_id;
+    if (drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_SUBMIT, &arg))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "Command submission not supported\n");
+        goto fail;
+    }
+
+    xengfx->cmd_bo = bo;
+    xengfx->cmd_used = 0;
+    return TRUE;
+
+fail:
+    xengfx_drm_destroy_bo(&xengfx->mode, bo);
+    return FALSE;
+}
+
+
+void
+xengfx_cmd_fini(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    if (!xengfx->cmd_bo)
+        return;
+
+    xengfx_drm_destroy_bo(&xengfx->mode, xengfx->cmd_bo);
+    xengfx->cmd_bo = NULL;
+    xengfx->cmd_used = 0;
+}
+
+
+Bool
+xengfx_cmd_submit(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct drm_xengfx_submit arg;
+    int ret;
+
+    if (!xengfx->cmd_used)
+        return TRUE;
+
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = xengfx->cmd_bo->handle;
+    arg.fb_id = xengfx->mode.fb_id;
+    arg.offset = 0;
+    arg.length = xengfx->cmd_used;
+
+    ret = drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_SUBMIT, &arg);
+    xengfx->cmd_used = 0;
+    if (ret)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Command submission failed: %s\n",
+                   strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static void*
+xengfx_cmd_reserve(ScrnInfoPtr scrn, uint32_t size)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    uint8_t *ptr;
+
+    if (xengfx->cmd_used + size > xengfx->cmd_bo->size)
+        xengfx_cmd_submit(scrn);
+
+    ptr = (uint8_t *) xengfx->cmd_bo->ptr + xengfx->cmd_used;
+    xengfx->cmd_used += size;
+
+    return ptr;
+}
+
+
+static void
+xengfx_cmd_emit_boxes(ScrnInfoPtr scrn, const void *cmd, uint32_t cmd_size,
+                      BoxPtr boxes, int num_boxes)
+{
+    uint32_t length = cmd_size + num_boxes * sizeof (struct drm_xengfx_box);
+    uint8_t *ptr = xengfx_cmd_reserve(scrn, length);
+    struct drm_xengfx_cmd_header *header = (struct drm_xengfx_cmd_header *) ptr;
+    struct drm_xengfx_box *out = (struct drm_xengfx_box *) (ptr + cmd_size);
+    int i;
+
+    memcpy(ptr, cmd, cmd_size);
+    header->length = length;
+    header->count = num_boxes;
+
+    for (i = 0; i < num_boxes; ++i)
+    {
+        out[i].x1 = boxes[i].x1;
+        out[i].y1 = boxes[i].y1;
+        out[i].x2 = boxes[i].x2;
+        out[i].y2 = boxes[i].y2;
+    }
+}
+
+
+void
+xengfx_cmd_dirty(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes)
+{
+    struct drm_xengfx_cmd_dirty cmd;
+    int n;
+
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.header.type = DRM_XENGFX_CMD_DIRTY;
+
+    for (; num_boxes > 0; num_boxes -= n, boxes += n)
+    {
+        n = min(num_boxes, XENGFX_CMD_MAX_BOXES);
+        xengfx_cmd_emit_boxes(scrn, &cmd, sizeof (cmd), boxes, n);
+    }
+}
+
+
+void
+xengfx_cmd_fill(ScrnInfoPtr scrn, uint32_t pixel, BoxPtr boxes, int num_boxes)
+{
+    struct drm_xengfx_cmd_fill cmd;
+    int n;
+
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.header.type = DRM_XENGFX_CMD_FILL;
+    cmd.pixel = pixel;
+
+    for (; num_boxes > 0; num_boxes -= n, boxes += n)
+    {
+        n = min(num_boxes, XENGFX_CMD_MAX_BOXES);
+        xengfx_cmd_emit_boxes(scrn, &cmd, sizeof (cmd), boxes, n);
+    }
+}
+
+
+Bool
+xengfx_cmd_copy(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes, int dx, int dy)
+{
+    struct drm_xengfx_cmd_copy cmd;
+
+    // The boxes of a copy move at once, they cannot be split
+    if (num_boxes > XENGFX_CMD_MAX_BOXES)
+        return FALSE;
+
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.header.type = DRM_XENGFX_CMD_COPY;
+    cmd.dx = dx;
+    cmd.dy = dy;
+
+    xengfx_cmd_emit_boxes(scrn, &cmd, sizeof (cmd), boxes, num_boxes);
+    return TRUE;
+}
+
+
+// Cursor positions may be updated from the signal handler, so they are
+// only latched there and turned into commands from the flush.
+void
+xengfx_cmd_cursor(ScrnInfoPtr scrn)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        struct xengfx_crtc *xengfx_crtc = config->crtc[i]->driver_private;
+        struct drm_xengfx_cmd_cursor_move *cmd;
+
+        if (!xengfx_crtc->cursor_moved)
+            continue;
+        xengfx_crtc->cursor_moved = FALSE;
+
+        cmd = xengfx_cmd_reserve(scrn, sizeof (*cmd));
+        memset(cmd, 0, sizeof (*cmd));
+        cmd->header.type = DRM_XENGFX_CMD_CURSOR_MOVE;
+        cmd->header.length = sizeof (*cmd);
+        cmd->crtc_id = xengfx_crtc->mode_crtc->crtc_id;
+        cmd->x = xengfx_crtc->cursor_x;
+        cmd->y = xengfx_crtc->cursor_y;
+    }
+}
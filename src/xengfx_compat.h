@@ -0,0 +1,106 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#ifndef XENGFX_COMPAT_H_
+#define XENGFX_COMPAT_H_
+
+// The screen entry points lost their scrnIndex in 1.13, the block
+// handler its read mask in 1.19, when sockets moved to notify fds.
+// Present and DRI3 need 1.15, so they are only built against the newer
+// interface.
+
+#include <xorgVersion.h>
+
+#ifndef XF86_HAS_SCRN_CONV
+#define xf86ScreenToScrn(screen)        xf86Screens[(screen)->myNum]
+#define xf86ScrnToScreen(scrn)          screenInfo.screens[(scrn)->scrnIndex]
+#endif
+
+#ifdef XF86_SCRN_INTERFACE
+
+#define XENGFX_SCRN_ARG_TYPE            ScrnInfoPtr
+#define XENGFX_SCRN_INFO_PTR(arg)       ScrnInfoPtr scrn = (arg)
+
+#define XENGFX_SCREEN_INIT_ARGS_DECL    ScreenPtr screen, int argc, char **argv
+#define XENGFX_CLOSE_SCREEN_ARGS_DECL   ScreenPtr screen
+#define XENGFX_CLOSE_SCREEN_ARGS        screen
+
+#define XENGFX_VT_FUNC_ARGS_DECL        ScrnInfoPtr arg
+#define XENGFX_VT_FUNC_ARGS(flags)      scrn
+#define XENGFX_SWITCH_MODE_ARGS_DECL    ScrnInfoPtr arg, DisplayModePtr mode
+#define XENGFX_ADJUST_FRAME_ARGS_DECL   ScrnInfoPtr arg, int x, int y
+#define XENGFX_FREE_SCREEN_ARGS_DECL    ScrnInfoPtr arg
+
+#else
+
+#define XENGFX_SCRN_ARG_TYPE            int
+#define XENGFX_SCRN_INFO_PTR(arg)       ScrnInfoPtr scrn = xf86Screens[(arg)]
+
+#define XENGFX_SCREEN_INIT_ARGS_DECL    int scrnIndex, ScreenPtr screen, int argc, char **argv
+#define XENGFX_CLOSE_SCREEN_ARGS_DECL   int scrnIndex, ScreenPtr screen
+#define XENGFX_CLOSE_SCREEN_ARGS        scrnIndex, screen
+
+#define XENGFX_VT_FUNC_ARGS_DECL        int arg, int flags
+#define XENGFX_VT_FUNC_ARGS(flags)      scrn->scrnIndex, (flags)
+#define XENGFX_SWITCH_MODE_ARGS_DECL    int arg, DisplayModePtr mode, int flags
+#define XENGFX_ADJUST_FRAME_ARGS_DECL   int arg, int x, int y, int flags
+#define XENGFX_FREE_SCREEN_ARGS_DECL    int arg, int flags
+
+#endif
+
+#if ABI_VIDEODRV_VERSION >= SET_ABI_VERSION(23, 0)
+#define XENGFX_BLOCK_HANDLER_ARGS_DECL  ScreenPtr screen, pointer timeout
+#define XENGFX_BLOCK_HANDLER_ARGS       screen, timeout
+#elif defined(XF86_SCRN_INTERFACE)
+#define XENGFX_BLOCK_HANDLER_ARGS_DECL  ScreenPtr screen, pointer timeout, pointer read_mask
+#define XENGFX_BLOCK_HANDLER_ARGS       screen, timeout, read_mask
+#else
+#define XENGFX_BLOCK_HANDLER_ARGS_DECL  int i, pointer block_data, pointer timeout, \
+                                        pointer read_mask
+#define XENGFX_BLOCK_HANDLER_ARGS       i, block_data, timeout, read_mask
+#define XENGFX_BLOCK_HANDLER_SCREEN     screenInfo.screens[i]
+#endif
+
+#ifndef XENGFX_BLOCK_HANDLER_SCREEN
+#define XENGFX_BLOCK_HANDLER_SCREEN     screen
+#endif
+
+// Sockets are watched through SetNotifyFd instead of the select() masks
+#if ABI_VIDEODRV_VERSION >= SET_ABI_VERSION(22, 0)
+#define XENGFX_HAVE_NOTIFY_FD   1
+#endif
+
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 14, 99, 2, 0)
+#define XENGFX_DAMAGE_UNREGISTER(drawable, damage)  DamageUnregister(damage)
+#else
+#define XENGFX_DAMAGE_UNREGISTER(drawable, damage)  DamageUnregister(drawable, damage)
+#endif
+
+#endif /* XENGFX_COMPAT_H_ */
@@ -0,0 +1,338 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+// Damaged tiles are encoded in a staging GEM object and uploaded in
+// batches, for backends behind a channel where bytes are expensive.
+#define XENGFX_COMPRESS_TILE_SIZE       64
+#define XENGFX_COMPRESS_STAGING_SIZE    (4 * 1024 * 1024)
+
+// Rows sampled for the entropy estimate
+#define XENGFX_COMPRESS_SAMPLE_STEP     8
+
+#define XENGFX_ALIGN(x, a)  (((x) + (a) - 1) & ~((a) - 1))
+
+struct xengfx_rle_run
+{
+    uint32_t count;
+    uint32_t pixel;
+};
+
+
+static uint32_t
+xengfx_compress_pixel(const uint8_t *p, int cpp)
+{
+    if (cpp == 2)
+        return *(const uint16_t *) p;
+
+    return *(const uint32_t *) p;
+}
+
+
+// Number of runs a tile would encode to, estimated from one row in
+// XENGFX_COMPRESS_SAMPLE_STEP
+static int
+xengfx_compress_estimate_runs(const uint8_t *data, int width, int height, int cpp)
+{
+    int x, y, runs = 0, rows = 0;
+
+    for (y = 0; y < height; y += XENGFX_COMPRESS_SAMPLE_STEP, ++rows)
+    {
+        const uint8_t *row = data + y * width * cpp;
+        uint32_t prev = xengfx_compress_pixel(row, cpp);
+
+        runs++;
+        for (x = 1; x < width; ++x)
+        {
+            uint32_t pixel = xengfx_compress_pixel(row + x * cpp, cpp);
+
+            if (pixel != prev)
+                runs++;
+            prev = pixel;
+        }
+    }
+
+    return runs * height / rows;
+}
+
+
+static uint32_t
+xengfx_compress_rle(const uint8_t *data, int num_pixels, int cpp,
+                    uint8_t *out, uint32_t capacity)
+{
+    struct xengfx_rle_run *runs = (struct xengfx_rle_run *) out;
+    uint32_t max_runs = capacity / sizeof (*runs);
+    uint32_t n = 0;
+    int i;
+
+    for (i = 0; i < num_pixels; ++i)
+    {
+        uint32_t pixel = xengfx_compress_pixel(data + i * cpp, cpp);
+
+        if (n && runs[n - 1].pixel == pixel)
+        {
+            runs[n - 1].count++;
+            continue;
+        }
+
+        if (n == max_runs)
+            return 0;
+        runs[n].count = 1;
+        runs[n].pixel = pixel;
+        n++;
+    }
+
+    return n * sizeof (*runs);
+}
+
+
+static Bool
+xengfx_compress_upload(ScrnInfoPtr scrn, uint32_t count)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct drm_xengfx_upload arg;
+
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = xengfx->staging_bo->handle;
+    arg.fb_id = xengfx->mode.fb_id;
+    arg.length = xengfx->staging_used;
+    arg.count = count;
+
+    xengfx->staging_used = 0;
+
+    if (!drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_UPLOAD, &arg))
+        return TRUE;
+
+    if (errno == ENOTTY || errno == EINVAL)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Tile uploads rejected, "
+                   "compression disabled\n");
+        xengfx_compress_fini(scrn);
+        xengfx->compression = XENGFX_COMPRESSION_NONE;
+    }
+    else
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Tile upload failed: %s\n",
+                   strerror(errno));
+
+    return FALSE;
+}
+
+
+// Encode one tile at the end of the staging object, the scratch buffer
+// holds its pixels packed
+static void
+xengfx_compress_tile(ScrnInfoPtr scrn, BoxPtr box, int cpp)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    int width = box->x2 - box->x1;
+    int height = box->y2 - box->y1;
+    uint32_t raw = width * height * cpp;
+    uint8_t *out = (uint8_t *) xengfx->staging_bo->ptr + xengfx->staging_used;
+    struct drm_xengfx_tile_header *header = (struct drm_xengfx_tile_header *) out;
+    uint8_t *data = out + sizeof (*header);
+    uint32_t length = 0;
+    int encoding = DRM_XENGFX_TILE_RAW;
+
+    // Flat content is best as runs, anything else goes through LZ4
+    if (xengfx_compress_estimate_runs(xengfx->scratch, width, height, cpp) *
+        sizeof (struct xengfx_rle_run) < raw / 4)
+    {
+        length = xengfx_compress_rle(xengfx->scratch, width * height, cpp, data, raw / 2);
+        if (length)
+            encoding = DRM_XENGFX_TILE_RLE;
+    }
+#ifdef HAVE_LZ4
+    if (!length && xengfx->compression == XENGFX_COMPRESSION_LZ4)
+    {
+        int ret = LZ4_compress_default((const char *) xengfx->scratch, (char *) data,
+                                       raw, raw - 1);
+        if (ret > 0)
+        {
+            length = ret;
+            encoding = DRM_XENGFX_TILE_LZ4;
+        }
+    }
+#endif
+    if (!length)
+    {
+        memcpy(data, xengfx->scratch, raw);
+        length = raw;
+    }
+
+    header->x = box->x1;
+    header->y = box->y1;
+    header->width = width;
+    header->height = height;
+    header->encoding = encoding;
+    header->pad = 0;
+    header->length = length;
+
+    xengfx->staging_used += XENGFX_ALIGN(sizeof (*header) + length, 8);
+    xengfx->stats.bytes_raw += raw;
+    xengfx->stats.bytes_encoded += length;
+}
+
+
+// Upload the tiles touched by region, encoded. Commands recorded before
+// have to be submitted by the caller. Returns FALSE when some tiles did
+// not make it, the region then has to be reported another way.
+Bool
+xengfx_compress_flush(ScrnInfoPtr scrn, RegionPtr region)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    ScreenPtr screen = screenInfo.screens[scrn->scrnIndex];
+    PixmapPtr pixmap = screen->GetScreenPixmap(screen);
+    int cpp = pixmap->drawable.bitsPerPixel / 8;
+    BoxPtr extents = RegionExtents(region);
+    uint32_t max_tile = sizeof (struct drm_xengfx_tile_header) +
+                        XENGFX_COMPRESS_TILE_SIZE * XENGFX_COMPRESS_TILE_SIZE * cpp;
+    int x, y, col_start, col_end, row_start, row_end, count = 0;
+
+    col_start = max(extents->x1, 0) / XENGFX_COMPRESS_TILE_SIZE;
+    row_start = max(extents->y1, 0) / XENGFX_COMPRESS_TILE_SIZE;
+    col_end = min(extents->x2, pixmap->drawable.width);
+    col_end = (col_end + XENGFX_COMPRESS_TILE_SIZE - 1) / XENGFX_COMPRESS_TILE_SIZE;
+    row_end = min(extents->y2, pixmap->drawable.height);
+    row_end = (row_end + XENGFX_COMPRESS_TILE_SIZE - 1) / XENGFX_COMPRESS_TILE_SIZE;
+
+    for (y = row_start; y < row_end; ++y)
+    {
+        for (x = col_start; x < col_end; ++x)
+        {
+            const uint8_t *src;
+            uint8_t *dst = xengfx->scratch;
+            size_t len;
+            BoxRec box;
+            int i;
+
+            box.x1 = x * XENGFX_COMPRESS_TILE_SIZE;
+            box.y1 = y * XENGFX_COMPRESS_TILE_SIZE;
+            box.x2 = min(box.x1 + XENGFX_COMPRESS_TILE_SIZE, pixmap->drawable.width);
+            box.y2 = min(box.y1 + XENGFX_COMPRESS_TILE_SIZE, pixmap->drawable.height);
+
+            if (RegionContainsRect(region, &box) == rgnOUT)
+                continue;
+
+            if (xengfx->staging_used + max_tile > xengfx->staging_bo->size)
+            {
+                if (!xengfx_compress_upload(scrn, count))
+                    return FALSE;
+                count = 0;
+            }
+
+            src = (const uint8_t *) pixmap->devPrivate.ptr +
+                  box.y1 * pixmap->devKind + box.x1 * cpp;
+            len = (box.x2 - box.x1) * cpp;
+            for (i = box.y1; i < box.y2; ++i, src += pixmap->devKind, dst += len)
+                memcpy(dst, src, len);
+
+            xengfx_compress_tile(scrn, &box, cpp);
+            count++;
+        }
+    }
+
+    return !count || xengfx_compress_upload(scrn, count);
+}
+
+
+Bool
+xengfx_compress_init(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct drm_xengfx_upload arg;
+    struct xengfx_bo *bo;
+
+    xengfx->scratch = malloc(XENGFX_COMPRESS_TILE_SIZE * XENGFX_COMPRESS_TILE_SIZE * 4);
+    if (!xengfx->scratch)
+        return FALSE;
+
+    bo = xengfx_drm_create_bo(&xengfx->mode, XENGFX_BO_STAGING,
+                              XENGFX_COMPRESS_STAGING_SIZE, 1, 8,
+                              DRM_XENGFX_GEM_CACHED);
+    if (!bo)
+        goto fail;
+
+    if (xengfx_drm_map_bo(xengfx->fd, bo))
+    {
+        xengfx_drm_destroy_bo(&xengfx->mode, bo);
+        goto fail;
+    }
+
+    // An empty upload tells whether the backend knows about it
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = bo->handle;
+    arg.fb_id = xengfx->mode.fb_id;
+    if (drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_UPLOAD, &arg))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "Tile uploads not supported\n");
+        xengfx_drm_destroy_bo(&xengfx->mode, bo);
+        goto fail;
+    }
+
+    xengfx->staging_bo = bo;
+    xengfx->staging_used = 0;
+    return TRUE;
+
+fail:
+    free(xengfx->scratch);
+    xengfx->scratch = NULL;
+    return FALSE;
+}
+
+
+void
+xengfx_compress_fini(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_stats *stats = &xengfx->stats;
+
+    if (!xengfx->staging_bo)
+        return;
+
+    if (stats->bytes_raw)
+        xf86DrvMsg(scrn->scrnIndex, X_INFO,
+                   "Tile compression sent %llu of %llu bytes (%llu%%)\n",
+                   (unsigned long long) stats->bytes_encoded,
+                   (unsigned long long) stats->bytes_raw,
+                   (unsigned long long) (stats->bytes_encoded * 100 / stats->bytes_raw));
+
+    xengfx_drm_destroy_bo(&xengfx->mode, xengfx->staging_bo);
+    xengfx->staging_bo = NULL;
+    free(xengfx->scratch);
+    xengfx->scratch = NULL;
+}
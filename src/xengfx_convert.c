@@ -0,0 +1,550 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#include <damage.h>
+
+// The screen renders at depth 24 into a cached front buffer and only the
+// damage is converted to the scanout format, right before the backend is
+// told about it. RGB565 halves what the backend has to read. Software
+// gamma is applied on the way, with the ramps of the CRTC showing the pixel,
+// and so is the composited cursor.
+
+// Rows are looked up in chunks before being packed to RGB565
+#define XENGFX_CONVERT_CHUNK    256
+
+typedef void (*xengfx_convert_proc)(void *dst, const uint32_t *src, int n,
+                                    const uint32_t *dither);
+typedef void (*xengfx_convert_lut_proc)(uint32_t *dst, const uint32_t *src, int n,
+                                        const uint32_t *lut);
+
+// 4x4 ordered dither offsets per channel, each row repeated so a row
+// starting at any x can be read as one vector of up to 8 pixels
+static uint32_t xengfx_convert_dither[4][12];
+
+static xengfx_convert_proc xengfx_convert_rgb565;
+static xengfx_convert_lut_proc xengfx_convert_lut;
+
+
+static inline uint32_t
+xengfx_convert_adds(uint32_t p, uint32_t d)
+{
+    uint32_t r = min(((p >> 16) & 0xff) + ((d >> 16) & 0xff), 255u);
+    uint32_t g = min(((p >> 8) & 0xff) + ((d >> 8) & 0xff), 255u);
+    uint32_t b = min((p & 0xff) + (d & 0xff), 255u);
+
+    return r << 16 | g << 8 | b;
+}
+
+
+static void
+xengfx_convert_rgb565_generic(void *dst, const uint32_t *src, int n, const uint32_t *dither)
+{
+    uint16_t *out = dst;
+    int i;
+
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t p = src[i];
+
+        if (dither)
+            p = xengfx_convert_adds(p, dither[i & 3]);
+        out[i] = ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+    }
+}
+
+
+// The lookup table holds each channel value already shifted to where it
+// goes in the output pixel, red, green then blue
+static void
+xengfx_convert_lut_generic(uint32_t *dst, const uint32_t *src, int n, const uint32_t *lut)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        dst[i] = lut[(src[i] >> 16) & 0xff] | lut[256 + ((src[i] >> 8) & 0xff)] |
+                 lut[512 + (src[i] & 0xff)];
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static inline __m128i
+xengfx_convert_pack565_sse2(__m128i p)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001f));
+    __m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
+
+    // Sign extend, so the saturating pack keeps the 16 bits as they are
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+
+__attribute__((target("sse2")))
+static void
+xengfx_convert_rgb565_sse2(void *dst, const uint32_t *src, int n, const uint32_t *dither)
+{
+    uint16_t *out = dst;
+    __m128i d = dither ? _mm_loadu_si128((const __m128i *) dither) : _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m128i a = _mm_adds_epu8(_mm_loadu_si128((const __m128i *) (src + i)), d);
+        __m128i b = _mm_adds_epu8(_mm_loadu_si128((const __m128i *) (src + i + 4)), d);
+
+        _mm_storeu_si128((__m128i *) (out + i),
+                         _mm_packs_epi32(xengfx_convert_pack565_sse2(a),
+                                         xengfx_convert_pack565_sse2(b)));
+    }
+
+    xengfx_convert_rgb565_generic(out + i, src + i, n - i, dither);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i
+xengfx_convert_pack565_avx2(__m256i p)
+{
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xf800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07e0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001f));
+    __m256i v = _mm256_or_si256(_mm256_or_si256(r, g), b);
+
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+
+__attribute__((target("avx2")))
+static void
+xengfx_convert_rgb565_avx2(void *dst, const uint32_t *src, int n, const uint32_t *dither)
+{
+    uint16_t *out = dst;
+    __m256i d = dither ? _mm256_loadu_si256((const __m256i *) dither) : _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m256i a = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *) (src + i)), d);
+        __m256i b = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *) (src + i + 8)), d);
+        __m256i v = _mm256_packs_epi32(xengfx_convert_pack565_avx2(a),
+                                       xengfx_convert_pack565_avx2(b));
+
+        // The pack works within each 128 bits lane
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_permute4x64_epi64(v, 0xd8));
+    }
+
+    xengfx_convert_rgb565_sse2(out + i, src + i, n - i, dither);
+}
+
+
+__attribute__((target("avx2")))
+static void
+xengfx_convert_lut_avx2(uint32_t *dst, const uint32_t *src, int n, const uint32_t *lut)
+{
+    const int *table = (const int *) lut;
+    __m256i mask = _mm256_set1_epi32(0xff);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i r = _mm256_i32gather_epi32(table, _mm256_and_si256(_mm256_srli_epi32(p, 16), mask), 4);
+        __m256i g = _mm256_i32gather_epi32(table + 256,
+                                           _mm256_and_si256(_mm256_srli_epi32(p, 8), mask), 4);
+        __m256i b = _mm256_i32gather_epi32(table + 512, _mm256_and_si256(p, mask), 4);
+
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(_mm256_or_si256(r, g), b));
+    }
+
+    xengfx_convert_lut_generic(dst + i, src + i, n - i, lut);
+}
+#endif
+
+
+static void
+xengfx_convert_setup(ScrnInfoPtr scrn)
+{
+    static const uint8_t bayer[4][4] = {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+    const char *name = "generic";
+    int x, y;
+
+    if (xengfx_convert_rgb565)
+        return;
+
+    // Below the 3 bits dropped from red and blue, the 2 from green
+    for (y = 0; y < 4; ++y)
+    {
+        for (x = 0; x < 12; ++x)
+        {
+            uint32_t t = bayer[y][x & 3];
+
+            xengfx_convert_dither[y][x] = (t >> 1) << 16 | (t >> 2) << 8 | (t >> 1);
+        }
+    }
+
+    xengfx_convert_rgb565 = xengfx_convert_rgb565_generic;
+    xengfx_convert_lut = xengfx_convert_lut_generic;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("avx2"))
+    {
+        xengfx_convert_rgb565 = xengfx_convert_rgb565_avx2;
+        // SSE2 has no gather, lookups stay scalar below AVX2
+        xengfx_convert_lut = xengfx_convert_lut_avx2;
+        name = "AVX2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        xengfx_convert_rgb565 = xengfx_convert_rgb565_sse2;
+        name = "SSE2";
+    }
+#endif
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Scanout conversion uses %s kernels\n", name);
+}
+
+
+// A zeroed scanout buffer for a width x height screen and its framebuffer.
+// The front buffer it goes with is zeroed as well, so both start in sync.
+struct xengfx_bo*
+xengfx_convert_create_scanout(ScrnInfoPtr scrn, int width, int height, uint32_t *fb_id)
+{
+    struct xengfx_drm_mode *drm_mode = &to_xengfx_private(scrn)->mode;
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    struct xengfx_bo *bo;
+
+    xengfx_convert_setup(scrn);
+
+    bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_SCANOUT, width, height,
+                              drm_mode->scanout_cpp * 8, XENGFX_DRM_SCANOUT_FLAGS);
+    if (!bo)
+        return NULL;
+
+    if (xengfx_drm_map_bo(drm_mode->fd, bo))
+        goto fail;
+
+    handles[0] = bo->handle;
+    pitches[0] = bo->pitch;
+    if (drmModeAddFB2(drm_mode->fd, width, height, drm_mode->scanout_format,
+                      handles, pitches, offsets, fb_id, 0))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Backend rejected the %c%c%c%c scanout: %s\n",
+                   drm_mode->scanout_format & 0xff, (drm_mode->scanout_format >> 8) & 0xff,
+                   (drm_mode->scanout_format >> 16) & 0xff, drm_mode->scanout_format >> 24,
+                   strerror(errno));
+        goto fail;
+    }
+
+    return bo;
+
+fail:
+    xengfx_drm_destroy_bo(drm_mode, bo);
+    return NULL;
+}
+
+
+static void
+xengfx_convert_row(struct xengfx_drm_mode *drm_mode, uint8_t *dst, const uint32_t *src, int n,
+                   const uint32_t *lut, const uint32_t *dither)
+{
+    uint32_t tmp[XENGFX_CONVERT_CHUNK];
+    int i, len;
+
+    if (drm_mode->scanout_format == DRM_FORMAT_RGB565)
+    {
+        if (!lut)
+        {
+            xengfx_convert_rgb565(dst, src, n, dither);
+            return;
+        }
+
+        // Chunks are a multiple of the dither period
+        for (i = 0; i < n; i += len)
+        {
+            len = min(n - i, XENGFX_CONVERT_CHUNK);
+            xengfx_convert_lut(tmp, src + i, len, lut);
+            xengfx_convert_rgb565(dst + i * 2, tmp, len, dither);
+        }
+    }
+    else if (lut)
+        xengfx_convert_lut((uint32_t *) dst, src, n, lut);
+    else
+        memcpy(dst, src, n * 4);
+}
+
+
+// n pixels of row y from x, src pointing at the first one
+static void
+xengfx_convert_span(struct xengfx_private *xengfx, const uint32_t *src, int x, int y, int n,
+                    const uint32_t *lut)
+{
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+    const struct xengfx_bo *scanout = drm_mode->scanout_bo;
+    uint8_t *dst = (uint8_t *) scanout->ptr + y * scanout->pitch + x * drm_mode->scanout_cpp;
+    const uint32_t *dither = NULL;
+
+    if (n <= 0)
+        return;
+
+    // Offsets follow the screen position, so partial updates match
+    if (xengfx->dither)
+        dither = &xengfx_convert_dither[y & 3][x & 3];
+    xengfx_convert_row(drm_mode, dst, src, n, lut, dither);
+}
+
+
+static void
+xengfx_convert_boxes(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes, const uint32_t *lut)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    const struct xengfx_bo *front = xengfx->mode.front_bo;
+    const struct xengfx_cursor *cursor = NULL;
+    uint32_t tmp[XENGFX_CONVERT_CHUNK];
+    int i, x, y;
+
+    if (xengfx->composite_cursor && xengfx->cursor.visible)
+        cursor = &xengfx->cursor;
+
+    for (i = 0; i < num_boxes; ++i)
+    {
+        int x1 = max(boxes[i].x1, 0);
+        int y1 = max(boxes[i].y1, 0);
+        int x2 = min(boxes[i].x2, scrn->virtualX);
+        int y2 = min(boxes[i].y2, scrn->virtualY);
+
+        if (x1 >= x2)
+            continue;
+
+        for (y = y1; y < y2; ++y)
+        {
+            const uint32_t *src = (const uint32_t *) ((const uint8_t *) front->ptr +
+                                                      y * front->pitch);
+            int c1 = x2, c2 = x2;
+
+            // The part under the cursor goes through a copy it is blended into
+            if (cursor && y >= cursor->y && y < cursor->y + cursor->height)
+            {
+                c1 = max(x1, cursor->x);
+                c2 = min(x2, cursor->x + cursor->width);
+                if (c1 >= c2)
+                    c1 = c2 = x2;
+            }
+
+            xengfx_convert_span(xengfx, src + x1, x1, y, c1 - x1, lut);
+            for (x = c1; x < c2; x += XENGFX_CONVERT_CHUNK)
+            {
+                int n = min(c2 - x, XENGFX_CONVERT_CHUNK);
+
+                memcpy(tmp, src + x, n * sizeof (*tmp));
+                xengfx_cursor_blend(cursor, tmp, x, y, n);
+                xengfx_convert_span(xengfx, tmp, x, y, n, lut);
+            }
+            xengfx_convert_span(xengfx, src + c2, c2, y, x2 - c2, lut);
+        }
+    }
+}
+
+
+// Bring the damaged part of the scanout buffer up to date with the front
+void
+xengfx_convert_region(ScrnInfoPtr scrn, RegionPtr region)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    RegionRec rest, part;
+    int i;
+
+    if (!to_xengfx_private(scrn)->soft_gamma)
+    {
+        xengfx_convert_boxes(scrn, RegionRects(region), RegionNumRects(region), NULL);
+        return;
+    }
+
+    RegionNull(&rest);
+    RegionNull(&part);
+    RegionCopy(&rest, region);
+
+    // Where CRTCs overlap, the first one's ramps win
+    for (i = 0; i < config->num_crtc && RegionNotEmpty(&rest); ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+        if (!crtc->enabled || !xengfx_crtc->lut || xengfx_crtc->rotate_fb_id)
+            continue;
+
+        RegionReset(&part, &crtc->bounds);
+        RegionIntersect(&part, &part, &rest);
+        xengfx_convert_boxes(scrn, RegionRects(&part), RegionNumRects(&part), xengfx_crtc->lut);
+        RegionSubtract(&rest, &rest, &part);
+    }
+
+    xengfx_convert_boxes(scrn, RegionRects(&rest), RegionNumRects(&rest), NULL);
+
+    RegionUninit(&part);
+    RegionUninit(&rest);
+}
+
+
+// Have the next flush convert everything the CRTC shows again
+void
+xengfx_convert_damage_crtc(xf86CrtcPtr crtc)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(crtc->scrn);
+    RegionPtr damage;
+    RegionRec region;
+
+    if (!xengfx->damage || !crtc->enabled)
+        return;
+
+    // Same pixels in the front buffer, the tile hashes must not drop them
+    xengfx_tile_invalidate(crtc->scrn, &crtc->bounds, 1);
+
+    damage = DamageRegion(xengfx->damage);
+    RegionInit(&region, &crtc->bounds, 1);
+    RegionUnion(damage, damage, &region);
+    RegionUninit(&region);
+}
+
+
+// Software gamma: the ramps become a lookup table in the scanout format
+void
+xengfx_convert_set_gamma(xf86CrtcPtr crtc, const uint16_t *red, const uint16_t *green,
+                         const uint16_t *blue, int size)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    const uint16_t *ramps[3];
+    int c, i;
+
+    if (size < 2)
+        return;
+
+    if (!xengfx_crtc->lut)
+    {
+        xengfx_crtc->lut = malloc(3 * 256 * sizeof (*xengfx_crtc->lut));
+        if (!xengfx_crtc->lut)
+            return;
+    }
+
+    ramps[0] = red;
+    ramps[1] = green;
+    ramps[2] = blue;
+    for (c = 0; c < 3; ++c)
+    {
+        for (i = 0; i < 256; ++i)
+        {
+            uint32_t v = ramps[c][i * (size - 1) / 255] >> 8;
+
+            xengfx_crtc->lut[c * 256 + i] = v << ((2 - c) * 8);
+        }
+    }
+
+    xengfx_convert_damage_crtc(crtc);
+}
+
+
+// Whether the CRTC's ramps leave every pixel as it is
+Bool
+xengfx_convert_gamma_is_identity(xf86CrtcPtr crtc)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    int c, i;
+
+    if (!xengfx_crtc->lut)
+        return TRUE;
+
+    for (c = 0; c < 3; ++c)
+        for (i = 0; i < 256; ++i)
+            if (xengfx_crtc->lut[c * 256 + i] != (uint32_t) i << ((2 - c) * 8))
+                return FALSE;
+
+    return TRUE;
+}
+
+
+// Software gamma keeps the native scanout until a ramp changes pixels.
+// Then the whole screen is converted into a new XRGB8888 scanout buffer
+// that becomes the one CRTCs show, the caller moves them over and removes
+// the old framebuffer it gets back.
+Bool
+xengfx_convert_start(ScrnInfoPtr scrn, uint32_t *old_fb_id)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+    RegionRec region;
+    BoxRec box;
+    uint32_t fb_id;
+
+    drm_mode->scanout_format = DRM_FORMAT_XRGB8888;
+    drm_mode->scanout_cpp = 4;
+    drm_mode->scanout_bo = xengfx_convert_create_scanout(scrn, scrn->virtualX,
+                                                         scrn->virtualY, &fb_id);
+    if (!drm_mode->scanout_bo)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Software gamma disabled\n");
+        drm_mode->scanout_format = 0;
+        xengfx->soft_gamma = FALSE;
+        return FALSE;
+    }
+
+    // Fills recorded so far land in the front buffer before it is read
+    if (xengfx->cmd_bo)
+        xengfx_cmd_submit(scrn);
+
+    // Moves and compressed tiles would hand the backend front buffer pixels
+    xengfx->copy_moves = FALSE;
+    xengfx_compress_fini(scrn);
+    xengfx->compression = XENGFX_COMPRESSION_NONE;
+
+    box.x1 = box.y1 = 0;
+    box.x2 = scrn->virtualX;
+    box.y2 = scrn->virtualY;
+    RegionInit(&region, &box, 1);
+    xengfx_convert_region(scrn, &region);
+    RegionUninit(&region);
+
+    *old_fb_id = drm_mode->fb_id;
+    drm_mode->fb_id = fb_id;
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Scanout converted to XRGB8888 for software gamma\n");
+    return TRUE;
+}
@@ -27,7 +27,10 @@
  *
  **************************************************************************/
 
+#include <string.h>
+
 #include "xengfx_driver.h"
+#include "xengfx_drm.h"
 
 static void
 xengfx_crtc_dpms(xf86CrtcPtr crtc, int mode)
@@ -36,6 +39,30 @@ xengfx_crtc_dpms(xf86CrtcPtr crtc, int mode)
 }
 
 
+// Forget what was committed, the next commit sends everything again
+void
+xengfx_crtc_invalidate(xf86CrtcPtr crtc)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+    xengfx_crtc->committed.valid = FALSE;
+    xengfx_crtc->committed.gamma_valid = FALSE;
+}
+
+
+static Bool
+xengfx_crtc_is_committed(struct xengfx_crtc *xengfx_crtc, uint32_t fb_id, int x, int y,
+                         uint32_t *output_ids, int output_count)
+{
+    struct xengfx_crtc_state *state = &xengfx_crtc->committed;
+
+    return state->valid && state->fb_id == fb_id && state->x == x && state->y == y &&
+           !memcmp(&state->kmode, &xengfx_crtc->kmode, sizeof (state->kmode)) &&
+           state->output_count == output_count &&
+           !memcmp(state->output_ids, output_ids, output_count * sizeof (*output_ids));
+}
+
+
 static Bool
 xengfx_crtc_apply(xf86CrtcPtr crtc)
 {
@@ -43,12 +70,13 @@ xengfx_crtc_apply(xf86CrtcPtr crtc)
     xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
     struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
-    int i, fb_id, ret = FALSE;
+    struct xengfx_crtc_state *state = &xengfx_crtc->committed;
+    int i, fb_id, x, y, ret = FALSE;
 
     uint32_t *output_ids;
     int output_count = 0;
 
-    output_ids = calloc(sizeof (uint32_t), xf86_config->num_output);
+    output_ids = calloc(sizeof (uint32_t), xf86_config->num_output + 1);
     if (!output_ids)
         return FALSE;
 
@@ -64,26 +92,59 @@ xengfx_crtc_apply(xf86CrtcPtr crtc)
     }
 
     if (!xf86CrtcRotate(crtc))
+    {
+        free(output_ids);
         return FALSE;
+    }
 
+    // Only sent when the ramp changed
     crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
                            crtc->gamma_blue, crtc->gamma_size);
 
+    // Rotated and scaled CRTCs scan out their shadow
     fb_id = drm_mode->fb_id;
+    x = crtc->x;
+    y = crtc->y;
+    if (xengfx_crtc->rotate_fb_id)
+    {
+        fb_id = xengfx_crtc->rotate_fb_id;
+        x = y = 0;
+    }
+
+    if (xengfx_crtc_is_committed(xengfx_crtc, fb_id, x, y, output_ids, output_count))
+    {
+        free(output_ids);
+        return TRUE;
+    }
+
     ret = drmModeSetCrtc(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
-                         fb_id, crtc->x, crtc->y, output_ids, output_count,
+                         fb_id, x, y, output_ids, output_count,
                          &xengfx_crtc->kmode);
 
     if (ret)
     {
         xf86DrvMsg(scrn->scrnIndex, X_ERROR, "failed to set mode : %s\n",
                    strerror(-ret));
-        ret = FALSE;
+        // The kernel state is unknown now
+        xengfx_crtc_invalidate(crtc);
+        free(output_ids);
+        return FALSE;
     }
-    else
-        ret = TRUE;
 
-    return ret;
+    free(state->output_ids);
+    state->valid = TRUE;
+    state->fb_id = fb_id;
+    state->x = x;
+    state->y = y;
+    state->kmode = xengfx_crtc->kmode;
+    state->output_ids = output_ids;
+    state->output_count = output_count;
+
+    // The ramps now apply to a different part of the screen
+    if (xengfx_crtc->lut)
+        xengfx_convert_damage_crtc(crtc);
+
+    return TRUE;
 }
 
 
@@ -151,9 +212,19 @@ xengfx_crtc_set_cursor_colors(xf86CrtcPtr crtc, int bg, int fg)
 static void
 xengfx_crtc_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
 {
+    struct xengfx_private *xengfx = to_xengfx_private(crtc->scrn);
     struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
 
+    // Batched with the next flush
+    if (xengfx->cmd_bo)
+    {
+        xengfx_crtc->cursor_x = x;
+        xengfx_crtc->cursor_y = y;
+        xengfx_crtc->cursor_moved = TRUE;
+        return;
+    }
+
     drmModeMoveCursor(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id, x, y);
 }
 
@@ -163,9 +234,12 @@ xengfx_crtc_show_cursor(xf86CrtcPtr crtc)
 {
     struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
-    uint32_t handle = xengfx_crtc->cursor_bo->handle;
 
-    drmModeSetCursor(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id, handle, 64, 64);
+    if (!xengfx_crtc->cursor_bo)
+        return;
+
+    drmModeSetCursor(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
+                     xengfx_crtc->cursor_bo->handle, 64, 64);
 }
 
 
@@ -179,32 +253,18 @@ xengfx_crtc_hide_cursor(xf86CrtcPtr crtc)
 }
 
 
+// The image is already 64x64 ARGB, a visible cursor picks it up as soon
+// as it is written
 static void
 xengfx_crtc_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
 {
-#if 0
     struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
-    uint32_t handle = xengfx_crtc->cursor_bo->handle; // assume cursor is already mapped
-    uint32_t *ptr = (uint32_t *) xengfx_crtc->cursor_bo->ptr;
-    int i, ret;
+    struct xengfx_bo *bo = xengfx_crtc->cursor_bo;
 
-    for (i = 0; i < 64*64; ++i)
-        ptr[i] = image[i];
-
-    ret = drmModeSetCursor(xengfx_crtc->drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
-                           handle, 64, 64);
-
-    // if fail, fallback to SW cursor
-    if (ret)
-    {
-        xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-        xf86CursorInfoPtr cursor_info = xf86_config->cursor_info;
-
-        cursor_info->MaxWidth = cursor_info->MaxHeight = 0;
-    }
-#endif
+    if (!bo || (!bo->ptr && xengfx_drm_map_bo(xengfx_crtc->drm_mode->fd, bo)))
+        return;
 
-    // We do not support HW cursor for the moment
+    memcpy(bo->ptr, image, 64 * 64 * sizeof (CARD32));
 }
 
 
@@ -216,7 +276,10 @@ xengfx_crtc_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
     struct xengfx_drm_mode *mode = xengfx_crtc->drm_mode;
     int ret;
 
-    xengfx_crtc->rotate_bo = xengfx_drm_create_bo(mode->fd, width, height, scrn->bitsPerPixel);
+    xengfx_crtc->rotate_bo = xengfx_drm_create_bo(mode, XENGFX_BO_ROTATION,
+                                                  width, height, scrn->bitsPerPixel,
+                                                  DRM_XENGFX_GEM_WC | DRM_XENGFX_GEM_PITCH_64 |
+                                                  DRM_XENGFX_GEM_SCANOUT);
     if (!xengfx_crtc->rotate_bo)
     {
         xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR, "Couldn't allocate shadow memory for rotated CRTC.\n");
@@ -229,11 +292,23 @@ xengfx_crtc_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
     if (ret)
     {
         ErrorF("failed to rotate fb.\n");
-        xengfx_drm_destroy_bo(mode->fd, xengfx_crtc->rotate_bo);
+        xengfx_drm_destroy_bo(mode, xengfx_crtc->rotate_bo);
+        xengfx_crtc->rotate_bo = NULL;
+        return NULL;
+    }
+
+    // Redrawn by xf86Rotate through the shadow pixmap
+    if (xengfx_drm_map_bo(mode->fd, xengfx_crtc->rotate_bo))
+    {
+        drmModeRmFB(mode->fd, xengfx_crtc->rotate_fb_id);
+        xengfx_crtc->rotate_fb_id = 0;
+        xengfx_drm_destroy_bo(mode, xengfx_crtc->rotate_bo);
+        xengfx_crtc->rotate_bo = NULL;
         return NULL;
     }
 
     xengfx_crtc->rotate_pitch = xengfx_crtc->rotate_bo->pitch;
+    xengfx_capture_invalidate(scrn);
     return xengfx_crtc->rotate_bo;
 }
 
@@ -262,7 +337,8 @@ xengfx_crtc_shadow_create(xf86CrtcPtr crtc,  void *data, int width, int height)
     }
 
     rotate_pixmap = GetScratchPixmapHeader(scrn->pScreen, width, height, scrn->depth,
-                                           scrn->bitsPerPixel, xengfx_crtc->rotate_pitch, NULL);
+                                           scrn->bitsPerPixel, xengfx_crtc->rotate_pitch,
+                                           xengfx_crtc->rotate_bo->ptr);
     if (!rotate_pixmap)
     {
         xf86DrvMsg(scrn->scrnIndex, X_ERROR, "Couldn't allocate shadow memory for rotated CRTC.\n");
@@ -289,20 +365,80 @@ xengfx_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data
         drmModeRmFB(mode->fd, xengfx_crtc->rotate_fb_id);
         xengfx_crtc->rotate_fb_id = 0;
 
-        xengfx_drm_destroy_bo(mode->fd, xengfx_crtc->rotate_bo);
+        xengfx_drm_destroy_bo(mode, xengfx_crtc->rotate_bo);
         xengfx_crtc->rotate_bo = NULL;
+        xengfx_capture_invalidate(crtc->scrn);
     }
 }
 
+// The first ramp that is not identity moves every CRTC showing the front
+// buffer over to the converted scanout. Called from within a commit, the
+// CRTC being committed may be applied here already.
+static Bool
+xengfx_crtc_start_conversion(ScrnInfoPtr scrn)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    struct xengfx_drm_mode *drm_mode = &to_xengfx_private(scrn)->mode;
+    uint32_t old_fb_id;
+    int i;
+
+    // Retried on the next commit
+    if (!scrn->vtSema || !drm_mode->fb_id)
+        return FALSE;
+
+    if (!xengfx_convert_start(scrn, &old_fb_id))
+        return FALSE;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr other = config->crtc[i];
+        struct xengfx_crtc *xengfx_crtc = other->driver_private;
+
+        if (other->enabled && xengfx_crtc->committed.valid &&
+            xengfx_crtc->committed.fb_id == old_fb_id)
+            xengfx_crtc_apply(other);
+    }
+
+    drmModeRmFB(drm_mode->fd, old_fb_id);
+    return TRUE;
+}
+
+
 static void
 xengfx_crtc_gamma_set(xf86CrtcPtr crtc, uint16_t *red, uint16_t *green,
                       uint16_t *blue, int size)
 {
     struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
+    struct xengfx_crtc_state *state = &xengfx_crtc->committed;
+    uint32_t hash = 2166136261u;
+    int i;
+
+    // FNV-1a over the three ramps
+    for (i = 0; i < size; ++i)
+    {
+        hash = (hash ^ red[i]) * 16777619u;
+        hash = (hash ^ green[i]) * 16777619u;
+        hash = (hash ^ blue[i]) * 16777619u;
+    }
 
-    drmModeCrtcSetGamma(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
-                        size, red, green, blue);
+    if (state->gamma_valid && state->gamma_hash == hash)
+        return;
+
+    // The kernel ramps stay untouched, the flush applies them instead
+    if (to_xengfx_private(crtc->scrn)->soft_gamma)
+    {
+        xengfx_convert_set_gamma(crtc, red, green, blue, size);
+        state->gamma_valid = TRUE;
+        state->gamma_hash = hash;
+        if (!drm_mode->scanout_format && !xengfx_convert_gamma_is_identity(crtc))
+            state->gamma_valid = xengfx_crtc_start_conversion(crtc->scrn);
+        return;
+    }
+
+    state->gamma_valid = !drmModeCrtcSetGamma(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
+                                              size, red, green, blue);
+    state->gamma_hash = hash;
 }
 
 
@@ -314,6 +450,8 @@ xengfx_crtc_destroy(xf86CrtcPtr crtc)
     xengfx_crtc_hide_cursor(crtc);
     // Unmap cursor
 
+    free(xengfx_crtc->committed.output_ids);
+    free(xengfx_crtc->lut);
     free(xengfx_crtc);
     crtc->driver_private = NULL;
 }
@@ -350,16 +488,59 @@ xengfx_crtc_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode, int num)
     xengfx_crtc = xnfcalloc(sizeof (struct xengfx_crtc), 1);
     xengfx_crtc->mode_crtc = drmModeGetCrtc(drm_mode->fd, drm_mode->mode_res->crtcs[num]);
     xengfx_crtc->drm_mode = drm_mode;
+    xengfx_crtc->pipe = num;
     crtc->driver_private = xengfx_crtc;
 }
 
+
+// Whether the backend applies gamma ramps on every CRTC
+Bool
+xengfx_crtc_has_gamma(ScrnInfoPtr scrn)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        struct xengfx_crtc *xengfx_crtc = config->crtc[i]->driver_private;
+
+        if (!xengfx_crtc->mode_crtc || !xengfx_crtc->mode_crtc->gamma_size)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+// Whether a rotated or scaled CRTC scans out a shadow, which neither
+// dropped moves and fills nor the converted copy ever reach
+Bool
+xengfx_crtc_has_shadow(ScrnInfoPtr scrn)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        struct xengfx_crtc *xengfx_crtc = config->crtc[i]->driver_private;
+
+        if (config->crtc[i]->enabled && xengfx_crtc->rotate_fb_id)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
 Bool
 xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height)
 {
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
     xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
     struct xengfx_crtc *xengfx_crtc = xf86_config->crtc[0]->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
     struct xengfx_bo *old_front = NULL;
+    struct xengfx_bo *old_scanout = drm_mode->scanout_bo;
     Bool ret;
     ScreenPtr screen = screenInfo.screens[scrn->scrnIndex];
     PixmapPtr ppix = screen->GetScreenPixmap(screen);
@@ -371,13 +552,26 @@ xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height)
     if (scrn->virtualX == width && scrn->virtualY == height)
         return TRUE;
 
+    // The old front buffer stays around until the new one is scanned out
+    if (!xengfx_drm_budget_check(drm_mode, xengfx_drm_budget_front_size(drm_mode, width, height)))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+                   "Not enough video memory for a %dx%d screen\n", width, height);
+        return FALSE;
+    }
+
+    // Pending damage and commands refer to the current framebuffer
+    xengfx_flush(scrn);
+
     old_width = scrn->virtualX;
     old_height = scrn->virtualY;
     old_pitch = drm_mode->front_bo->pitch;
     old_fb_id = drm_mode->fb_id;
     old_front = drm_mode->front_bo;
 
-    drm_mode->front_bo = xengfx_drm_create_bo(drm_mode->fd, width, height, scrn->bitsPerPixel);
+    drm_mode->front_bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_FRONT,
+                                              width, height, scrn->bitsPerPixel,
+                                              xengfx_drm_front_flags(scrn));
     if (!drm_mode->front_bo)
         goto fail;
 
@@ -387,8 +581,15 @@ xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height)
     scrn->virtualY = height;
     scrn->displayWidth = pitch / cpp;
 
-    ret = drmModeAddFB(drm_mode->fd, width, height, scrn->depth, scrn->bitsPerPixel,
-                       pitch, drm_mode->front_bo->handle, &drm_mode->fb_id);
+    if (drm_mode->scanout_format)
+    {
+        drm_mode->scanout_bo = xengfx_convert_create_scanout(scrn, width, height,
+                                                             &drm_mode->fb_id);
+        ret = !drm_mode->scanout_bo;
+    }
+    else
+        ret = drmModeAddFB(drm_mode->fd, width, height, scrn->depth, scrn->bitsPerPixel,
+                           pitch, drm_mode->front_bo->handle, &drm_mode->fb_id);
     if (ret)
         goto fail;
 
@@ -397,6 +598,7 @@ xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height)
         goto fail;
 
     screen->ModifyPixmapHeader(ppix, width, height, -1, -1, pitch, new_pixels);
+    xengfx_pixmap_set_bo(ppix, drm_mode->front_bo);
 
     for (i = 0; i < xf86_config->num_crtc; ++i)
     {
@@ -412,15 +614,28 @@ xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height)
     if (old_fb_id)
     {
         drmModeRmFB(drm_mode->fd, old_fb_id);
-        xengfx_drm_destroy_bo(drm_mode->fd, old_front);
+        xengfx_drm_destroy_bo(drm_mode, old_front);
+        if (old_scanout)
+            xengfx_drm_destroy_bo(drm_mode, old_scanout);
     }
 
+    if (xengfx->tile_table)
+        xengfx_tile_resize(scrn, width, height);
+    if (drm_mode->dirty_bo)
+        xengfx_drm_create_dirty_bo(drm_mode, width, height);
+
+    xengfx_capture_invalidate(scrn);
     return TRUE;
 
 fail:
+    if (drm_mode->fb_id != old_fb_id)
+        drmModeRmFB(drm_mode->fd, drm_mode->fb_id);
     if (drm_mode->front_bo)
-        xengfx_drm_destroy_bo(drm_mode->fd, drm_mode->front_bo);
+        xengfx_drm_destroy_bo(drm_mode, drm_mode->front_bo);
     drm_mode->front_bo = old_front;
+    if (drm_mode->scanout_bo != old_scanout)
+        xengfx_drm_destroy_bo(drm_mode, drm_mode->scanout_bo);
+    drm_mode->scanout_bo = old_scanout;
     scrn->virtualX = old_width;
     scrn->virtualY = old_height;
     scrn->displayWidth = old_pitch / cpp;
@@ -0,0 +1,347 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+
+#include <mipointer.h>
+#include <mipointrst.h>
+#include <cursorstr.h>
+#include <servermd.h>
+
+// The cursor is blended into the converted scanout only, while the damage
+// is converted. Neither the front buffer nor the clients ever see it, and
+// a motion only converts again the rectangles it left and entered.
+
+
+static void
+xengfx_cursor_damage(struct xengfx_cursor *cursor)
+{
+    BoxRec box;
+    RegionRec region;
+
+    if (!cursor->visible)
+        return;
+
+    box.x1 = cursor->x;
+    box.y1 = cursor->y;
+    box.x2 = cursor->x + cursor->width;
+    box.y2 = cursor->y + cursor->height;
+
+    RegionInit(&region, &box, 1);
+    RegionUnion(&cursor->damage, &cursor->damage, &region);
+    RegionUninit(&region);
+}
+
+
+// Premultiplied ARGB copy of the cursor image, core cursors included
+static Bool
+xengfx_cursor_load(struct xengfx_cursor *cursor, CursorPtr pCursor)
+{
+    CursorBitsPtr bits = pCursor->bits;
+    int width = bits->width, height = bits->height;
+    int stride = BitmapBytePad(width);
+    uint32_t fg, bg, *image;
+    int x, y;
+
+    if (cursor->image_size < width * height)
+    {
+        image = realloc(cursor->image, width * height * sizeof (*image));
+        if (!image)
+            return FALSE;
+        cursor->image = image;
+        cursor->image_size = width * height;
+    }
+
+    cursor->width = width;
+    cursor->height = height;
+    cursor->xhot = bits->xhot;
+    cursor->yhot = bits->yhot;
+
+    if (bits->argb)
+    {
+        memcpy(cursor->image, bits->argb, width * height * sizeof (*cursor->image));
+        return TRUE;
+    }
+
+    fg = 0xff000000 | (pCursor->foreRed >> 8) << 16 | (pCursor->foreGreen >> 8) << 8 |
+         (pCursor->foreBlue >> 8);
+    bg = 0xff000000 | (pCursor->backRed >> 8) << 16 | (pCursor->backGreen >> 8) << 8 |
+         (pCursor->backBlue >> 8);
+
+    for (y = 0; y < height; ++y)
+    {
+        const uint8_t *source = bits->source + y * stride;
+        const uint8_t *mask = bits->mask + y * stride;
+
+        for (x = 0; x < width; ++x)
+        {
+            uint8_t bit = screenInfo.bitmapBitOrder == LSBFirst ? 1 << (x & 7) : 0x80 >> (x & 7);
+
+            if (!(mask[x / 8] & bit))
+                cursor->image[y * width + x] = 0;
+            else
+                cursor->image[y * width + x] = source[x / 8] & bit ? fg : bg;
+        }
+    }
+
+    return TRUE;
+}
+
+
+// miDC realizes every cursor and keeps its per-device state, so that it
+// can take over at any time
+
+static Bool
+xengfx_cursor_realize(DeviceIntPtr dev, ScreenPtr screen, CursorPtr pCursor)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    return cursor->mi->RealizeCursor(dev, screen, pCursor);
+}
+
+
+static Bool
+xengfx_cursor_unrealize(DeviceIntPtr dev, ScreenPtr screen, CursorPtr pCursor)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    return cursor->mi->UnrealizeCursor(dev, screen, pCursor);
+}
+
+
+static void
+xengfx_cursor_set(DeviceIntPtr dev, ScreenPtr screen, CursorPtr pCursor, int x, int y)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    cursor->dev = dev;
+    cursor->current = pCursor;
+    cursor->pointer_x = x;
+    cursor->pointer_y = y;
+
+    if (cursor->software)
+    {
+        cursor->mi->SetCursor(dev, screen, pCursor, x, y);
+        return;
+    }
+
+    // Whatever showed the old one has to be converted again
+    xengfx_cursor_damage(cursor);
+    cursor->visible = pCursor && xengfx_cursor_load(cursor, pCursor);
+    cursor->x = x - cursor->xhot;
+    cursor->y = y - cursor->yhot;
+    xengfx_cursor_damage(cursor);
+}
+
+
+static void
+xengfx_cursor_move(DeviceIntPtr dev, ScreenPtr screen, int x, int y)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    cursor->dev = dev;
+    cursor->pointer_x = x;
+    cursor->pointer_y = y;
+
+    if (cursor->software)
+    {
+        cursor->mi->MoveCursor(dev, screen, x, y);
+        return;
+    }
+
+    if (cursor->x == x - cursor->xhot && cursor->y == y - cursor->yhot)
+        return;
+
+    xengfx_cursor_damage(cursor);
+    cursor->x = x - cursor->xhot;
+    cursor->y = y - cursor->yhot;
+    xengfx_cursor_damage(cursor);
+}
+
+
+// Hands the cursor over to miDC, which draws it into the front buffer
+static void
+xengfx_cursor_to_software(struct xengfx_cursor *cursor, ScreenPtr screen)
+{
+    xengfx_cursor_damage(cursor);
+    cursor->visible = FALSE;
+    cursor->software = TRUE;
+    if (cursor->dev)
+        cursor->mi->SetCursor(cursor->dev, screen, cursor->current,
+                              cursor->pointer_x, cursor->pointer_y);
+}
+
+
+// Only one sprite is blended. With a second master pointer miDC draws
+// every one of them, and keeps doing so after it goes away since only
+// miDC knows what the remaining sprites show.
+static Bool
+xengfx_cursor_device_init(DeviceIntPtr dev, ScreenPtr screen)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    if (!cursor->mi->DeviceCursorInitialize(dev, screen))
+        return FALSE;
+
+    if (++cursor->num_devices > 1 && !cursor->shared)
+    {
+        xf86DrvMsg(xf86ScreenToScrn(screen)->scrnIndex, X_INFO,
+                   "Several pointers, cursors drawn in software\n");
+        cursor->shared = TRUE;
+        if (!cursor->software)
+            xengfx_cursor_to_software(cursor, screen);
+    }
+
+    return TRUE;
+}
+
+
+static void
+xengfx_cursor_device_cleanup(DeviceIntPtr dev, ScreenPtr screen)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+
+    if (cursor->dev == dev)
+    {
+        cursor->dev = NULL;
+        cursor->current = NULL;
+    }
+    cursor->num_devices--;
+    cursor->mi->DeviceCursorCleanup(dev, screen);
+}
+
+
+static miPointerSpriteFuncRec xengfx_cursor_sprite_funcs = {
+    xengfx_cursor_realize,
+    xengfx_cursor_unrealize,
+    xengfx_cursor_set,
+    xengfx_cursor_move,
+    xengfx_cursor_device_init,
+    xengfx_cursor_device_cleanup,
+};
+
+
+// Goes on top of miDCInitialize, in place of its sprite functions. The
+// sprite is only updated from the main loop, never from the input signal
+// handler. Without a converted scanout there is nothing to blend into.
+Bool
+xengfx_cursor_init(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    struct xengfx_cursor *cursor = &xengfx->cursor;
+    miPointerScreenPtr pointer = dixLookupPrivate(&screen->devPrivates, miPointerScreenKey);
+
+    if (!xengfx->mode.scanout_bo || !pointer)
+        return FALSE;
+
+    memset(cursor, 0, sizeof (*cursor));
+    RegionNull(&cursor->damage);
+
+    cursor->mi = pointer->spriteFuncs;
+    pointer->spriteFuncs = &xengfx_cursor_sprite_funcs;
+
+    return TRUE;
+}
+
+
+// Rotated and scaled CRTCs scan out a shadow the converted copy never
+// reaches, miDC draws the cursor into the front buffer while one does
+void
+xengfx_cursor_update(ScrnInfoPtr scrn)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(scrn)->cursor;
+    Bool software = cursor->shared || xengfx_crtc_has_shadow(scrn);
+
+    if (cursor->software == software)
+        return;
+
+    if (software)
+    {
+        xengfx_cursor_to_software(cursor, scrn->pScreen);
+        return;
+    }
+
+    if (cursor->dev)
+        cursor->mi->SetCursor(cursor->dev, scrn->pScreen, NullCursor,
+                              cursor->pointer_x, cursor->pointer_y);
+    cursor->software = FALSE;
+    if (cursor->dev)
+        xengfx_cursor_set(cursor->dev, scrn->pScreen, cursor->current,
+                          cursor->pointer_x, cursor->pointer_y);
+}
+
+
+void
+xengfx_cursor_fini(ScreenPtr screen)
+{
+    struct xengfx_cursor *cursor = &to_xengfx_private(xf86ScreenToScrn(screen))->cursor;
+    miPointerScreenPtr pointer = dixLookupPrivate(&screen->devPrivates, miPointerScreenKey);
+
+    if (pointer)
+        pointer->spriteFuncs = cursor->mi;
+
+    RegionUninit(&cursor->damage);
+    free(cursor->image);
+    memset(cursor, 0, sizeof (*cursor));
+}
+
+
+// Pixels [x, x + n) of row y, all under the cursor, get it blended over
+void
+xengfx_cursor_blend(const struct xengfx_cursor *cursor, uint32_t *dst, int x, int y, int n)
+{
+    const uint32_t *src = cursor->image + (y - cursor->y) * cursor->width + (x - cursor->x);
+    int i, c;
+
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t a = src[i] >> 24;
+        uint32_t out = 0;
+
+        if (a == 0)
+            continue;
+        if (a == 0xff)
+        {
+            dst[i] = src[i];
+            continue;
+        }
+
+        // src + dst * (255 - a) / 255, rounded
+        for (c = 0; c < 24; c += 8)
+        {
+            uint32_t t = ((dst[i] >> c) & 0xff) * (0xff - a) + 0x80;
+
+            out |= min(((src[i] >> c) & 0xff) + ((t + (t >> 8)) >> 8), 0xffu) << c;
+        }
+        dst[i] = out;
+    }
+}
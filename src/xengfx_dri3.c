@@ -0,0 +1,161 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include "xengfx_driver.h"
+
+#ifdef HAVE_DRI3_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dri3.h>
+
+
+static int
+xengfx_dri3_open(ScreenPtr screen, RRProviderPtr provider, int *out)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    drm_magic_t magic;
+    char *name;
+    int fd;
+
+    name = drmGetDeviceNameFromFd(xengfx->fd);
+    if (!name)
+        return BadAlloc;
+
+    fd = open(name, O_RDWR | O_CLOEXEC);
+    free(name);
+    if (fd < 0)
+        return BadAlloc;
+
+    // Render nodes do not need authentication, primary nodes do
+    if (drmGetMagic(fd, &magic) == 0 && drmAuthMagic(xengfx->fd, magic))
+    {
+        close(fd);
+        return BadMatch;
+    }
+
+    *out = fd;
+    return Success;
+}
+
+
+static PixmapPtr
+xengfx_dri3_pixmap_from_fd(ScreenPtr screen, int fd,
+                           CARD16 width, CARD16 height, CARD16 stride,
+                           CARD8 depth, CARD8 bpp)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_bo *bo;
+    PixmapPtr pixmap;
+    off_t size;
+
+    if (!width || !height || depth < 8 || (bpp != 16 && bpp != 32))
+        return NULL;
+    if (stride < width * bpp / 8)
+        return NULL;
+
+    // Older kernels cannot report the dma-buf size, trust the client then
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0)
+        size = (off_t) height * stride;
+    else if (size < (off_t) height * stride)
+        return NULL;
+
+    bo = xengfx_drm_import_bo(&xengfx->mode, fd, size, stride);
+    if (!bo)
+        return NULL;
+    // One of ours, its size is known
+    if (bo->size < (uint64_t) height * stride)
+        goto fail_bo;
+
+    if (xengfx_drm_map_bo(xengfx->fd, bo))
+        goto fail_bo;
+
+    pixmap = screen->CreatePixmap(screen, 0, 0, depth, 0);
+    if (!pixmap)
+        goto fail_bo;
+
+    if (!screen->ModifyPixmapHeader(pixmap, width, height, 0, bpp, stride, bo->ptr))
+    {
+        screen->DestroyPixmap(pixmap);
+        goto fail_bo;
+    }
+
+    xengfx_pixmap_set_bo(pixmap, bo);
+    return pixmap;
+
+fail_bo:
+    xengfx_drm_destroy_bo(&xengfx->mode, bo);
+    return NULL;
+}
+
+
+static int
+xengfx_dri3_fd_from_pixmap(ScreenPtr screen, PixmapPtr pixmap,
+                           CARD16 *stride, CARD32 *size)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_bo *bo;
+    int fd;
+
+    // Pixmaps in system memory cannot be shared without a copy
+    bo = xengfx_pixmap_get_bo(pixmap);
+    if (!bo || bo->pitch > UINT16_MAX || bo->size > UINT32_MAX)
+        return -1;
+
+    fd = xengfx_drm_export_bo(&xengfx->mode, bo, TRUE);
+    if (fd < 0)
+        return -1;
+
+    *stride = bo->pitch;
+    *size = bo->size;
+    return fd;
+}
+
+
+static dri3_screen_info_rec xengfx_dri3_screen_info = {
+    .version = 0,
+
+    .open = xengfx_dri3_open,
+    .pixmap_from_fd = xengfx_dri3_pixmap_from_fd,
+    .fd_from_pixmap = xengfx_dri3_fd_from_pixmap,
+};
+
+
+Bool
+xengfx_dri3_screen_init(ScreenPtr screen)
+{
+    return dri3_screen_init(screen, &xengfx_dri3_screen_info);
+}
+
+#endif /* HAVE_DRI3_H */
@@ -47,9 +47,45 @@ static const struct pci_id_match xengfx_device_match[] =
     }
 };
 
+typedef enum
+{
+    OPTION_PAGE_FLIP,
+    OPTION_CAPTURE_SOCKET,
+    OPTION_COPY_MOVES,
+    OPTION_COMMAND_BUFFER,
+    OPTION_TILE_HASH,
+    OPTION_DIRTY_BITMAP,
+    OPTION_COMPRESSION,
+    OPTION_FRONT_MAPPING,
+    OPTION_XVIDEO,
+    OPTION_RENDER_SCALE,
+    OPTION_SCANOUT_FORMAT,
+    OPTION_DITHER,
+    OPTION_SOFTWARE_GAMMA,
+    OPTION_COMPOSITED_CURSOR,
+    OPTION_HW_CURSOR,
+    OPTION_RENDER_THREADS,
+} xengfx_opts;
+
 static const OptionInfoRec xengfx_options[] =
 {
-    {-1, NULL, OPTV_NONE, {0}, FALSE}
+    {OPTION_PAGE_FLIP,      "PageFlip",         OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_CAPTURE_SOCKET, "CaptureSocket",    OPTV_STRING,    {0},    FALSE},
+    {OPTION_COPY_MOVES,     "CopyMoves",        OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_COMMAND_BUFFER, "CommandBuffer",    OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_TILE_HASH,      "TileHash",         OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_DIRTY_BITMAP,   "DirtyBitmap",      OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_COMPRESSION,    "Compression",      OPTV_STRING,    {0},    FALSE},
+    {OPTION_FRONT_MAPPING,  "FrontMapping",     OPTV_STRING,    {0},    FALSE},
+    {OPTION_XVIDEO,         "XVideo",           OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_RENDER_SCALE,   "RenderScale",      OPTV_REAL,      {0},    FALSE},
+    {OPTION_SCANOUT_FORMAT, "ScanoutFormat",    OPTV_STRING,    {0},    FALSE},
+    {OPTION_DITHER,         "Dither",           OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_SOFTWARE_GAMMA, "SoftwareGamma",    OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_COMPOSITED_CURSOR, "CompositedCursor", OPTV_BOOLEAN,  {0},    FALSE},
+    {OPTION_HW_CURSOR,      "HWCursor",         OPTV_BOOLEAN,   {0},    FALSE},
+    {OPTION_RENDER_THREADS, "RenderThreads",    OPTV_INTEGER,   {0},    FALSE},
+    {-1,                    NULL,               OPTV_NONE,      {0},    FALSE}
 };
 
 static Bool
@@ -105,6 +141,8 @@ xengfx_pre_init(ScrnInfoPtr scrn, int flags)
     struct xengfx_private *xengfx;
     rgb initial_weight = { 0, 0, 0 };
     Gamma zeros = { 0.0, 0.0, 0.0 };
+    CARD32 start = GetTimeInMillis();
+    const char *s;
 
     if (scrn->numEntities != 1)
         return FALSE;
@@ -158,6 +196,90 @@ xengfx_pre_init(ScrnInfoPtr scrn, int flags)
     memcpy(xengfx->Options, xengfx_options, sizeof (xengfx_options));
     xf86ProcessOptions(scrn->scrnIndex, scrn->options, xengfx->Options);
 
+    xengfx->page_flip = xf86ReturnOptValBool(xengfx->Options, OPTION_PAGE_FLIP, TRUE);
+    xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Page flipping %s\n",
+               xengfx->page_flip ? "enabled" : "disabled");
+
+    xengfx->copy_moves = xf86ReturnOptValBool(xengfx->Options, OPTION_COPY_MOVES, TRUE);
+    xengfx->use_cmd = xf86ReturnOptValBool(xengfx->Options, OPTION_COMMAND_BUFFER, TRUE);
+    xengfx->tile_hash = xf86ReturnOptValBool(xengfx->Options, OPTION_TILE_HASH, FALSE);
+    xengfx->dirty_bitmap = xf86ReturnOptValBool(xengfx->Options, OPTION_DIRTY_BITMAP, TRUE);
+    xengfx->xvideo = xf86ReturnOptValBool(xengfx->Options, OPTION_XVIDEO, TRUE);
+    xengfx->capture_path = xf86GetOptValString(xengfx->Options, OPTION_CAPTURE_SOCKET);
+
+    xengfx->compression = XENGFX_COMPRESSION_NONE;
+    s = xf86GetOptValString(xengfx->Options, OPTION_COMPRESSION);
+    if (s && !xf86NameCmp(s, "rle"))
+        xengfx->compression = XENGFX_COMPRESSION_RLE;
+    else if (s && !xf86NameCmp(s, "lz4"))
+    {
+#ifdef HAVE_LZ4
+        xengfx->compression = XENGFX_COMPRESSION_LZ4;
+#else
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Built without LZ4, using RLE only\n");
+        xengfx->compression = XENGFX_COMPRESSION_RLE;
+#endif
+    }
+    else if (s && xf86NameCmp(s, "none"))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Unknown compression \"%s\"\n", s);
+    if (xengfx->compression != XENGFX_COMPRESSION_NONE)
+        xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Tile compression: %s\n", s);
+
+    s = xf86GetOptValString(xengfx->Options, OPTION_SCANOUT_FORMAT);
+    if (s && !xf86NameCmp(s, "rgb565"))
+    {
+        xengfx->mode.scanout_format = DRM_FORMAT_RGB565;
+        xengfx->mode.scanout_cpp = 2;
+    }
+    else if (s && xf86NameCmp(s, "native"))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Unknown scanout format \"%s\"\n", s);
+    if (xengfx->mode.scanout_format && scrn->depth != 24)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Scanout conversion needs depth 24\n");
+        xengfx->mode.scanout_format = 0;
+    }
+    xengfx->dither = xengfx->mode.scanout_format == DRM_FORMAT_RGB565 &&
+                     xf86ReturnOptValBool(xengfx->Options, OPTION_DITHER, TRUE);
+
+    xengfx->render_scale = 1.0;
+    if (xf86GetOptValReal(xengfx->Options, OPTION_RENDER_SCALE, &xengfx->render_scale))
+    {
+        if (xengfx->render_scale < 0.25 || xengfx->render_scale > 1.0)
+        {
+            xf86DrvMsg(scrn->scrnIndex, X_WARNING, "RenderScale must be between 0.25 and 1\n");
+            xengfx->render_scale = 1.0;
+        }
+        else if (xengfx->render_scale < 1.0)
+            xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Rendering at %g of the mode size\n",
+                       xengfx->render_scale);
+    }
+
+    // One keeps Render on the server thread, zero picks one thread per CPU
+    xengfx->render_threads = 1;
+    if (xf86GetOptValInteger(xengfx->Options, OPTION_RENDER_THREADS, &xengfx->render_threads))
+    {
+        if (xengfx->render_threads < 0)
+        {
+            xf86DrvMsg(scrn->scrnIndex, X_WARNING, "RenderThreads cannot be negative\n");
+            xengfx->render_threads = 1;
+        }
+        else if (xengfx->render_threads == 0)
+            xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Render operations split over one "
+                       "thread per CPU\n");
+        else if (xengfx->render_threads > 1)
+            xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Render operations split over %d threads\n",
+                       xengfx->render_threads);
+    }
+
+    xengfx->front_map = XENGFX_MAP_LAZY;
+    s = xf86GetOptValString(xengfx->Options, OPTION_FRONT_MAPPING);
+    if (s && !xf86NameCmp(s, "populate"))
+        xengfx->front_map = XENGFX_MAP_POPULATE;
+    else if (s && xf86NameCmp(s, "lazy"))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Unknown front buffer mapping \"%s\"\n", s);
+    if (xengfx->front_map != XENGFX_MAP_LAZY)
+        xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Front buffer mapping: %s\n", s);
+
     xengfx->fd = xengfx_open_drm_master(scrn);
     if (xengfx->fd < 0)
         return FALSE;
@@ -173,6 +295,48 @@ xengfx_pre_init(ScrnInfoPtr scrn, int flags)
         return FALSE;
     }
 
+    // Backends ignoring gamma get it applied when converting the damage
+    if (!xf86GetOptValBool(xengfx->Options, OPTION_SOFTWARE_GAMMA, &xengfx->soft_gamma))
+        xengfx->soft_gamma = !xengfx_crtc_has_gamma(scrn);
+    if (xengfx->soft_gamma && scrn->depth != 24)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Software gamma needs depth 24\n");
+        xengfx->soft_gamma = FALSE;
+    }
+    xengfx->composite_cursor = xf86ReturnOptValBool(xengfx->Options, OPTION_COMPOSITED_CURSOR,
+                                                    FALSE);
+    if (xengfx->composite_cursor && scrn->depth != 24)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Composited cursor needs depth 24\n");
+        xengfx->composite_cursor = FALSE;
+    }
+    xengfx->hw_cursor = xf86ReturnOptValBool(xengfx->Options, OPTION_HW_CURSOR, FALSE);
+    if (xengfx->hw_cursor && xengfx->composite_cursor)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Composited cursor, no hardware cursor\n");
+        xengfx->hw_cursor = FALSE;
+    }
+
+    // Software gamma alone keeps the native scanout until a ramp that is
+    // not identity arrives
+    if (xengfx->composite_cursor && !xengfx->mode.scanout_format)
+    {
+        xengfx->mode.scanout_format = DRM_FORMAT_XRGB8888;
+        xengfx->mode.scanout_cpp = 4;
+    }
+    else if (xengfx->soft_gamma && !xengfx->mode.scanout_format)
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "Software gamma converts the scanout once "
+                   "a ramp is set\n");
+
+    // Copy moves and compression are turned off once the backend accepts
+    // the format, they stay when it falls back to native
+    if (xengfx->mode.scanout_format)
+        xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Scanout converted to %s%s%s%s\n",
+                   xengfx->mode.scanout_format == DRM_FORMAT_RGB565 ? "RGB565" : "XRGB8888",
+                   xengfx->dither ? ", dithered" : "",
+                   xengfx->soft_gamma ? ", with software gamma" : "",
+                   xengfx->composite_cursor ? ", with the cursor composited" : "");
+
     if (!xf86SetGamma(scrn, zeros))
         return FALSE;
 
@@ -189,6 +353,9 @@ xengfx_pre_init(ScrnInfoPtr scrn, int flags)
     if (!xf86LoadSubModule(scrn, "fb"))
         return FALSE;
 
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "PreInit took %u ms\n",
+               (unsigned) (GetTimeInMillis() - start));
+
     return TRUE;
 }
 
@@ -196,7 +363,7 @@ xengfx_pre_init(ScrnInfoPtr scrn, int flags)
 static Bool
 xengfx_create_screen_resources(ScreenPtr screen)
 {
-    ScrnInfoPtr scrn = xf86Screens[screen->myNum];
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
     struct xengfx_private *xengfx = to_xengfx_private(scrn);
     PixmapPtr rootPixmap;
     Bool ret;
@@ -216,6 +383,7 @@ xengfx_create_screen_resources(ScreenPtr screen)
     rootPixmap = screen->GetScreenPixmap(screen);
     if (!screen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
         return FALSE;
+    xengfx_pixmap_set_bo(rootPixmap, xengfx->mode.front_bo);
 
     xengfx->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
                                   screen, rootPixmap);
@@ -223,79 +391,126 @@ xengfx_create_screen_resources(ScreenPtr screen)
         return FALSE;
 
     DamageRegister(&rootPixmap->drawable, xengfx->damage);
+    xengfx->dirty_fb = TRUE;
+
+    if (xengfx->use_cmd)
+        xengfx_cmd_init(scrn);
+    if (xengfx->tile_hash)
+        xengfx_tile_init(scrn);
+    if (xengfx->compression != XENGFX_COMPRESSION_NONE)
+        xengfx_compress_init(scrn);
+
     return TRUE;
 }
 
 
+// The CRTCs and the framebuffer are left as they are, rendering keeps
+// going to the front buffer and its damage is reported when coming back.
 static void
-xengfx_leave_vt(int scrnIndex, int flags)
+xengfx_leave_vt(XENGFX_VT_FUNC_ARGS_DECL)
 {
-    // XXX: Naive implementation
-    ScrnInfoPtr scrn = xf86Screens[scrnIndex];
+    XENGFX_SCRN_INFO_PTR(arg);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
 
+    if (xengfx->hw_cursor)
+        xf86_hide_cursors(scrn);
+    xengfx_flush(scrn);
     scrn->vtSema = FALSE;
+
+    if (drmDropMaster(xengfx->fd))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to drop DRM master: %s\n",
+                   strerror(errno));
 }
 
 
 static Bool
-xengfx_close_screen(int scrnIndex, ScreenPtr screen)
+xengfx_close_screen(XENGFX_CLOSE_SCREEN_ARGS_DECL)
 {
-    ScrnInfoPtr scrn = xf86Screens[scrnIndex];
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
     struct xengfx_private *xengfx = to_xengfx_private(scrn);
 
     if (xengfx->damage)
     {
-        DamageUnregister(&screen->GetScreenPixmap(screen)->drawable, xengfx->damage);
+        XENGFX_DAMAGE_UNREGISTER(&screen->GetScreenPixmap(screen)->drawable, xengfx->damage);
         DamageDestroy(xengfx->damage);
         xengfx->damage = NULL;
     }
 
     if (scrn->vtSema)
-        xengfx_leave_vt(scrnIndex, 0);
+        xengfx_leave_vt(XENGFX_VT_FUNC_ARGS(0));
+
+    xengfx_tile_fini(scrn);
+    xengfx_compress_fini(scrn);
+    xengfx_stats_fini(screen);
+    xengfx_cmd_fini(scrn);
+    xengfx_capture_fini(screen);
+    xengfx_video_fini(screen);
+    if (xengfx->composite_cursor)
+        xengfx_cursor_fini(screen);
+    if (xengfx->hw_cursor)
+        xf86_cursors_fini(screen);
+    xengfx_vblank_fini(screen);
+    xengfx_gc_fini(screen);
+    xengfx_pixmap_fini(screen);
+    xengfx_render_fini(screen);
+    xengfx_drm_destroy_dirty_bo(&xengfx->mode);
+    xengfx_drm_budget_report(&xengfx->mode);
+    xengfx_drm_free_properties(&xengfx->mode);
 
     // XXX: Free GEM objects here
 
     screen->CreateScreenResources = xengfx->CreateScreenResources;
     xengfx->BlockHandler = xengfx->BlockHandler;
 
-    drmDropMaster(xengfx->fd);
-
     screen->CloseScreen = xengfx->CloseScreen;
-    return (*screen->CloseScreen) (scrnIndex, screen);
+    return (*screen->CloseScreen) (XENGFX_CLOSE_SCREEN_ARGS);
 }
 
 
 static void
-xengfx_block_handler(int i, pointer blockData, pointer timeout, pointer readMask)
+xengfx_block_handler(XENGFX_BLOCK_HANDLER_ARGS_DECL)
 {
-    ScreenPtr screen = screenInfo.screens[i];
-    struct xengfx_private *xengfx = to_xengfx_private(xf86Screens[screen->myNum]);
+    ScrnInfoPtr scrn = xf86ScreenToScrn(XENGFX_BLOCK_HANDLER_SCREEN);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    // Before miSprite's block handler, which puts a cursor it took back up
+    if (xengfx->composite_cursor)
+        xengfx_cursor_update(scrn);
+
+    xengfx->BlockHandler(XENGFX_BLOCK_HANDLER_ARGS);
 
-    xengfx->BlockHandler(i, blockData, timeout, readMask);
+    xengfx_flush(scrn);
+    xengfx_stats_publish(XENGFX_BLOCK_HANDLER_SCREEN);
 }
 
 
 static Bool
-xengfx_enter_vt(int scrnIndex, int flags)
+xengfx_enter_vt(XENGFX_VT_FUNC_ARGS_DECL)
 {
-    ScrnInfoPtr scrn = xf86Screens[scrnIndex];
+    XENGFX_SCRN_INFO_PTR(arg);
     struct xengfx_private *xengfx = to_xengfx_private(scrn);
 
+    if (drmSetMaster(xengfx->fd))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to become DRM master: %s\n",
+                   strerror(errno));
+
     scrn->vtSema = TRUE;
 
-    return xengfx_drm_set_desired_modes(scrn, &xengfx->mode);
+    // The backend may not have kept what was shown before
+    if (xengfx->tile_table)
+        xengfx_tile_resize(scrn, scrn->virtualX, scrn->virtualY);
+
+    return xengfx_drm_restore_modes(scrn, &xengfx->mode);
 }
 
 
 static Bool
-xengfx_screen_init(int scrnIndex,
-                   ScreenPtr screen,
-                   int argc,
-                   char **argv)
+xengfx_screen_init(XENGFX_SCREEN_INIT_ARGS_DECL)
 {
-    ScrnInfoPtr scrn = xf86Screens[screen->myNum];
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
     struct xengfx_private *xengfx = to_xengfx_private(scrn);
     VisualPtr visual;
+    CARD32 start = GetTimeInMillis();
     int ret;
 
     scrn->pScreen = screen;
@@ -343,17 +558,52 @@ xengfx_screen_init(int scrnIndex,
 
     fbPictureInit(screen, NULL, 0);
 
+    // Below Damage, which xengfx_gc_init sets up
+    if (!xengfx_render_init(screen, xengfx->render_threads))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Render operations kept on the server thread\n");
+
+    if (!xengfx_pixmap_init(screen))
+        return FALSE;
+
+    if (!xengfx_gc_init(screen))
+        return FALSE;
+
     xengfx->CreateScreenResources = screen->CreateScreenResources;
     screen->CreateScreenResources = xengfx_create_screen_resources;
 
     xf86SetBlackWhitePixels(screen);
 
+#if ABI_VIDEODRV_VERSION < SET_ABI_VERSION(14, 0)
     miInitializeBackingStore(screen);
+#endif
     xf86SetBackingStore(screen);
     xf86SetSilkenMouse(screen);
+    // miDC stays underneath the composited cursor, which hands it over
+    // whenever a CRTC scans out a shadow
     miDCInitialize(screen, xf86GetPointerScreenFuncs());
+    if (xengfx->composite_cursor && !xengfx_cursor_init(screen))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "No converted scanout, "
+                   "the cursor is not composited\n");
+        xengfx->composite_cursor = FALSE;
+    }
 
-    // No xf86_cursors_init. we stay on SW cursor
+    // The hardware cursor goes through the CRTC cursor planes, xf86Cursor
+    // falls back to miDC for the cursors they cannot show
+    if (xengfx->hw_cursor &&
+        !xf86_cursors_init(screen, 64, 64,
+                           HARDWARE_CURSOR_TRUECOLOR_AT_8BPP |
+                           HARDWARE_CURSOR_BIT_ORDER_MSBFIRST |
+                           HARDWARE_CURSOR_INVERT_MASK |
+                           HARDWARE_CURSOR_SWAP_SOURCE_AND_MASK |
+                           HARDWARE_CURSOR_AND_SOURCE_WITH_MASK |
+                           HARDWARE_CURSOR_SOURCE_MASK_INTERLEAVE_64 |
+                           HARDWARE_CURSOR_UPDATE_UNHIDDEN |
+                           HARDWARE_CURSOR_ARGB))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Hardware cursor initialization failed\n");
+        xengfx->hw_cursor = FALSE;
+    }
 
     // Must force it before EnterVT, so we are in control of VT and
     // later memory should be bound when allocation e.g rotate_men
@@ -361,6 +611,10 @@ xengfx_screen_init(int scrnIndex,
 
     screen->SaveScreen = xf86SaveScreen;
 
+    // When the front buffer starts with what the console showed, keep it
+    // instead of painting the root when started with -background none
+    screen->canDoBGNoneRoot = xengfx->mode.console_copied;
+
     xengfx->CloseScreen = screen->CloseScreen;
     screen->CloseScreen = xengfx_close_screen;
 
@@ -372,6 +626,29 @@ xengfx_screen_init(int scrnIndex,
     if (!xf86CrtcScreenInit(screen))
         return FALSE;
 
+    if (xengfx->render_scale < 1.0 &&
+        !xengfx_drm_set_render_scale(screen, xengfx->render_scale))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to scale the CRTCs\n");
+
+    if (!xengfx_vblank_init(screen))
+        return FALSE;
+
+    if (xengfx->xvideo && !xengfx_video_init(screen))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to initialize XVideo\n");
+
+#ifdef HAVE_PRESENT_H
+    if (!xengfx_present_screen_init(screen))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to initialize Present extension\n");
+#endif
+
+#ifdef HAVE_DRI3_H
+    if (!xengfx_dri3_screen_init(screen))
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Failed to initialize DRI3 extension\n");
+#endif
+
+    if (xengfx->capture_path)
+        xengfx_capture_init(screen, xengfx->capture_path);
+
     if (!miCreateDefColormap(screen))
         return FALSE;
 
@@ -380,19 +657,26 @@ xengfx_screen_init(int scrnIndex,
     if (serverGeneration == 1)
         xf86ShowUnusedOptions(scrn->scrnIndex, scrn->options);
 
-    return xengfx_enter_vt(scrnIndex, 1);
+    ret = xengfx_enter_vt(XENGFX_VT_FUNC_ARGS(1));
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "ScreenInit took %u ms\n",
+               (unsigned) (GetTimeInMillis() - start));
+
+    return ret;
 }
 
 
 static Bool
-xengfx_switch_mode(int scrnIndex, DisplayModePtr mode, int flags)
+xengfx_switch_mode(XENGFX_SWITCH_MODE_ARGS_DECL)
 {
-    return xf86SetSingleMode(xf86Screens[scrnIndex], mode, RR_Rotate_0);
+    XENGFX_SCRN_INFO_PTR(arg);
+
+    return xf86SetSingleMode(scrn, mode, RR_Rotate_0);
 }
 
 
 static void
-xengfx_adjust_frame(int scrnIndex, int x, int y, int flags)
+xengfx_adjust_frame(XENGFX_ADJUST_FRAME_ARGS_DECL)
 {
     // XXX : do we need to implement that ?
     // intel does not, but modesetting does
@@ -400,15 +684,18 @@ xengfx_adjust_frame(int scrnIndex, int x, int y, int flags)
 
 
 static void
-xengfx_free_screen(int scrnIndex, int flags)
+xengfx_free_screen(XENGFX_FREE_SCREEN_ARGS_DECL)
 {
 }
 
 
 static ModeStatus
-xengfx_valid_mode(int scrnIndex, DisplayModePtr mode, Bool verbose, int flags)
+xengfx_valid_mode(XENGFX_SCRN_ARG_TYPE arg, DisplayModePtr mode, Bool verbose, int flags)
 {
-    return MODE_OK;
+    XENGFX_SCRN_INFO_PTR(arg);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    return xengfx_drm_budget_mode_valid(&xengfx->mode, mode);
 }
 
 
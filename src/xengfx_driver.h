@@ -40,7 +40,12 @@
 #include <xf86.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 #include <xf86Crtc.h>
+#include <xf86xv.h>
+#include <mipointer.h>
+
+#include "xengfx_compat.h"
 
 #define XENGFX_VERSION_MAJOR PACKAGE_VERSION_MAJOR
 #define XENGFX_VERSION_MINOR PACKAGE_VERSION_MINOR
@@ -53,15 +58,81 @@
 #define XENGFX_VENDOR_ID 0x5853
 #define XENGFX_DEVICE_ID 0xc147
 
+// The converted scanout is only written by the conversion
+#define XENGFX_DRM_SCANOUT_FLAGS (DRM_XENGFX_GEM_WC | DRM_XENGFX_GEM_SCANOUT)
+
+// How the front buffer gets mapped
+enum xengfx_map_mode
+{
+    XENGFX_MAP_LAZY,
+    XENGFX_MAP_POPULATE,
+};
+
+// What a BO is used for, for the memory accounting
+enum xengfx_bo_purpose
+{
+    XENGFX_BO_FRONT,
+    XENGFX_BO_CURSOR,
+    XENGFX_BO_ROTATION,
+    XENGFX_BO_PIXMAP,
+    XENGFX_BO_COMMAND,
+    XENGFX_BO_STAGING,
+    XENGFX_BO_DIRTY_BITMAP,
+    XENGFX_BO_IMPORTED,
+    XENGFX_BO_OVERLAY,
+    XENGFX_BO_SCANOUT,
+    XENGFX_BO_PURPOSE_COUNT
+};
+
 struct xengfx_bo
 {
     uint32_t handle;
-    uint32_t size;
+    uint64_t size;
     void *ptr;
     int map_count;
     uint32_t pitch;
+    uint32_t bpp;
+    uint32_t fb_id;     // only set once the BO has been used for a page flip
+    Bool shared;        // imported or exported through PRIME, never recycled
+    uint32_t flags;     // DRM_XENGFX_GEM_* flags the kernel granted
+    enum xengfx_bo_purpose purpose;
+
+    // PRIME hands back the handle this fd already has for a buffer, so
+    // importing one that was exported or imported before adds a reference
+    int refcount;
+    struct xengfx_bo *shared_next;
+
+    struct xengfx_bo *next;     // BO cache link
+};
+
+
+typedef void (*xengfx_vblank_handler_proc)(xf86CrtcPtr crtc, uint64_t event_id,
+                                           uint64_t ust, uint64_t msc);
+
+struct xengfx_vblank_event
+{
+    struct xengfx_vblank_event *next;
+    struct xengfx_drm_mode *drm_mode;
+    xf86CrtcPtr crtc;
+    uint64_t event_id;
+    Bool aborted;
+    xengfx_vblank_handler_proc handler;
+
+    // A flip spanning several CRTCs completes when all of them did, with
+    // the timestamp of the reference CRTC
+    struct xengfx_vblank_event *ref;
+    int pending;
+    uint64_t ust;
+    uint64_t msc;
+};
+
+struct xengfx_plane
+{
+    drmModePlanePtr plane;
+    void *owner;                // video port showing frames on it
 };
 
+
 struct xengfx_drm_mode
 {
     int fd;
@@ -71,20 +142,87 @@ struct xengfx_drm_mode
     int cpp;
 
     struct xengfx_bo *front_bo;
+    Bool console_copied;        // front buffer starts with what every CRTC showed
+
+    // Format fb_id scans out when it is not the front buffer's, with the
+    // buffer the front buffer damage is converted into
+    uint32_t scanout_format;
+    int scanout_cpp;
+    struct xengfx_bo *scanout_bo;
+
+    // KMS properties, shared by all connectors
+    drmModePropertyPtr *props;
+    int num_props;
+
+    // Overlay planes able to show video
+    struct xengfx_plane *planes;
+    int num_planes;
+
+    // Bytes of live BOs, against a budget of video memory (0 if unknown)
+    uint64_t budget;
+    uint64_t used;
+    uint64_t used_by[XENGFX_BO_PURPOSE_COUNT];
+    uint64_t peak;
+
+    // Dirty tile bitmap of the front buffer, in tiles
+    struct xengfx_bo *dirty_bo;
+    int dirty_cols;
+    int dirty_rows;
+
+    // BOs imported or exported through PRIME, by handle
+    struct xengfx_bo *shared_bos;
+
+    // Released pixmap BOs, kept mapped for reuse
+    struct xengfx_bo *bo_cache;
+    int bo_cache_count;
+    uint32_t bo_cache_size;
+
+    drmEventContext event_context;
+    struct xengfx_vblank_event *events;
 };
 
 
+// What was last committed to a CRTC, so unchanged state is not sent again
+struct xengfx_crtc_state
+{
+    Bool valid;
+    uint32_t fb_id;
+    int x;
+    int y;
+    drmModeModeInfo kmode;
+    uint32_t *output_ids;
+    int output_count;
+
+    Bool gamma_valid;
+    uint32_t gamma_hash;
+};
+
 struct xengfx_crtc
 {
     drmModeCrtcPtr mode_crtc;
     drmModeModeInfo kmode;
     struct xengfx_drm_mode *drm_mode;
+    int pipe;
+
+    // 32 bits vblank sequence extended to a 64 bits MSC
+    uint32_t msc_prev;
+    uint64_t msc_high;
+
+    // Latest cursor position, waiting for the next command submission
+    volatile Bool cursor_moved;
+    volatile int cursor_x;
+    volatile int cursor_y;
 
     struct xengfx_bo *cursor_bo;
 
     struct xengfx_bo *rotate_bo;
     uint32_t rotate_fb_id;
     uint32_t rotate_pitch;
+
+    struct xengfx_crtc_state committed;
+
+    // Software gamma, 3 x 256 entries in the scanout pixel format
+    uint32_t *lut;
 };
 
 
@@ -104,11 +242,66 @@ struct xengfx_output
     drmModeConnectorPtr mode_output;
     drmModeEncoderPtr mode_encoder;
 
+    // mode_output is still current, the next detect need not probe
+    Bool fresh;
+
+    // EDID currently attached to the output, parsed again only on change
+    uint32_t edid_blob_id;
+    drmModePropertyBlobPtr edid_blob;
+
     int num_props;
     struct xengfx_property *props;
 };
 
 
+// Cursor blended into the converted scanout, never into the front buffer
+struct xengfx_cursor
+{
+    uint32_t *image;            // premultiplied ARGB
+    int image_size;
+    int width;
+    int height;
+    int xhot;
+    int yhot;
+    int x;                      // top left corner, in screen coordinates
+    int y;
+    Bool visible;
+
+    // Rectangles it left or entered, converted again by the next flush
+    RegionRec damage;
+
+    // miDC shows it instead while a CRTC scans out a shadow, and for good
+    // once a second master pointer exists
+    miPointerSpriteFuncPtr mi;
+    Bool software;
+    int num_devices;            // master pointers with a sprite
+    Bool shared;
+    DeviceIntPtr dev;           // last one to set or move it
+    CursorPtr current;
+    int pointer_x;              // hotspot, in screen coordinates
+    int pointer_y;
+};
+
+
+struct xengfx_capture;
+struct xengfx_render;
+
+// Counters logged when the screen closes, and published while it runs
+struct xengfx_stats
+{
+    uint64_t tiles_hashed;
+    uint64_t tiles_dropped;
+    uint64_t bytes_raw;
+    uint64_t bytes_encoded;
+};
+
+enum xengfx_compression
+{
+    XENGFX_COMPRESSION_NONE,
+    XENGFX_COMPRESSION_RLE,
+    XENGFX_COMPRESSION_LZ4,
+};
+
 struct xengfx_private
 {
     int fd;
@@ -121,28 +314,192 @@ struct xengfx_private
     CreateScreenResourcesProcPtr CreateScreenResources;
     CloseScreenProcPtr CloseScreen;
     ScreenBlockHandlerProcPtr BlockHandler;
+    CreatePixmapProcPtr CreatePixmap;
+    DestroyPixmapProcPtr DestroyPixmap;
+    CreateGCProcPtr CreateGC;
+    CopyWindowProcPtr CopyWindow;
 
     DamagePtr damage;
+    Bool dirty_fb;
+
+    enum xengfx_map_mode front_map;
+
+    Bool dirty_bitmap;
+
+    Bool use_cmd;
+    struct xengfx_bo *cmd_bo;
+    uint32_t cmd_used;
+
+    enum xengfx_compression compression;
+    struct xengfx_bo *staging_bo;
+    uint32_t staging_used;
+    uint8_t *scratch;
+
+    Bool tile_hash;
+    uint32_t *tile_table;
+    int tile_cols;
+    int tile_rows;
+
+    struct xengfx_stats stats;
+    Atom stats_atom;
+    CARD32 stats_time;          // last publication
+    char *stats_text;           // what was published then
+
+    Bool page_flip;
+    Bool copy_moves;
+    Bool xvideo;
+    Bool dither;                // ordered dither when converting to RGB565
+    Bool soft_gamma;            // gamma ramps applied while converting
+    Bool composite_cursor;
+    Bool hw_cursor;             // xf86Cursor on the CRTC cursor planes
+    struct xengfx_cursor cursor;
+    double render_scale;        // screen size relative to the CRTC modes
+    int render_threads;         // threads splitting Render operations, 0 for one per CPU
+    XF86VideoAdaptorPtr video_adaptor;
+    const char *capture_path;
+    struct xengfx_capture *capture;
+    struct xengfx_render *render;
 };
 
 #define to_xengfx_private(p) ((struct xengfx_private*)(p->driverPrivate))
 
 // xengfx_crtc
 void xengfx_crtc_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode, int num);
+void xengfx_crtc_invalidate(xf86CrtcPtr crtc);
+Bool xengfx_crtc_has_gamma(ScrnInfoPtr scrn);
+Bool xengfx_crtc_has_shadow(ScrnInfoPtr scrn);
 Bool xengfx_crtc_resize(ScrnInfoPtr scrn, int width, int height);
 
 //xengfx_drm
 Bool xengfx_drm_pre_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int cpp);
 Bool xengfx_drm_set_desired_modes(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode);
+Bool xengfx_drm_restore_modes(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode);
+Bool xengfx_drm_set_render_scale(ScreenPtr screen, double scale);
+Bool xengfx_drm_kmode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b);
 void xengfx_mode_to_kmode(drmModeModeInfoPtr kmode, DisplayModePtr mode);
 void xengfx_mode_from_kmode(ScrnInfoPtr scrn, drmModeModeInfoPtr kmode, DisplayModePtr mode);
-struct xengfx_bo* xengfx_drm_create_bo(int fd, const unsigned width, const unsigned height, const unsigned bpp);
+struct xengfx_bo* xengfx_drm_create_bo(struct xengfx_drm_mode *drm_mode,
+                                       enum xengfx_bo_purpose purpose,
+                                       const unsigned width, const unsigned height,
+                                       const unsigned bpp, const uint32_t flags);
 int xengfx_drm_map_bo(int fd, struct xengfx_bo *bo);
-int xengfx_drm_destroy_bo(int fd, struct xengfx_bo *bo);
+int xengfx_drm_map_bo_mode(int fd, struct xengfx_bo *bo, enum xengfx_map_mode mode);
+int xengfx_drm_destroy_bo(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo);
+struct xengfx_bo* xengfx_drm_import_bo(struct xengfx_drm_mode *drm_mode, int prime_fd,
+                                       uint64_t size, uint32_t pitch);
+int xengfx_drm_export_bo(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo,
+                         Bool writable);
+struct xengfx_bo* xengfx_drm_bo_cache_get(struct xengfx_drm_mode *drm_mode, const unsigned width,
+                                          const unsigned height, const unsigned bpp);
+void xengfx_drm_bo_cache_put(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo);
+void xengfx_drm_bo_cache_purge(struct xengfx_drm_mode *drm_mode);
 void* xengfx_drm_map_front_bo(struct xengfx_drm_mode *drm_mode);
+Bool xengfx_drm_budget_check(struct xengfx_drm_mode *drm_mode, uint64_t size);
+uint64_t xengfx_drm_budget_front_size(struct xengfx_drm_mode *drm_mode, int width, int height);
+ModeStatus xengfx_drm_budget_mode_valid(struct xengfx_drm_mode *drm_mode, DisplayModePtr mode);
+void xengfx_drm_budget_report(struct xengfx_drm_mode *drm_mode);
+int xengfx_drm_budget_format(struct xengfx_drm_mode *drm_mode, char *text, int size);
+uint32_t xengfx_drm_front_flags(ScrnInfoPtr scrn);
 Bool xengfx_drm_create_initial_bos(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode);
+Bool xengfx_drm_create_dirty_bo(struct xengfx_drm_mode *drm_mode, int width, int height);
+void xengfx_drm_destroy_dirty_bo(struct xengfx_drm_mode *drm_mode);
+drmModeConnectorPtr xengfx_drm_get_connector(struct xengfx_drm_mode *drm_mode, uint32_t id,
+                                             Bool probe);
+drmModePropertyPtr xengfx_drm_get_property(struct xengfx_drm_mode *drm_mode, uint32_t id);
+void xengfx_drm_free_properties(struct xengfx_drm_mode *drm_mode);
 
 //xengfx_output
 void xengfx_output_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int num);
 
+// xengfx_plane
+void xengfx_plane_init(struct xengfx_drm_mode *drm_mode);
+struct xengfx_plane* xengfx_plane_get(struct xengfx_drm_mode *drm_mode, int pipe,
+                                      uint32_t format, void *owner);
+void xengfx_plane_put(struct xengfx_drm_mode *drm_mode, struct xengfx_plane *plane);
+
+// xengfx_pixmap
+Bool xengfx_pixmap_init(ScreenPtr screen);
+void xengfx_pixmap_fini(ScreenPtr screen);
+struct xengfx_bo* xengfx_pixmap_get_bo(PixmapPtr pixmap);
+void xengfx_pixmap_set_bo(PixmapPtr pixmap, struct xengfx_bo *bo);
+
+// xengfx_vblank
+Bool xengfx_vblank_init(ScreenPtr screen);
+void xengfx_vblank_fini(ScreenPtr screen);
+xf86CrtcPtr xengfx_covering_crtc(ScrnInfoPtr scrn, BoxPtr box);
+int xengfx_get_crtc_ust_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc);
+Bool xengfx_queue_vblank(xf86CrtcPtr crtc, uint64_t event_id, uint64_t msc,
+                         xengfx_vblank_handler_proc handler);
+void xengfx_abort_vblank(ScrnInfoPtr scrn, uint64_t event_id);
+Bool xengfx_page_flip(ScrnInfoPtr scrn, xf86CrtcPtr ref_crtc, uint32_t fb_id,
+                      uint64_t event_id, xengfx_vblank_handler_proc handler);
+
+// xengfx_present
+Bool xengfx_present_screen_init(ScreenPtr screen);
+
+// xengfx_dri3
+Bool xengfx_dri3_screen_init(ScreenPtr screen);
+
+// xengfx_flush
+void xengfx_flush(ScrnInfoPtr scrn);
+
+// xengfx_cmd
+Bool xengfx_cmd_init(ScrnInfoPtr scrn);
+void xengfx_cmd_fini(ScrnInfoPtr scrn);
+Bool xengfx_cmd_submit(ScrnInfoPtr scrn);
+void xengfx_cmd_dirty(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes);
+void xengfx_cmd_fill(ScrnInfoPtr scrn, uint32_t pixel, BoxPtr boxes, int num_boxes);
+Bool xengfx_cmd_copy(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes, int dx, int dy);
+void xengfx_cmd_cursor(ScrnInfoPtr scrn);
+
+// xengfx_compress
+Bool xengfx_compress_init(ScrnInfoPtr scrn);
+void xengfx_compress_fini(ScrnInfoPtr scrn);
+Bool xengfx_compress_flush(ScrnInfoPtr scrn, RegionPtr region);
+
+// xengfx_tile
+Bool xengfx_tile_init(ScrnInfoPtr scrn);
+void xengfx_tile_fini(ScrnInfoPtr scrn);
+Bool xengfx_tile_resize(ScrnInfoPtr scrn, int width, int height);
+void xengfx_tile_filter(ScrnInfoPtr scrn, RegionPtr region);
+void xengfx_tile_invalidate(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes);
+
+// xengfx_stats
+void xengfx_stats_publish(ScreenPtr screen);
+void xengfx_stats_fini(ScreenPtr screen);
+
+// xengfx_gc
+Bool xengfx_gc_init(ScreenPtr screen);
+void xengfx_gc_fini(ScreenPtr screen);
+
+// xengfx_capture
+Bool xengfx_capture_init(ScreenPtr screen, const char *path);
+void xengfx_capture_fini(ScreenPtr screen);
+void xengfx_capture_damage(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes);
+void xengfx_capture_invalidate(ScrnInfoPtr scrn);
+
+// xengfx_convert
+struct xengfx_bo* xengfx_convert_create_scanout(ScrnInfoPtr scrn, int width, int height,
+                                               uint32_t *fb_id);
+void xengfx_convert_region(ScrnInfoPtr scrn, RegionPtr region);
+void xengfx_convert_damage_crtc(xf86CrtcPtr crtc);
+void xengfx_convert_set_gamma(xf86CrtcPtr crtc, const uint16_t *red, const uint16_t *green,
+                              const uint16_t *blue, int size);
+Bool xengfx_convert_gamma_is_identity(xf86CrtcPtr crtc);
+Bool xengfx_convert_start(ScrnInfoPtr scrn, uint32_t *old_fb_id);
+
+// xengfx_cursor
+Bool xengfx_cursor_init(ScreenPtr screen);
+void xengfx_cursor_fini(ScreenPtr screen);
+void xengfx_cursor_update(ScrnInfoPtr scrn);
+void xengfx_cursor_blend(const struct xengfx_cursor *cursor, uint32_t *dst, int x, int y, int n);
+
+// xengfx_render
+Bool xengfx_render_init(ScreenPtr screen, int num_threads);
+void xengfx_render_fini(ScreenPtr screen);
+
+// xengfx_video
+Bool xengfx_video_init(ScreenPtr screen);
+void xengfx_video_fini(ScreenPtr screen);
+
 #endif /* XENGFX_DRIVER_H */
@@ -32,6 +32,10 @@
 #include "xengfx_driver.h"
 #include "xengfx_drm.h"
 
+// Bounds on the released BOs kept around for reuse
+#define XENGFX_BO_CACHE_MAX_COUNT   16
+#define XENGFX_BO_CACHE_MAX_SIZE    (32 * 1024 * 1024)
+
 
 void
 xengfx_mode_to_kmode(drmModeModeInfoPtr kmode, DisplayModePtr mode)
@@ -90,13 +94,181 @@ xengfx_mode_from_kmode(ScrnInfoPtr scrn, drmModeModeInfoPtr kmode, DisplayModePt
 }
 
 
+static const char *xengfx_bo_purpose_names[XENGFX_BO_PURPOSE_COUNT] = {
+    "front buffer",
+    "cursors",
+    "rotation",
+    "pixmaps",
+    "command buffer",
+    "staging",
+    "dirty bitmap",
+    "imported",
+    "video overlays",
+    "converted scanout",
+};
+
+
+// The budget comes from VideoRam in the Device section. GEM objects live
+// in guest memory, nothing the device exposes bounds them, so without it
+// allocations are only tracked.
+static void
+xengfx_drm_budget_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    drm_mode->budget = (uint64_t) xengfx->pEnt->device->videoRam * 1024;
+    if (!drm_mode->budget)
+        return;
+
+    scrn->videoRam = drm_mode->budget / 1024;
+    xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Video memory budget: %d KiB\n", scrn->videoRam);
+}
+
+
+// Size of a GEM object, as far as its flags tell the pitch alignment. The
+// object gets its real size once created.
+static uint64_t
+xengfx_drm_bo_size(unsigned width, unsigned height, unsigned bpp, uint32_t flags)
+{
+    uint64_t pitch = ((uint64_t) width * bpp + 7) / 8;
+
+    if ((flags & DRM_XENGFX_GEM_PITCH_MASK) == DRM_XENGFX_GEM_PITCH_64)
+        pitch = (pitch + 63) & ~(uint64_t) 63;
+
+    return pitch * height;
+}
+
+
+// Whether size more bytes fit the budget, giving the BO cache back first
+Bool
+xengfx_drm_budget_check(struct xengfx_drm_mode *drm_mode, uint64_t size)
+{
+    if (!drm_mode->budget || drm_mode->used + size <= drm_mode->budget)
+        return TRUE;
+
+    xengfx_drm_bo_cache_purge(drm_mode);
+
+    return drm_mode->used + size <= drm_mode->budget;
+}
+
+
+// Size of the front buffer a mode needs, with its converted copy
+uint64_t
+xengfx_drm_budget_front_size(struct xengfx_drm_mode *drm_mode, int width, int height)
+{
+    uint64_t size = xengfx_drm_bo_size(width, height, drm_mode->cpp * 8,
+                                       xengfx_drm_front_flags(drm_mode->scrn));
+
+    if (drm_mode->scanout_format)
+        size += xengfx_drm_bo_size(width, height, drm_mode->scanout_cpp * 8,
+                                   XENGFX_DRM_SCANOUT_FLAGS);
+
+    return size;
+}
+
+
+ModeStatus
+xengfx_drm_budget_mode_valid(struct xengfx_drm_mode *drm_mode, DisplayModePtr mode)
+{
+    // Everything else can be given back, but the cursors
+    uint64_t reserved = drm_mode->used_by[XENGFX_BO_CURSOR];
+
+    if (!drm_mode->budget)
+        return MODE_OK;
+
+    if (reserved + xengfx_drm_budget_front_size(drm_mode, mode->HDisplay, mode->VDisplay) >
+        drm_mode->budget)
+        return MODE_MEM;
+
+    return MODE_OK;
+}
+
+
+void
+xengfx_drm_budget_report(struct xengfx_drm_mode *drm_mode)
+{
+    ScrnInfoPtr scrn = drm_mode->scrn;
+    int i;
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "GEM memory peak: %llu KiB\n",
+               (unsigned long long) (drm_mode->peak / 1024));
+    for (i = 0; i < XENGFX_BO_PURPOSE_COUNT; ++i)
+        if (drm_mode->used_by[i])
+            xf86DrvMsg(scrn->scrnIndex, X_INFO, "  %s: %llu KiB\n",
+                       xengfx_bo_purpose_names[i],
+                       (unsigned long long) (drm_mode->used_by[i] / 1024));
+}
+
+
+// The same figures for _XENGFX_STATS, in bytes, one word names
+int
+xengfx_drm_budget_format(struct xengfx_drm_mode *drm_mode, char *text, int size)
+{
+    char name[32];
+    int len, i, j;
+
+    len = snprintf(text, size, "gem_budget %llu\ngem_used %llu\ngem_peak %llu\n",
+                   (unsigned long long) drm_mode->budget,
+                   (unsigned long long) drm_mode->used,
+                   (unsigned long long) drm_mode->peak);
+
+    for (i = 0; i < XENGFX_BO_PURPOSE_COUNT && len < size; ++i)
+    {
+        for (j = 0; xengfx_bo_purpose_names[i][j] && j < (int) sizeof (name) - 1; ++j)
+            name[j] = xengfx_bo_purpose_names[i][j] == ' ' ? '_' : xengfx_bo_purpose_names[i][j];
+        name[j] = 0;
+
+        len += snprintf(text + len, size - len, "gem_%s %llu\n", name,
+                        (unsigned long long) drm_mode->used_by[i]);
+    }
+
+    return min(len, size - 1);
+}
+
+
+// Imported BOs belong to their exporter, they are reported but do not
+// count against the budget
+static void
+xengfx_drm_budget_add(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo)
+{
+    drm_mode->used_by[bo->purpose] += bo->size;
+    if (bo->purpose == XENGFX_BO_IMPORTED)
+        return;
+
+    drm_mode->used += bo->size;
+    drm_mode->peak = max(drm_mode->peak, drm_mode->used);
+}
+
+
+static void
+xengfx_drm_budget_remove(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo)
+{
+    drm_mode->used_by[bo->purpose] -= bo->size;
+    if (bo->purpose != XENGFX_BO_IMPORTED)
+        drm_mode->used -= bo->size;
+}
+
+
 struct xengfx_bo*
-xengfx_drm_create_bo(int fd, const unsigned width, const unsigned height, const unsigned bpp)
+xengfx_drm_create_bo(struct xengfx_drm_mode *drm_mode, enum xengfx_bo_purpose purpose,
+                     const unsigned width, const unsigned height, const unsigned bpp,
+                     const uint32_t flags)
 {
+    uint64_t size = xengfx_drm_bo_size(width, height, bpp, flags);
     struct drm_xengfx_gem_create arg;
     struct xengfx_bo *bo;
     int ret;
 
+    if (!xengfx_drm_budget_check(drm_mode, size))
+    {
+        // Pixmaps fall back to system memory
+        if (purpose != XENGFX_BO_PIXMAP)
+            xf86DrvMsg(drm_mode->scrn->scrnIndex, X_WARNING,
+                       "No video memory left for %ux%u %s\n", width, height,
+                       xengfx_bo_purpose_names[purpose]);
+        return NULL;
+    }
+
     bo = calloc(1, sizeof (*bo));
     if (!bo)
         return NULL;
@@ -105,14 +277,21 @@ xengfx_drm_create_bo(int fd, const unsigned width, const unsigned height, const
     arg.width = width;
     arg.height = height;
     arg.bpp = bpp;
+    arg.flags = flags;
 
-    ret = drmIoctl(fd, DRM_IOCTL_XENGFX_GEM_CREATE, &arg);
+    ret = drmIoctl(drm_mode->fd, DRM_IOCTL_XENGFX_GEM_CREATE, &arg);
     if (ret)
         goto err;
 
     bo->handle = arg.handle;
     bo->pitch = arg.pitch;
     bo->size = arg.size;
+    bo->bpp = bpp;
+    bo->refcount = 1;
+    if (arg.flags & DRM_XENGFX_GEM_GRANTED)
+        bo->flags = arg.flags & ~DRM_XENGFX_GEM_GRANTED;
+    bo->purpose = purpose;
+    xengfx_drm_budget_add(drm_mode, bo);
 
     return bo;
 err:
@@ -121,36 +300,292 @@ err:
 }
 
 
+// fb renders straight into the front buffer and reads it back (copies,
+// Render blending, GetImage), as do the tile filter, compression and the
+// conversion, so it stays cached. Write-combining is only for buffers
+// nobody reads back.
+uint32_t
+xengfx_drm_front_flags(ScrnInfoPtr scrn)
+{
+    uint32_t flags = DRM_XENGFX_GEM_CACHED | DRM_XENGFX_GEM_PITCH_64;
+
+    // The converted copy is scanned out instead
+    if (!to_xengfx_private(scrn)->mode.scanout_format)
+        flags |= DRM_XENGFX_GEM_SCANOUT;
+
+    return flags;
+}
+
+
+Bool
+xengfx_drm_kmode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+    return a->clock == b->clock &&
+           a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+           a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+           a->hskew == b->hskew &&
+           a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+           a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+           a->vscan == b->vscan && a->flags == b->flags;
+}
+
+
+// Whether the CRTC already shows its desired configuration, left by the
+// console or a previous server, so what it shows is what it will show.
+static Bool
+xengfx_drm_shows_desired(xf86CrtcPtr crtc)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    drmModeCrtcPtr kcrtc = xengfx_crtc->mode_crtc;
+    drmModeModeInfo kmode;
+    int i;
+
+    if (!crtc->enabled || !kcrtc || !kcrtc->buffer_id || !kcrtc->mode_valid ||
+        crtc->desiredRotation != RR_Rotate_0 ||
+        to_xengfx_private(crtc->scrn)->render_scale < 1.0 ||
+        to_xengfx_private(crtc->scrn)->mode.scanout_format ||
+        kcrtc->x != crtc->desiredX || kcrtc->y != crtc->desiredY)
+        return FALSE;
+
+    xengfx_mode_to_kmode(&kmode, &crtc->desiredMode);
+    if (!xengfx_drm_kmode_equal(&kmode, &kcrtc->mode))
+        return FALSE;
+
+    // Driving the same connectors
+    for (i = 0; i < config->num_output; ++i)
+    {
+        xf86OutputPtr output = config->output[i];
+        struct xengfx_output *xengfx_output = output->driver_private;
+        Bool shown = xengfx_output->mode_encoder->crtc_id == kcrtc->crtc_id;
+
+        if (shown != (output->crtc == crtc))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+// Copy what the CRTC currently shows into the front buffer, so the switch
+// to it does not show a black frame.
+static Bool
+xengfx_drm_copy_scanout(struct xengfx_drm_mode *drm_mode, xf86CrtcPtr crtc)
+{
+    ScrnInfoPtr scrn = drm_mode->scrn;
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    drmModeCrtcPtr kcrtc = xengfx_crtc->mode_crtc;
+    struct xengfx_bo *front = drm_mode->front_bo;
+    struct xengfx_bo old;
+    struct drm_gem_close arg;
+    drmModeFBPtr fb;
+    const uint8_t *src;
+    uint8_t *dst;
+    int width, height, y;
+    Bool ret = FALSE;
+
+    fb = drmModeGetFB(drm_mode->fd, kcrtc->buffer_id);
+    if (!fb)
+        return FALSE;
+
+    // The handle is only given to the master
+    if (!fb->handle)
+    {
+        drmModeFreeFB(fb);
+        return FALSE;
+    }
+
+    memset(&old, 0, sizeof (old));
+    old.handle = fb->handle;
+    old.size = fb->pitch * fb->height;
+
+    if (fb->bpp == (uint32_t) scrn->bitsPerPixel && !xengfx_drm_map_bo(drm_mode->fd, &old))
+    {
+        width = min(kcrtc->mode.hdisplay, (int) fb->width - (int) kcrtc->x);
+        width = min(width, scrn->virtualX - (int) kcrtc->x);
+        height = min(kcrtc->mode.vdisplay, (int) fb->height - (int) kcrtc->y);
+        height = min(height, scrn->virtualY - (int) kcrtc->y);
+        if (width <= 0)
+            height = 0;
+
+        src = (const uint8_t *) old.ptr + kcrtc->y * fb->pitch + kcrtc->x * drm_mode->cpp;
+        dst = (uint8_t *) front->ptr + kcrtc->y * front->pitch + kcrtc->x * drm_mode->cpp;
+        for (y = 0; y < height; ++y)
+            memcpy(dst + y * front->pitch, src + y * fb->pitch, width * drm_mode->cpp);
+
+        munmap(old.ptr, old.size);
+        ret = TRUE;
+    }
+
+    // drmModeGetFB opened a new reference on the BO
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = fb->handle;
+    drmIoctl(drm_mode->fd, DRM_IOCTL_GEM_CLOSE, &arg);
+    drmModeFreeFB(fb);
+
+    return ret;
+}
+
+
 Bool
 xengfx_drm_create_initial_bos(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode)
 {
     xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
     int width = scrn->virtualX;
     int height = scrn->virtualY;
     int bpp = scrn->bitsPerPixel;
     int cpp = (bpp + 7) / 8;
-    int i;
+    int i, enabled, copied;
+
+    // Created first, the front buffer flags and the cursor depend on
+    // whether it exists. When the backend rejects the format, gamma and
+    // cursor still need a converted copy in the front buffer's one,
+    // otherwise the front buffer is scanned out, so it is created with
+    // DRM_XENGFX_GEM_SCANOUT and keeps copy moves and compression.
+    if (drm_mode->scanout_format)
+    {
+        drm_mode->scanout_bo = xengfx_convert_create_scanout(scrn, width, height,
+                                                             &drm_mode->fb_id);
+        if (!drm_mode->scanout_bo && drm_mode->scanout_format != DRM_FORMAT_XRGB8888 &&
+            (xengfx->soft_gamma || xengfx->composite_cursor))
+        {
+            drm_mode->scanout_format = DRM_FORMAT_XRGB8888;
+            drm_mode->scanout_cpp = 4;
+            drm_mode->scanout_bo = xengfx_convert_create_scanout(scrn, width, height,
+                                                                 &drm_mode->fb_id);
+        }
+        if (drm_mode->scanout_bo)
+        {
+            // Moves and compressed tiles would hand the backend front buffer pixels
+            xengfx->copy_moves = FALSE;
+            xengfx->compression = XENGFX_COMPRESSION_NONE;
+        }
+        else
+        {
+            drm_mode->scanout_format = 0;
+            xengfx->soft_gamma = FALSE;
+            xengfx->composite_cursor = FALSE;
+        }
+    }
 
-    drm_mode->front_bo = xengfx_drm_create_bo(drm_mode->fd, width, height, bpp);
+    drm_mode->front_bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_FRONT, width, height, bpp,
+                                              xengfx_drm_front_flags(scrn));
     if (!drm_mode->front_bo)
         return FALSE;
     scrn->displayWidth = drm_mode->front_bo->pitch / cpp;
 
+    // The first modeset then only changes the buffer being shown
+    drm_mode->console_copied = FALSE;
+    for (i = 0, enabled = copied = 0; i < xf86_config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+        if (!crtc->enabled)
+            continue;
+        enabled++;
+
+        if (!xengfx_drm_shows_desired(crtc) || !xengfx_drm_map_front_bo(drm_mode))
+            continue;
+
+        if (xengfx_drm_copy_scanout(drm_mode, crtc))
+            copied++;
+        else
+            xf86DrvMsg(scrn->scrnIndex, X_INFO,
+                       "Could not copy the contents shown on CRTC %d\n", i);
+    }
+    drm_mode->console_copied = enabled && copied == enabled;
+
     width = height = 64;
     bpp = 32;
     for (i = 0; i < xf86_config->num_crtc; ++i)
     {
         xf86CrtcPtr crtc = xf86_config->crtc[i];
         struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
-        xengfx_crtc->cursor_bo = xengfx_drm_create_bo(drm_mode->fd, width, height, bpp);
+        xengfx_crtc->cursor_bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_CURSOR,
+                                                      width, height, bpp,
+                                                      DRM_XENGFX_GEM_WC | DRM_XENGFX_GEM_SCANOUT);
     }
 
+    if (xengfx->dirty_bitmap)
+        xengfx_drm_create_dirty_bo(drm_mode, scrn->virtualX, scrn->virtualY);
+
     return TRUE;
 }
 
 
+// Dirty tile bitmap shared with the backend, for a width x height
+// framebuffer. Without it damage is reported as rectangles.
+Bool
+xengfx_drm_create_dirty_bo(struct xengfx_drm_mode *drm_mode, int width, int height)
+{
+    ScrnInfoPtr scrn = drm_mode->scrn;
+    int cols = (width + DRM_XENGFX_DIRTY_TILE_SIZE - 1) / DRM_XENGFX_DIRTY_TILE_SIZE;
+    int rows = (height + DRM_XENGFX_DIRTY_TILE_SIZE - 1) / DRM_XENGFX_DIRTY_TILE_SIZE;
+    struct drm_xengfx_doorbell arg;
+    struct xengfx_bo *bo;
+
+    xengfx_drm_destroy_dirty_bo(drm_mode);
+
+    // Shared atomics need coherent cached memory
+    bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_DIRTY_BITMAP, cols, rows, 1,
+                              DRM_XENGFX_GEM_DIRTY_BITMAP | DRM_XENGFX_GEM_CACHED);
+    if (!bo)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "Dirty tile bitmap not supported\n");
+        return FALSE;
+    }
+
+    if (!(bo->flags & DRM_XENGFX_GEM_DIRTY_BITMAP) ||
+        bo->pitch % sizeof (uint64_t) || bo->pitch * 8 < cols ||
+        bo->size < sizeof (struct drm_xengfx_dirty_bitmap) + (uint64_t) rows * bo->pitch ||
+        xengfx_drm_map_bo(drm_mode->fd, bo))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Unusable dirty tile bitmap\n");
+        xengfx_drm_destroy_bo(drm_mode, bo);
+        return FALSE;
+    }
+
+    // Bits nobody is woken up for are lost damage
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = bo->handle;
+    if (drmIoctl(drm_mode->fd, DRM_IOCTL_XENGFX_DOORBELL, &arg))
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "Dirty tile bitmap doorbell not supported\n");
+        xengfx_drm_destroy_bo(drm_mode, bo);
+        return FALSE;
+    }
+
+    drm_mode->dirty_bo = bo;
+    drm_mode->dirty_cols = cols;
+    drm_mode->dirty_rows = rows;
+
+    return TRUE;
+}
+
+
+void
+xengfx_drm_destroy_dirty_bo(struct xengfx_drm_mode *drm_mode)
+{
+    if (!drm_mode->dirty_bo)
+        return;
+
+    xengfx_drm_destroy_bo(drm_mode, drm_mode->dirty_bo);
+    drm_mode->dirty_bo = NULL;
+    drm_mode->dirty_cols = 0;
+    drm_mode->dirty_rows = 0;
+}
+
+
 int
 xengfx_drm_map_bo(int fd, struct xengfx_bo *bo)
+{
+    return xengfx_drm_map_bo_mode(fd, bo, XENGFX_MAP_LAZY);
+}
+
+
+int
+xengfx_drm_map_bo_mode(int fd, struct xengfx_bo *bo, enum xengfx_map_mode mode)
 {
     struct drm_xengfx_gem_map arg;
     int ret;
@@ -170,7 +605,17 @@ xengfx_drm_map_bo(int fd, struct xengfx_bo *bo)
     if (ret)
         return ret;
 
-    map = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, arg.offset);
+    switch (mode)
+    {
+    case XENGFX_MAP_POPULATE:
+        // Take all the faults now rather than on the first redraw
+        map = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, arg.offset);
+        break;
+    default:
+        map = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, arg.offset);
+        break;
+    }
     if (map == MAP_FAILED)
         return -errno;
 
@@ -180,17 +625,41 @@ xengfx_drm_map_bo(int fd, struct xengfx_bo *bo)
 
 
 int
-xengfx_drm_destroy_bo(int fd, struct xengfx_bo *bo)
+xengfx_drm_destroy_bo(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo)
 {
+    int fd = drm_mode->fd;
     struct drm_gem_close arg;
+    struct xengfx_bo **p;
     int ret;
 
+    // Another import still uses the handle
+    if (--bo->refcount > 0)
+        return 0;
+
+    if (bo->shared)
+    {
+        for (p = &drm_mode->shared_bos; *p; p = &(*p)->shared_next)
+        {
+            if (*p == bo)
+            {
+                *p = bo->shared_next;
+                break;
+            }
+        }
+    }
+
     if (bo->ptr)
     {
         munmap(bo->ptr, bo->size);
         bo->ptr = NULL;
     }
 
+    if (bo->fb_id)
+    {
+        drmModeRmFB(fd, bo->fb_id);
+        bo->fb_id = 0;
+    }
+
     memset(&arg, 0, sizeof (arg));
     arg.handle = bo->handle;
 
@@ -198,11 +667,165 @@ xengfx_drm_destroy_bo(int fd, struct xengfx_bo *bo)
     if (ret)
         return -errno;
 
+    xengfx_drm_budget_remove(drm_mode, bo);
     free(bo);
     return 0;
 }
 
 
+static void
+xengfx_drm_share_bo(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo)
+{
+    if (bo->shared)
+        return;
+
+    bo->shared = TRUE;
+    bo->shared_next = drm_mode->shared_bos;
+    drm_mode->shared_bos = bo;
+}
+
+
+// A dma-buf this fd already has a handle for comes back as the BO using
+// it, with one more reference
+struct xengfx_bo*
+xengfx_drm_import_bo(struct xengfx_drm_mode *drm_mode, int prime_fd, uint64_t size,
+                     uint32_t pitch)
+{
+    struct xengfx_bo *bo;
+    uint32_t handle;
+
+    if (drmPrimeFDToHandle(drm_mode->fd, prime_fd, &handle))
+        return NULL;
+
+    for (bo = drm_mode->shared_bos; bo; bo = bo->shared_next)
+    {
+        if (bo->handle == handle)
+        {
+            bo->refcount++;
+            return bo;
+        }
+    }
+
+    bo = calloc(1, sizeof (*bo));
+    if (!bo)
+    {
+        struct drm_gem_close arg;
+
+        memset(&arg, 0, sizeof (arg));
+        arg.handle = handle;
+        drmIoctl(drm_mode->fd, DRM_IOCTL_GEM_CLOSE, &arg);
+        return NULL;
+    }
+
+    // Owned by the exporter, only reported
+    bo->handle = handle;
+    bo->size = size;
+    bo->pitch = pitch;
+    bo->refcount = 1;
+    bo->purpose = XENGFX_BO_IMPORTED;
+    xengfx_drm_share_bo(drm_mode, bo);
+    xengfx_drm_budget_add(drm_mode, bo);
+
+    return bo;
+}
+
+
+// Only writable exports can be mapped for writing, capture clients just
+// read the screen
+int
+xengfx_drm_export_bo(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo, Bool writable)
+{
+    int flags = DRM_CLOEXEC;
+    int prime_fd;
+
+#ifdef DRM_RDWR
+    if (writable)
+        flags |= DRM_RDWR;
+#endif
+
+    if (drmPrimeHandleToFD(drm_mode->fd, bo->handle, flags, &prime_fd))
+        return -errno;
+
+    xengfx_drm_share_bo(drm_mode, bo);
+    return prime_fd;
+}
+
+
+struct xengfx_bo*
+xengfx_drm_bo_cache_get(struct xengfx_drm_mode *drm_mode, const unsigned width,
+                        const unsigned height, const unsigned bpp)
+{
+    uint64_t min_pitch = (uint64_t) width * ((bpp + 7) / 8);
+    struct xengfx_bo **p;
+
+    // No BO pitch can hold such a row
+    if (min_pitch > UINT32_MAX)
+        return NULL;
+
+    for (p = &drm_mode->bo_cache; *p; p = &(*p)->next)
+    {
+        struct xengfx_bo *bo = *p;
+        uint64_t needed = (uint64_t) bo->pitch * height;
+
+        if (bo->bpp != bpp || bo->pitch < min_pitch || bo->size < needed)
+            continue;
+
+        // Do not waste a large BO on a small pixmap
+        if (bo->size > 2 * needed)
+            continue;
+
+        *p = bo->next;
+        bo->next = NULL;
+        drm_mode->bo_cache_count--;
+        drm_mode->bo_cache_size -= bo->size;
+        return bo;
+    }
+
+    return NULL;
+}
+
+
+void
+xengfx_drm_bo_cache_put(struct xengfx_drm_mode *drm_mode, struct xengfx_bo *bo)
+{
+    if (bo->shared ||
+        drm_mode->bo_cache_count >= XENGFX_BO_CACHE_MAX_COUNT ||
+        drm_mode->bo_cache_size + bo->size > XENGFX_BO_CACHE_MAX_SIZE)
+    {
+        xengfx_drm_destroy_bo(drm_mode, bo);
+        return;
+    }
+
+    // The framebuffer was created for the previous pixmap geometry
+    if (bo->fb_id)
+    {
+        drmModeRmFB(drm_mode->fd, bo->fb_id);
+        bo->fb_id = 0;
+    }
+
+    bo->next = drm_mode->bo_cache;
+    drm_mode->bo_cache = bo;
+    drm_mode->bo_cache_count++;
+    drm_mode->bo_cache_size += bo->size;
+}
+
+
+void
+xengfx_drm_bo_cache_purge(struct xengfx_drm_mode *drm_mode)
+{
+    while (drm_mode->bo_cache)
+    {
+        struct xengfx_bo *bo = drm_mode->bo_cache;
+
+        drm_mode->bo_cache = bo->next;
+        xengfx_drm_destroy_bo(drm_mode, bo);
+    }
+
+    drm_mode->bo_cache_count = 0;
+    drm_mode->bo_cache_size = 0;
+}
+
+
 void*
 xengfx_drm_map_front_bo(struct xengfx_drm_mode *drm_mode)
 {
@@ -211,7 +834,8 @@ xengfx_drm_map_front_bo(struct xengfx_drm_mode *drm_mode)
     if (drm_mode->front_bo->ptr)
         return drm_mode->front_bo->ptr;
 
-    ret = xengfx_drm_map_bo(drm_mode->fd, drm_mode->front_bo);
+    ret = xengfx_drm_map_bo_mode(drm_mode->fd, drm_mode->front_bo,
+                                 to_xengfx_private(drm_mode->scrn)->front_map);
     if (ret)
         return NULL;
 
@@ -219,17 +843,133 @@ xengfx_drm_map_front_bo(struct xengfx_drm_mode *drm_mode)
 }
 
 
+// Without probe, return the connector state the kernel already has instead
+// of forcing a detection cycle, unless that state has never been filled in.
+drmModeConnectorPtr
+xengfx_drm_get_connector(struct xengfx_drm_mode *drm_mode, uint32_t id, Bool probe)
+{
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+    drmModeConnectorPtr koutput;
+
+    if (!probe)
+    {
+        koutput = drmModeGetConnectorCurrent(drm_mode->fd, id);
+        if (koutput && (koutput->count_modes > 0 ||
+                        koutput->connection == DRM_MODE_DISCONNECTED))
+            return koutput;
+        drmModeFreeConnector(koutput);
+    }
+#endif
+
+    return drmModeGetConnector(drm_mode->fd, id);
+}
+
+
+// Property objects are the same for every connector, fetch each one once.
+// The cache lives as long as mode_res.
+drmModePropertyPtr
+xengfx_drm_get_property(struct xengfx_drm_mode *drm_mode, uint32_t id)
+{
+    drmModePropertyPtr prop, *props;
+    int i;
+
+    for (i = 0; i < drm_mode->num_props; ++i)
+        if (drm_mode->props[i]->prop_id == id)
+            return drm_mode->props[i];
+
+    prop = drmModeGetProperty(drm_mode->fd, id);
+    if (!prop)
+        return NULL;
+
+    props = realloc(drm_mode->props, (drm_mode->num_props + 1) * sizeof (*props));
+    if (!props)
+    {
+        drmModeFreeProperty(prop);
+        return NULL;
+    }
+    props[drm_mode->num_props++] = prop;
+    drm_mode->props = props;
+
+    return prop;
+}
+
+
+// Outputs only keep pointers into the cache until their next
+// create_resources, which fetches the properties again
+void
+xengfx_drm_free_properties(struct xengfx_drm_mode *drm_mode)
+{
+    int i;
+
+    for (i = 0; i < drm_mode->num_props; ++i)
+        drmModeFreeProperty(drm_mode->props[i]);
+    free(drm_mode->props);
+    drm_mode->props = NULL;
+    drm_mode->num_props = 0;
+}
+
+
 static const xf86CrtcConfigFuncsRec xengfx_crtc_config_funcs = {
     xengfx_crtc_resize
 };
 
 
+// Shrink the initial layout so the screen is rendered at a fraction of
+// the CRTC modes, xengfx_drm_set_render_scale() scales it back up.
+static void
+xengfx_drm_scale_layout(ScrnInfoPtr scrn, double scale)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int width = 0, height = 0;
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        double w = crtc->desiredMode.HDisplay * scale;
+        double h = crtc->desiredMode.VDisplay * scale;
+        int sw, sh;
+
+        if (!crtc->enabled)
+            continue;
+
+        if (crtc->desiredRotation & (RR_Rotate_90 | RR_Rotate_270))
+        {
+            double t = w;
+
+            w = h;
+            h = t;
+        }
+
+        // Round up so the scaled CRTC stays within the screen
+        sw = (int) w;
+        sh = (int) h;
+        sw += sw < w;
+        sh += sh < h;
+
+        crtc->desiredX = crtc->desiredX * scale;
+        crtc->desiredY = crtc->desiredY * scale;
+        width = max(width, crtc->desiredX + sw);
+        height = max(height, crtc->desiredY + sh);
+    }
+
+    if (!width || !height)
+        return;
+
+    scrn->virtualX = scrn->display->virtualX = width;
+    scrn->virtualY = scrn->display->virtualY = height;
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Screen rendered at %dx%d\n", width, height);
+}
+
+
 Bool
 xengfx_drm_pre_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int cpp)
 {
     struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    CARD32 start, probed;
     int i;
 
+    start = GetTimeInMillis();
     xf86CrtcConfigInit(scrn, &xengfx_crtc_config_funcs);
 
     mode->fd = xengfx->fd;
@@ -239,14 +979,25 @@ xengfx_drm_pre_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int cpp)
     if (!mode->mode_res)
         return FALSE;
 
+    // Needed before modes get validated
+    xengfx_drm_budget_init(scrn, mode);
+
     xf86CrtcSetSizeRange(scrn, 320, 200, mode->mode_res->max_width, mode->mode_res->max_height);
 
     for (i = 0; i < mode->mode_res->count_crtcs; ++i)
         xengfx_crtc_init(scrn, mode, i);
     for (i = 0; i < mode->mode_res->count_connectors; ++i)
         xengfx_output_init(scrn, mode, i);
+    xengfx_plane_init(mode);
+    probed = GetTimeInMillis();
 
     xf86InitialConfiguration(scrn, TRUE);
+    if (xengfx->render_scale < 1.0)
+        xengfx_drm_scale_layout(scrn, xengfx->render_scale);
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO,
+               "KMS resources fetched in %u ms, initial configuration in %u ms\n",
+               (unsigned) (probed - start), (unsigned) (GetTimeInMillis() - probed));
 
     return TRUE;
 }
@@ -268,8 +1019,15 @@ xengfx_drm_set_desired_modes(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode)
         // Skip disabled CRTCs
         if (!crtc->enabled)
         {
-            drmModeSetCrtc(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
-                           0, 0, 0, NULL, 0, NULL);
+            struct xengfx_crtc_state *state = &xengfx_crtc->committed;
+
+            if (state->valid && !state->fb_id)
+                continue;
+
+            state->valid = !drmModeSetCrtc(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id,
+                                           0, 0, 0, NULL, 0, NULL);
+            state->fb_id = 0;
+            state->output_count = 0;
             continue;
         }
 
@@ -310,3 +1068,100 @@ xengfx_drm_set_desired_modes(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode)
 
     return TRUE;
 }
+
+
+// The CRTCs of a screen rendered at a fraction of their mode size scan
+// out a shadow that xf86Rotate redraws from the damage, scaled up with a
+// bilinear filter. The transform is also the RandR one, so it survives
+// RandR mode changes until a client sets another.
+Bool
+xengfx_drm_set_render_scale(ScreenPtr screen, double scale)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    RRTransformRec transform;
+    int i;
+
+    RRTransformInit(&transform);
+    pixman_transform_init_scale(&transform.transform, pixman_double_to_fixed(scale),
+                                pixman_double_to_fixed(scale));
+    pixman_f_transform_init_scale(&transform.f_transform, scale, scale);
+    pixman_f_transform_init_scale(&transform.f_inverse, 1.0 / scale, 1.0 / scale);
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (!crtc->enabled || !crtc->randr_crtc)
+            continue;
+
+        if (RRCrtcTransformSet(crtc->randr_crtc, &transform.transform,
+                               &transform.f_transform, &transform.f_inverse,
+                               FilterBilinear, strlen(FilterBilinear), NULL, 0) != Success)
+            return FALSE;
+
+        // Picked up by xf86CrtcRotate on the next modeset
+        if (!RRTransformCopy(&crtc->transform, &crtc->randr_crtc->client_pending_transform))
+            return FALSE;
+        crtc->transformPresent = TRUE;
+        RRTransformCopy(&crtc->desiredTransform, &crtc->transform);
+        crtc->desiredTransformPresent = TRUE;
+    }
+
+    return TRUE;
+}
+
+
+// Bring the CRTCs back to the state they had before a VT switch. The
+// kernel keeps what was set as long as nobody else touched it, so only
+// the CRTCs that changed get a modeset.
+Bool
+xengfx_drm_restore_modes(ScrnInfoPtr scrn, struct xengfx_drm_mode *drm_mode)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+        uint32_t crtc_id = xengfx_crtc->mode_crtc->crtc_id;
+        drmModeCrtcPtr kcrtc;
+        Bool same;
+
+        kcrtc = drmModeGetCrtc(drm_mode->fd, crtc_id);
+        if (!kcrtc)
+            return xengfx_drm_set_desired_modes(scrn, drm_mode);
+
+        if (!crtc->enabled)
+            same = !kcrtc->buffer_id;
+        else
+            same = xengfx_crtc->committed.valid && kcrtc->mode_valid &&
+                   kcrtc->buffer_id == xengfx_crtc->committed.fb_id &&
+                   kcrtc->x == xengfx_crtc->committed.x &&
+                   kcrtc->y == xengfx_crtc->committed.y &&
+                   xengfx_drm_kmode_equal(&kcrtc->mode, &xengfx_crtc->kmode);
+        drmModeFreeCrtc(kcrtc);
+
+        // Another master may have changed the gamma ramps
+        xengfx_crtc->committed.gamma_valid = FALSE;
+        if (same)
+        {
+            if (crtc->enabled)
+                crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+                                       crtc->gamma_blue, crtc->gamma_size);
+            continue;
+        }
+
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "CRTC %d changed while switched away\n", i);
+        xengfx_crtc_invalidate(crtc);
+
+        if (!crtc->enabled)
+            drmModeSetCrtc(drm_mode->fd, crtc_id, 0, 0, 0, NULL, 0, NULL);
+        else if (!crtc->funcs->set_mode_major(crtc, &crtc->mode, crtc->rotation,
+                                              crtc->x, crtc->y))
+            return FALSE;
+    }
+
+    return TRUE;
+}
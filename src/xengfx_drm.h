@@ -35,9 +35,33 @@
 
 #define DRM_XENGFX_GEM_CREATE   0x0
 #define DRM_XENGFX_GEM_MAP      0x1
+#define DRM_XENGFX_MOVE_RECTS   0x2
+#define DRM_XENGFX_SUBMIT       0x3
+#define DRM_XENGFX_DOORBELL     0x4
+#define DRM_XENGFX_UPLOAD       0x5
 
 #define DRM_IOCTL_XENGFX_GEM_CREATE     DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_GEM_CREATE, struct drm_xengfx_gem_create)
 #define DRM_IOCTL_XENGFX_GEM_MAP        DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_GEM_MAP, struct drm_xengfx_gem_map)
+#define DRM_IOCTL_XENGFX_MOVE_RECTS     DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_MOVE_RECTS, struct drm_xengfx_move_rects)
+#define DRM_IOCTL_XENGFX_SUBMIT         DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_SUBMIT, struct drm_xengfx_submit)
+#define DRM_IOCTL_XENGFX_DOORBELL       DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_DOORBELL, struct drm_xengfx_doorbell)
+#define DRM_IOCTL_XENGFX_UPLOAD         DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_UPLOAD, struct drm_xengfx_upload)
+
+// drm_xengfx_gem_create flags. On return, the kernel sets GRANTED and
+// leaves only the flags it honoured; older kernels leave flags untouched.
+#define DRM_XENGFX_GEM_DIRTY_BITMAP     (1 << 0)
+
+#define DRM_XENGFX_GEM_CACHE_MASK       (3 << 4)
+#define DRM_XENGFX_GEM_CACHED           (1 << 4)
+#define DRM_XENGFX_GEM_WC               (2 << 4)
+#define DRM_XENGFX_GEM_UNCACHED         (3 << 4)
+
+#define DRM_XENGFX_GEM_PITCH_MASK       (3 << 8)
+#define DRM_XENGFX_GEM_PITCH_64         (1 << 8)
+
+#define DRM_XENGFX_GEM_SCANOUT          (1 << 12)
+
+#define DRM_XENGFX_GEM_GRANTED          (1U << 31)
 
 struct drm_xengfx_gem_create
 {
@@ -54,6 +78,30 @@ struct drm_xengfx_gem_create
 };
 
 
+// A DRM_XENGFX_GEM_DIRTY_BITMAP object is created with width and height
+// in tiles and a bpp of 1. It starts with this header, then row y of the
+// bitmap starts at bit y * pitch * 8 of bits. The driver sets bits with
+// atomic ORs, then sets pending and rings the doorbell if it was clear.
+// The backend clears pending, then takes the bits with atomic exchanges,
+// and does so before running any submission for the framebuffer.
+#define DRM_XENGFX_DIRTY_TILE_SIZE      64
+
+struct drm_xengfx_dirty_bitmap
+{
+    uint32_t pending;
+    uint32_t pad[15];
+    uint64_t bits[];
+};
+
+
+// A zero fb_id only checks that the backend takes doorbells
+struct drm_xengfx_doorbell
+{
+    uint32_t handle;    // dirty bitmap
+    uint32_t fb_id;
+};
+
+
 struct drm_xengfx_gem_map
 {
     uint32_t handle;
@@ -61,4 +109,126 @@ struct drm_xengfx_gem_map
     uint64_t offset;
 };
 
+
+// Destination rectangle, its content comes from (x - dx, y - dy)
+struct drm_xengfx_move_rect
+{
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+    int16_t dx;
+    int16_t dy;
+};
+
+
+// All the rectangles of one call move at once: every source is read from
+// the framebuffer content before the call, like a VNC CopyRect update.
+struct drm_xengfx_move_rects
+{
+    uint32_t fb_id;
+    uint32_t count;
+    uint64_t rects;     // struct drm_xengfx_move_rect[count]
+};
+
+
+// Submit a buffer of commands recorded in a GEM object. Commands apply to
+// fb_id in order, and the buffer can be reused once the ioctl returns.
+struct drm_xengfx_submit
+{
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t offset;
+    uint32_t length;
+};
+
+
+#define DRM_XENGFX_CMD_DIRTY        0x1
+#define DRM_XENGFX_CMD_FILL         0x2
+#define DRM_XENGFX_CMD_COPY         0x3
+#define DRM_XENGFX_CMD_CURSOR_MOVE  0x4
+
+struct drm_xengfx_box
+{
+    int16_t x1;
+    int16_t y1;
+    int16_t x2;
+    int16_t y2;
+};
+
+
+// Every command starts with this header and is 8 bytes aligned
+struct drm_xengfx_cmd_header
+{
+    uint16_t type;
+    uint16_t length;    // in bytes, header included
+    uint32_t count;     // number of boxes following the command, if any
+};
+
+
+// Read back the pixels of the boxes from the framebuffer
+struct drm_xengfx_cmd_dirty
+{
+    struct drm_xengfx_cmd_header header;
+    struct drm_xengfx_box boxes[];
+};
+
+
+struct drm_xengfx_cmd_fill
+{
+    struct drm_xengfx_cmd_header header;
+    uint32_t pixel;
+    uint32_t pad;
+    struct drm_xengfx_box boxes[];
+};
+
+
+// Destination boxes, moved at once from (x - dx, y - dy)
+struct drm_xengfx_cmd_copy
+{
+    struct drm_xengfx_cmd_header header;
+    int16_t dx;
+    int16_t dy;
+    uint32_t pad;
+    struct drm_xengfx_box boxes[];
+};
+
+
+struct drm_xengfx_cmd_cursor_move
+{
+    struct drm_xengfx_cmd_header header;
+    uint32_t crtc_id;
+    uint32_t pad;
+    int32_t x;
+    int32_t y;
+};
+
+
+// Upload count encoded tiles stored back to back in a GEM object, each
+// a header followed by its data and padded to 8 bytes. The object can be
+// reused once the ioctl returns.
+struct drm_xengfx_upload
+{
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t length;
+    uint32_t count;
+};
+
+
+#define DRM_XENGFX_TILE_RAW     0x0     // rows of width pixels, packed
+#define DRM_XENGFX_TILE_RLE     0x1     // { uint32_t count, pixel } runs, row major
+#define DRM_XENGFX_TILE_LZ4     0x2     // LZ4 block of the raw data
+
+struct drm_xengfx_tile_header
+{
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint16_t encoding;
+    uint16_t pad;
+    uint32_t length;    // bytes of data following the header
+};
+
 #endif /* XENGFX_DRM_H_ */
@@ -0,0 +1,246 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#include <damage.h>
+
+// Upper bound the kernel accepts in a single dirty report
+#define XENGFX_FLUSH_MAX_CLIPS 256
+
+
+static void
+xengfx_flush_dirty_fb(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    drmModeClip clips[XENGFX_FLUSH_MAX_CLIPS];
+    int i, j, n, ret;
+
+    for (i = 0; i < num_boxes; i += n)
+    {
+        n = min(num_boxes - i, XENGFX_FLUSH_MAX_CLIPS);
+        for (j = 0; j < n; ++j)
+        {
+            clips[j].x1 = boxes[i + j].x1;
+            clips[j].y1 = boxes[i + j].y1;
+            clips[j].x2 = boxes[i + j].x2;
+            clips[j].y2 = boxes[i + j].y2;
+        }
+
+        ret = drmModeDirtyFB(xengfx->fd, xengfx->mode.fb_id, clips, n);
+        if (ret == -ENOSYS)
+        {
+            // The backend reads the framebuffer on its own
+            xf86DrvMsg(scrn->scrnIndex, X_INFO, "Dirty reports not needed\n");
+            xengfx->dirty_fb = FALSE;
+            return;
+        }
+    }
+}
+
+
+// Returns FALSE when the backend was not told, the boxes then have to be
+// reported another way
+static Bool
+xengfx_flush_dirty_bitmap(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+    struct drm_xengfx_dirty_bitmap *bitmap = drm_mode->dirty_bo->ptr;
+    uint64_t stride = (uint64_t) drm_mode->dirty_bo->pitch * 8;
+    struct drm_xengfx_doorbell arg;
+    int i, x, y;
+
+    for (i = 0; i < num_boxes; ++i)
+    {
+        int x1 = max(boxes[i].x1, 0) / DRM_XENGFX_DIRTY_TILE_SIZE;
+        int y1 = max(boxes[i].y1, 0) / DRM_XENGFX_DIRTY_TILE_SIZE;
+        int x2 = min((boxes[i].x2 + DRM_XENGFX_DIRTY_TILE_SIZE - 1) / DRM_XENGFX_DIRTY_TILE_SIZE,
+                     drm_mode->dirty_cols);
+        int y2 = min((boxes[i].y2 + DRM_XENGFX_DIRTY_TILE_SIZE - 1) / DRM_XENGFX_DIRTY_TILE_SIZE,
+                     drm_mode->dirty_rows);
+
+        for (y = y1; y < y2; ++y)
+        {
+            for (x = x1; x < x2; ++x)
+            {
+                uint64_t bit = y * stride + x;
+
+                __atomic_fetch_or(&bitmap->bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Only the clean to dirty transition needs waking the backend up
+    if (__atomic_exchange_n(&bitmap->pending, 1, __ATOMIC_SEQ_CST))
+        return TRUE;
+
+    memset(&arg, 0, sizeof (arg));
+    arg.handle = drm_mode->dirty_bo->handle;
+    arg.fb_id = drm_mode->fb_id;
+    if (!drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_DOORBELL, &arg))
+        return TRUE;
+
+    // Nobody would ring it again while pending is set
+    __atomic_store_n(&bitmap->pending, 0, __ATOMIC_SEQ_CST);
+    if (errno == ENOTTY || errno == EINVAL)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Doorbell not supported, "
+                   "falling back to dirty rectangles\n");
+        xengfx_drm_destroy_dirty_bo(drm_mode);
+    }
+    else
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Doorbell failed: %s\n", strerror(errno));
+
+    return FALSE;
+}
+
+
+// CRTCs scanning out a rotated or scaled shadow show what xf86Rotate
+// redrew from the same damage, reported through the CRTC transform.
+static void
+xengfx_flush_shadows(ScrnInfoPtr scrn, RegionPtr region)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    drmModeClip clips[XENGFX_FLUSH_MAX_CLIPS];
+    BoxPtr boxes = RegionRects(region);
+    int num_boxes = RegionNumRects(region);
+    int i, j, n;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+        if (!crtc->enabled || !xengfx_crtc->rotate_fb_id)
+            continue;
+
+        for (j = n = 0; j < num_boxes; ++j)
+        {
+            BoxRec box;
+
+            // The filter reads a pixel around each destination pixel
+            box.x1 = max(boxes[j].x1 - 1, crtc->bounds.x1);
+            box.y1 = max(boxes[j].y1 - 1, crtc->bounds.y1);
+            box.x2 = min(boxes[j].x2 + 1, crtc->bounds.x2);
+            box.y2 = min(boxes[j].y2 + 1, crtc->bounds.y2);
+            if (box.x1 >= box.x2 || box.y1 >= box.y2)
+                continue;
+
+            pixman_f_transform_bounds(&crtc->f_framebuffer_to_crtc, &box);
+            clips[n].x1 = max(box.x1, 0);
+            clips[n].y1 = max(box.y1, 0);
+            clips[n].x2 = min(box.x2, crtc->mode.HDisplay);
+            clips[n].y2 = min(box.y2, crtc->mode.VDisplay);
+            if (++n == XENGFX_FLUSH_MAX_CLIPS)
+            {
+                drmModeDirtyFB(xengfx->fd, xengfx_crtc->rotate_fb_id, clips, n);
+                n = 0;
+            }
+        }
+
+        if (n)
+            drmModeDirtyFB(xengfx->fd, xengfx_crtc->rotate_fb_id, clips, n);
+    }
+}
+
+
+void
+xengfx_flush(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    RegionPtr region;
+    BoxPtr boxes;
+    int num_boxes;
+    Bool reported = FALSE;
+
+    // Keep accumulating damage while switched away
+    if (!xengfx->damage || !scrn->vtSema)
+        return;
+
+    region = DamageRegion(xengfx->damage);
+    if (xengfx->tile_table && RegionNotEmpty(region))
+        xengfx_tile_filter(scrn, region);
+
+    // Past the tile filter, the front buffer did not change there
+    if (xengfx->composite_cursor && RegionNotEmpty(&xengfx->cursor.damage))
+    {
+        RegionUnion(region, region, &xengfx->cursor.damage);
+        RegionEmpty(&xengfx->cursor.damage);
+    }
+
+    if (RegionNotEmpty(region))
+    {
+        boxes = RegionRects(region);
+        num_boxes = RegionNumRects(region);
+
+        // The backend reads the converted copy
+        if (xengfx->mode.scanout_bo)
+            xengfx_convert_region(scrn, region);
+        xengfx_capture_damage(scrn, boxes, num_boxes);
+        if (xengfx->staging_bo || xengfx->mode.dirty_bo)
+        {
+            // Tiles carry the latest pixels, commands recorded before
+            // have to run first
+            if (xengfx->cmd_bo)
+                xengfx_cmd_submit(scrn);
+
+            if (xengfx->staging_bo)
+                reported = xengfx_compress_flush(scrn, region);
+            else
+                reported = xengfx_flush_dirty_bitmap(scrn, boxes, num_boxes);
+        }
+
+        // Also when the tiles could not be handed over
+        if (!reported)
+        {
+            if (xengfx->cmd_bo)
+                xengfx_cmd_dirty(scrn, boxes, num_boxes);
+            else if (xengfx->dirty_fb)
+                xengfx_flush_dirty_fb(scrn, boxes, num_boxes);
+        }
+
+        if (xengfx->dirty_fb)
+            xengfx_flush_shadows(scrn, region);
+
+        DamageEmpty(xengfx->damage);
+    }
+
+    // Everything recorded since the last flush goes in one submission
+    if (xengfx->cmd_bo)
+    {
+        xengfx_cmd_cursor(scrn);
+        xengfx_cmd_submit(scrn);
+    }
+}
@@ -0,0 +1,600 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#include <damage.h>
+#include <fb.h>
+#include <gcstruct.h>
+
+// Smaller copies are cheaper to resend than to flush for
+#define XENGFX_MOVE_MIN_AREA    (64 * 64)
+
+// Not worth building a region for smaller fills
+#define XENGFX_FILL_MIN_AREA    (16 * 16)
+
+// Rendering to the scanout goes through these wrappers, so operations
+// the backend can replay itself are forwarded instead of their pixels.
+struct xengfx_gc
+{
+    const GCFuncs *funcs;
+    const GCOps *ops;       // wrapped ops, NULL when the GC is not wrapped
+    GCOps wrap_ops;
+};
+
+static DevPrivateKeyRec xengfx_gc_key;
+
+static RegionPtr xengfx_copy_area(DrawablePtr src, DrawablePtr dst, GCPtr gc,
+                                  int srcx, int srcy, int width, int height,
+                                  int dstx, int dsty);
+static void xengfx_fill_spans(DrawablePtr drawable, GCPtr gc, int nspans,
+                              DDXPointPtr points, int *widths, int sorted);
+static void xengfx_poly_fill_rect(DrawablePtr drawable, GCPtr gc,
+                                  int nrects, xRectangle *rects);
+
+#define xengfx_gc_get(gc) \
+    ((struct xengfx_gc *) dixGetPrivateAddr(&(gc)->devPrivates, &xengfx_gc_key))
+
+#define XENGFX_GC_FUNC_PROLOGUE(gc, priv) \
+    do { \
+        (gc)->funcs = (priv)->funcs; \
+        if ((priv)->ops) \
+            (gc)->ops = (priv)->ops; \
+    } while (0)
+
+#define XENGFX_GC_OP_PROLOGUE(gc, priv) \
+    do { \
+        (gc)->funcs = (priv)->funcs; \
+        (gc)->ops = (priv)->ops; \
+    } while (0)
+
+
+static const GCFuncs xengfx_gc_funcs;
+
+
+// Rewrap the GC after calling down, either with our ops or leaving the
+// lower ones alone when the GC does not draw to the scanout
+static void
+xengfx_gc_wrap(GCPtr gc, struct xengfx_gc *priv)
+{
+    priv->funcs = gc->funcs;
+    gc->funcs = &xengfx_gc_funcs;
+
+    if (!priv->ops)
+        return;
+
+    priv->ops = gc->ops;
+    priv->wrap_ops = *gc->ops;
+    priv->wrap_ops.CopyArea = xengfx_copy_area;
+    priv->wrap_ops.FillSpans = xengfx_fill_spans;
+    priv->wrap_ops.PolyFillRect = xengfx_poly_fill_rect;
+    gc->ops = &priv->wrap_ops;
+}
+
+
+static Bool
+xengfx_drawable_is_scanout(DrawablePtr drawable)
+{
+    ScreenPtr screen = drawable->pScreen;
+
+    if (drawable->type == DRAWABLE_WINDOW)
+        return screen->GetWindowPixmap((WindowPtr) drawable) == screen->GetScreenPixmap(screen);
+
+    return (PixmapPtr) drawable == screen->GetScreenPixmap(screen);
+}
+
+
+static int64_t
+xengfx_region_area(RegionPtr region)
+{
+    BoxPtr boxes = RegionRects(region);
+    int64_t area = 0;
+    int i;
+
+    for (i = 0; i < RegionNumRects(region); ++i)
+        area += (int64_t) (boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1);
+
+    return area;
+}
+
+
+static Bool
+xengfx_gc_send_move(ScrnInfoPtr scrn, RegionPtr dst, int dx, int dy)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct drm_xengfx_move_rects arg;
+    struct drm_xengfx_move_rect *rects;
+    BoxPtr boxes = RegionRects(dst);
+    int i, n = RegionNumRects(dst);
+    int ret;
+
+    if (!n)
+        return TRUE;
+
+    if (xengfx->cmd_bo)
+    {
+        if (!xengfx_cmd_copy(scrn, boxes, n, dx, dy))
+            return FALSE;
+        goto done;
+    }
+
+    rects = malloc(n * sizeof (*rects));
+    if (!rects)
+        return FALSE;
+
+    for (i = 0; i < n; ++i)
+    {
+        rects[i].x = boxes[i].x1;
+        rects[i].y = boxes[i].y1;
+        rects[i].width = boxes[i].x2 - boxes[i].x1;
+        rects[i].height = boxes[i].y2 - boxes[i].y1;
+        rects[i].dx = dx;
+        rects[i].dy = dy;
+    }
+
+    memset(&arg, 0, sizeof (arg));
+    arg.fb_id = xengfx->mode.fb_id;
+    arg.count = n;
+    arg.rects = (uintptr_t) rects;
+
+    ret = drmIoctl(xengfx->fd, DRM_IOCTL_XENGFX_MOVE_RECTS, &arg);
+    free(rects);
+
+    if (ret)
+    {
+        if (errno == EINVAL || errno == ENOTTY || errno == ENOSYS)
+        {
+            xf86DrvMsg(scrn->scrnIndex, X_INFO, "Backend does not support moves\n");
+            xengfx->copy_moves = FALSE;
+        }
+        return FALSE;
+    }
+
+done:
+    // Capture clients only know about pixels
+    xengfx_capture_damage(scrn, boxes, n);
+    xengfx_tile_invalidate(scrn, boxes, n);
+    return TRUE;
+}
+
+
+// Called around a copy on the scanout: make sure the backend is up to
+// date with the source before the move, then drop the pixels it has
+// just moved on its own from the damage. Both ends of the move are
+// clipped to the screen pixmap first, the backend cannot read outside of
+// the framebuffer and fb leaves those pixels alone anyway.
+static Bool
+xengfx_gc_move_begin(ScrnInfoPtr scrn, RegionPtr dst, int dx, int dy)
+{
+    ScreenPtr screen = xf86ScrnToScreen(scrn);
+    PixmapPtr pixmap = screen->GetScreenPixmap(screen);
+    BoxRec box;
+    RegionRec bounds;
+
+    box.x1 = 0;
+    box.y1 = 0;
+    box.x2 = pixmap->drawable.width;
+    box.y2 = pixmap->drawable.height;
+    RegionInit(&bounds, &box, 1);
+
+    RegionIntersect(dst, dst, &bounds);
+    RegionTranslate(dst, -dx, -dy);
+    RegionIntersect(dst, dst, &bounds);
+    RegionTranslate(dst, dx, dy);
+    RegionUninit(&bounds);
+
+    if (xengfx_region_area(dst) < XENGFX_MOVE_MIN_AREA)
+        return FALSE;
+
+    xengfx_flush(scrn);
+    return TRUE;
+}
+
+
+static void
+xengfx_gc_move_end(ScrnInfoPtr scrn, RegionPtr dst, int dx, int dy)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    RegionPtr damage = DamageRegion(xengfx->damage);
+
+    if (xengfx_gc_send_move(scrn, dst, dx, dy))
+        RegionSubtract(damage, damage, dst);
+}
+
+
+// A move or fill dropped from the damage would never reach a shadow
+static Bool
+xengfx_gc_can_move(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    return xengfx->copy_moves && xengfx->damage && scrn->vtSema &&
+           !xengfx_crtc_has_shadow(scrn);
+}
+
+
+static RegionPtr
+xengfx_copy_area(DrawablePtr src, DrawablePtr dst, GCPtr gc,
+                 int srcx, int srcy, int width, int height, int dstx, int dsty)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(dst->pScreen);
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+    int dx = (dst->x + dstx) - (src->x + srcx);
+    int dy = (dst->y + dsty) - (src->y + srcy);
+    Bool move = FALSE;
+    RegionRec region;
+    RegionPtr ret;
+
+    if (xengfx_gc_can_move(scrn) && (dx || dy) && width > 0 && height > 0 &&
+        gc->alu == GXcopy &&
+        (gc->planemask & FbFullMask(dst->depth)) == FbFullMask(dst->depth) &&
+        xengfx_drawable_is_scanout(src))
+    {
+        BoxRec box;
+
+        box.x1 = dst->x + dstx;
+        box.y1 = dst->y + dsty;
+        box.x2 = box.x1 + width;
+        box.y2 = box.y1 + height;
+
+        RegionInit(&region, &box, 1);
+        RegionIntersect(&region, &region, gc->pCompositeClip);
+
+        // Only what is visible in the source gets copied. The clip list
+        // may be smaller than what fb copies, which is safe: anything
+        // left out is still reported as damage
+        if (src->type == DRAWABLE_WINDOW)
+        {
+            RegionTranslate(&region, -dx, -dy);
+            RegionIntersect(&region, &region, &((WindowPtr) src)->clipList);
+            RegionTranslate(&region, dx, dy);
+        }
+
+        move = xengfx_gc_move_begin(scrn, &region, dx, dy);
+        if (!move)
+            RegionUninit(&region);
+    }
+
+    XENGFX_GC_OP_PROLOGUE(gc, priv);
+    ret = gc->ops->CopyArea(src, dst, gc, srcx, srcy, width, height, dstx, dsty);
+    xengfx_gc_wrap(gc, priv);
+
+    if (move)
+    {
+        xengfx_gc_move_end(scrn, &region, dx, dy);
+        RegionUninit(&region);
+    }
+
+    return ret;
+}
+
+
+// Solid fills are replayed by the backend from a FILL command, fb still
+// renders them so the framebuffer stays in sync. The pixel is in the front
+// buffer format, useless on a converted scanout.
+static Bool
+xengfx_gc_can_fill(ScrnInfoPtr scrn, GCPtr gc)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    return xengfx->cmd_bo && !xengfx->mode.scanout_format && xengfx->damage && scrn->vtSema &&
+           gc->fillStyle == FillSolid && gc->alu == GXcopy &&
+           (gc->planemask & FbFullMask(gc->depth)) == FbFullMask(gc->depth) &&
+           !xengfx_crtc_has_shadow(scrn);
+}
+
+
+// Rectangles are relative to the drawable when translate is set, spans
+// already are in screen coordinates (fb GCs have miTranslate set)
+static RegionPtr
+xengfx_gc_fill_begin(DrawablePtr drawable, GCPtr gc, int nrects, xRectangle *rects,
+                     Bool translate)
+{
+    RegionPtr region;
+    int64_t area = 0;
+    int i;
+
+    // Client rectangles go up to 65535x65535
+    for (i = 0; i < nrects && area < XENGFX_FILL_MIN_AREA; ++i)
+        area += (int64_t) rects[i].width * rects[i].height;
+    if (area < XENGFX_FILL_MIN_AREA)
+        return NULL;
+
+    region = RegionFromRects(nrects, rects, CT_UNSORTED);
+    if (!region)
+        return NULL;
+
+    if (translate)
+        RegionTranslate(region, drawable->x, drawable->y);
+    RegionIntersect(region, region, gc->pCompositeClip);
+
+    return region;
+}
+
+
+static void
+xengfx_gc_fill_end(ScrnInfoPtr scrn, GCPtr gc, RegionPtr region)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    RegionPtr damage = DamageRegion(xengfx->damage);
+    BoxPtr boxes = RegionRects(region);
+    int n = RegionNumRects(region);
+
+    if (n)
+    {
+        xengfx_cmd_fill(scrn, gc->fgPixel, boxes, n);
+        xengfx_capture_damage(scrn, boxes, n);
+        xengfx_tile_invalidate(scrn, boxes, n);
+        RegionSubtract(damage, damage, region);
+    }
+
+    RegionDestroy(region);
+}
+
+
+static void
+xengfx_fill_spans(DrawablePtr drawable, GCPtr gc, int nspans,
+                  DDXPointPtr points, int *widths, int sorted)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(drawable->pScreen);
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+    RegionPtr region = NULL;
+
+    if (nspans > 0 && xengfx_gc_can_fill(scrn, gc))
+    {
+        xRectangle *rects = malloc(nspans * sizeof (*rects));
+        int i;
+
+        if (rects)
+        {
+            for (i = 0; i < nspans; ++i)
+            {
+                rects[i].x = points[i].x;
+                rects[i].y = points[i].y;
+                rects[i].width = widths[i];
+                rects[i].height = 1;
+            }
+            region = xengfx_gc_fill_begin(drawable, gc, nspans, rects, FALSE);
+            free(rects);
+        }
+    }
+
+    XENGFX_GC_OP_PROLOGUE(gc, priv);
+    gc->ops->FillSpans(drawable, gc, nspans, points, widths, sorted);
+    xengfx_gc_wrap(gc, priv);
+
+    if (region)
+        xengfx_gc_fill_end(scrn, gc, region);
+}
+
+
+static void
+xengfx_poly_fill_rect(DrawablePtr drawable, GCPtr gc, int nrects, xRectangle *rects)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(drawable->pScreen);
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+    RegionPtr region = NULL;
+
+    // Built before calling down, lower layers may rewrite the rectangles
+    if (nrects > 0 && xengfx_gc_can_fill(scrn, gc))
+        region = xengfx_gc_fill_begin(drawable, gc, nrects, rects, TRUE);
+
+    XENGFX_GC_OP_PROLOGUE(gc, priv);
+    gc->ops->PolyFillRect(drawable, gc, nrects, rects);
+    xengfx_gc_wrap(gc, priv);
+
+    if (region)
+        xengfx_gc_fill_end(scrn, gc, region);
+}
+
+
+static void
+xengfx_validate_gc(GCPtr gc, unsigned long changes, DrawablePtr drawable)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+
+    XENGFX_GC_FUNC_PROLOGUE(gc, priv);
+    gc->funcs->ValidateGC(gc, changes, drawable);
+
+    // Only drawing to the scanout is worth forwarding
+    priv->ops = xengfx_drawable_is_scanout(drawable) ? gc->ops : NULL;
+    xengfx_gc_wrap(gc, priv);
+}
+
+
+static void
+xengfx_change_gc(GCPtr gc, unsigned long mask)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+
+    XENGFX_GC_FUNC_PROLOGUE(gc, priv);
+    gc->funcs->ChangeGC(gc, mask);
+    xengfx_gc_wrap(gc, priv);
+}
+
+
+static void
+xengfx_copy_gc(GCPtr src, unsigned long mask, GCPtr dst)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(dst);
+
+    XENGFX_GC_FUNC_PROLOGUE(dst, priv);
+    dst->funcs->CopyGC(src, mask, dst);
+    xengfx_gc_wrap(dst, priv);
+}
+
+
+static void
+xengfx_destroy_gc(GCPtr gc)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+
+    XENGFX_GC_FUNC_PROLOGUE(gc, priv);
+    gc->funcs->DestroyGC(gc);
+}
+
+
+static void
+xengfx_change_clip(GCPtr gc, int type, pointer value, int nrects)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+
+    XENGFX_GC_FUNC_PROLOGUE(gc, priv);
+    gc->funcs->ChangeClip(gc, type, value, nrects);
+    xengfx_gc_wrap(gc, priv);
+}
+
+
+static void
+xengfx_destroy_clip(GCPtr gc)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+
+    XENGFX_GC_FUNC_PROLOGUE(gc, priv);
+    gc->funcs->DestroyClip(gc);
+    xengfx_gc_wrap(gc, priv);
+}
+
+
+static void
+xengfx_copy_clip(GCPtr dst, GCPtr src)
+{
+    struct xengfx_gc *priv = xengfx_gc_get(dst);
+
+    XENGFX_GC_FUNC_PROLOGUE(dst, priv);
+    dst->funcs->CopyClip(dst, src);
+    xengfx_gc_wrap(dst, priv);
+}
+
+
+static const GCFuncs xengfx_gc_funcs = {
+    xengfx_validate_gc,
+    xengfx_change_gc,
+    xengfx_copy_gc,
+    xengfx_destroy_gc,
+    xengfx_change_clip,
+    xengfx_destroy_clip,
+    xengfx_copy_clip
+};
+
+
+static Bool
+xengfx_create_gc(GCPtr gc)
+{
+    ScreenPtr screen = gc->pScreen;
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    struct xengfx_gc *priv = xengfx_gc_get(gc);
+    Bool ret;
+
+    screen->CreateGC = xengfx->CreateGC;
+    ret = screen->CreateGC(gc);
+    xengfx->CreateGC = screen->CreateGC;
+    screen->CreateGC = xengfx_create_gc;
+
+    if (ret)
+    {
+        priv->ops = NULL;
+        priv->funcs = gc->funcs;
+        gc->funcs = &xengfx_gc_funcs;
+    }
+
+    return ret;
+}
+
+
+static void
+xengfx_copy_window(WindowPtr window, DDXPointRec old_origin, RegionPtr src_region)
+{
+    ScreenPtr screen = window->drawable.pScreen;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    int dx = window->drawable.x - old_origin.x;
+    int dy = window->drawable.y - old_origin.y;
+    Bool move = FALSE;
+    RegionRec region;
+
+    // fb clips the source region in place, compute the destination first
+    if (xengfx_gc_can_move(scrn) && (dx || dy) &&
+        xengfx_drawable_is_scanout(&window->drawable))
+    {
+        RegionNull(&region);
+        RegionCopy(&region, src_region);
+        RegionTranslate(&region, dx, dy);
+        RegionIntersect(&region, &region, &window->borderClip);
+
+        move = xengfx_gc_move_begin(scrn, &region, dx, dy);
+        if (!move)
+            RegionUninit(&region);
+    }
+
+    screen->CopyWindow = xengfx->CopyWindow;
+    screen->CopyWindow(window, old_origin, src_region);
+    xengfx->CopyWindow = screen->CopyWindow;
+    screen->CopyWindow = xengfx_copy_window;
+
+    if (move)
+    {
+        xengfx_gc_move_end(scrn, &region, dx, dy);
+        RegionUninit(&region);
+    }
+}
+
+
+Bool
+xengfx_gc_init(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+
+    if (!dixRegisterPrivateKey(&xengfx_gc_key, PRIVATE_GC, sizeof (struct xengfx_gc)))
+        return FALSE;
+
+    // Damage has to sit below us so the moved pixels can be taken out of
+    // the damage once it has recorded them
+    if (!DamageSetup(screen))
+        return FALSE;
+
+    xengfx->CreateGC = screen->CreateGC;
+    screen->CreateGC = xengfx_create_gc;
+    xengfx->CopyWindow = screen->CopyWindow;
+    screen->CopyWindow = xengfx_copy_window;
+
+    return TRUE;
+}
+
+
+void
+xengfx_gc_fini(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+
+    screen->CreateGC = xengfx->CreateGC;
+    screen->CopyWindow = xengfx->CopyWindow;
+}
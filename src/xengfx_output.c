@@ -81,35 +81,11 @@ xengfx_output_create_ranged_atom(xf86OutputPtr output, Atom *atom,
 
 
 static void
-xengfx_output_create_resources(xf86OutputPtr output)
+xengfx_output_create_atoms(xf86OutputPtr output)
 {
     struct xengfx_output *xengfx_output = output->driver_private;
-    struct xengfx_drm_mode *drm_mode = xengfx_output->mode;
-    drmModeConnectorPtr mode_output = xengfx_output->mode_output;
     int i, j, err;
 
-    xengfx_output->props = calloc(mode_output->count_props, sizeof (struct xengfx_property));
-    if (!xengfx_output->props)
-        return;
-
-    xengfx_output->num_props = 0;
-    for (i = j = 0; i < mode_output->count_props; ++i)
-    {
-        drmModePropertyPtr drm_mode_prop;
-
-        drm_mode_prop = drmModeGetProperty(drm_mode->fd, mode_output->props[i]);
-        if (xengfx_property_ignore(drm_mode_prop))
-        {
-            drmModeFreeProperty(drm_mode_prop);
-            continue;
-        }
-
-        xengfx_output->props[j].mode_prop = drm_mode_prop;
-        xengfx_output->props[j].value = mode_output->prop_values[i];
-        ++j;
-    }
-    xengfx_output->num_props = j;
-
     for (i = 0; i < xengfx_output->num_props; ++i)
     {
         struct xengfx_property *p = &xengfx_output->props[i];
@@ -166,6 +142,43 @@ xengfx_output_create_resources(xf86OutputPtr output)
 }
 
 
+// KMS properties come from the shared cache, so only the RandR side is
+// set up for each output
+static void
+xengfx_output_create_resources(xf86OutputPtr output)
+{
+    struct xengfx_output *xengfx_output = output->driver_private;
+    struct xengfx_drm_mode *drm_mode = xengfx_output->mode;
+    drmModeConnectorPtr mode_output = xengfx_output->mode_output;
+    int i, j;
+
+    for (i = 0; i < xengfx_output->num_props; ++i)
+        free(xengfx_output->props[i].atoms);
+    free(xengfx_output->props);
+    xengfx_output->num_props = 0;
+
+    xengfx_output->props = calloc(mode_output->count_props, sizeof (struct xengfx_property));
+    if (!xengfx_output->props)
+        return;
+
+    for (i = j = 0; i < mode_output->count_props; ++i)
+    {
+        drmModePropertyPtr drm_mode_prop;
+
+        drm_mode_prop = xengfx_drm_get_property(drm_mode, mode_output->props[i]);
+        if (xengfx_property_ignore(drm_mode_prop))
+            continue;
+
+        xengfx_output->props[j].mode_prop = drm_mode_prop;
+        xengfx_output->props[j].value = mode_output->prop_values[i];
+        ++j;
+    }
+    xengfx_output->num_props = j;
+
+    xengfx_output_create_atoms(output);
+}
+
+
 static Bool
 xengfx_output_set_property(xf86OutputPtr output, Atom property,
                            RRPropertyValuePtr value)
@@ -178,7 +191,7 @@ xengfx_output_set_property(xf86OutputPtr output, Atom property,
     {
         struct xengfx_property *p = &xengfx_output->props[i];
 
-        if (p->atoms[0] == property)
+        if (!p->atoms || p->atoms[0] != property)
             continue;
 
         if (p->mode_prop->flags & DRM_MODE_PROP_RANGE)
@@ -243,9 +256,20 @@ xengfx_output_detect(xf86OutputPtr output)
 {
     struct xengfx_output *xengfx_output = output->driver_private;
     struct xengfx_drm_mode *drm_mode = xengfx_output->mode;
+    drmModeConnectorPtr koutput;
 
-    drmModeFreeConnector(xengfx_output->mode_output);
-    xengfx_output->mode_output = drmModeGetConnector(drm_mode->fd, xengfx_output->output_id);
+    // The initial configuration runs right after output init, reuse that
+    if (xengfx_output->fresh)
+        xengfx_output->fresh = FALSE;
+    else
+    {
+        koutput = xengfx_drm_get_connector(drm_mode, xengfx_output->output_id, TRUE);
+        if (koutput)
+        {
+            drmModeFreeConnector(xengfx_output->mode_output);
+            xengfx_output->mode_output = koutput;
+        }
+    }
 
     switch (xengfx_output->mode_output->connection)
     {
@@ -263,7 +287,9 @@ xengfx_output_detect(xf86OutputPtr output)
 static Bool
 xengfx_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
 {
-    return MODE_OK;
+    struct xengfx_output *xengfx_output = output->driver_private;
+
+    return xengfx_drm_budget_mode_valid(xengfx_output->mode, mode);
 }
 
 
@@ -274,6 +300,7 @@ xengfx_output_attach_edid(xf86OutputPtr output)
     struct xengfx_drm_mode *drm_mode = xengfx_output->mode;
     drmModeConnectorPtr koutput = xengfx_output->mode_output;
     drmModePropertyBlobPtr edid_blob = NULL;
+    uint32_t blob_id = 0;
     xf86MonPtr mon = NULL;
     int i;
 
@@ -282,23 +309,17 @@ xengfx_output_attach_edid(xf86OutputPtr output)
     {
         drmModePropertyPtr props;
 
-        props = drmModeGetProperty(drm_mode->fd, koutput->props[i]);
-        if (!props)
-            continue;
-        if (!(props->flags & DRM_MODE_PROP_BLOB))
-        {
-            drmModeFreeProperty(props);
-            continue;
-        }
-
-        if (!strcmp(props->name, "EDID"))
-        {
-            drmModeFreePropertyBlob(edid_blob);
-            edid_blob = drmModeGetPropertyBlob(drm_mode->fd, koutput->prop_values[i]);
-        }
-        drmModeFreeProperty(props);
+        props = xengfx_drm_get_property(drm_mode, koutput->props[i]);
+        if (props && (props->flags & DRM_MODE_PROP_BLOB) && !strcmp(props->name, "EDID"))
+            blob_id = koutput->prop_values[i];
     }
 
+    // The kernel hands out a new blob whenever the EDID changes
+    if (blob_id == xengfx_output->edid_blob_id)
+        return;
+
+    if (blob_id)
+        edid_blob = drmModeGetPropertyBlob(drm_mode->fd, blob_id);
     if (edid_blob)
     {
         mon = xf86InterpretEDID(output->scrn->scrnIndex, edid_blob->data);
@@ -307,7 +328,11 @@ xengfx_output_attach_edid(xf86OutputPtr output)
     }
 
     xf86OutputSetEDID(output, mon);
-    // No free of edid_blob ?
+
+    // mon points into the blob data, release the previous one only now
+    drmModeFreePropertyBlob(xengfx_output->edid_blob);
+    xengfx_output->edid_blob = edid_blob;
+    xengfx_output->edid_blob_id = blob_id;
 }
 
 
@@ -344,13 +369,13 @@ xengfx_output_destroy(xf86OutputPtr output)
     struct xengfx_output *xengfx_output = output->driver_private;
     int i;
 
+    // mode_prop belongs to the shared property cache
     for (i = 0; i < xengfx_output->num_props; ++i)
-    {
-        drmModeFreeProperty(xengfx_output->props[i].mode_prop);
         free(xengfx_output->props[i].atoms);
-    }
     free(xengfx_output->props);
 
+    drmModeFreePropertyBlob(xengfx_output->edid_blob);
+
     drmModeFreeEncoder(xengfx_output->mode_encoder);
     drmModeFreeConnector(xengfx_output->mode_output);
 
@@ -394,7 +419,7 @@ xengfx_output_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int num)
     static const char *output_name = "LVDS"; // We know it is a LVDS connector
     char name[32];
 
-    koutput = drmModeGetConnector(mode->fd, mode->mode_res->connectors[num]);
+    koutput = xengfx_drm_get_connector(mode, mode->mode_res->connectors[num], FALSE);
     if (!koutput)
         return;
 
@@ -423,6 +448,7 @@ xengfx_output_init(ScrnInfoPtr scrn, struct xengfx_drm_mode *mode, int num)
     xengfx_output->output_id = mode->mode_res->connectors[num];
     xengfx_output->mode_output = koutput;
     xengfx_output->mode_encoder = kencoder;
+    xengfx_output->fresh = TRUE;
 
     output->mm_width = koutput->mmWidth;
     output->mm_height = koutput->mmHeight;
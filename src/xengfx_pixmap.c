@@ -0,0 +1,187 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#include <servermd.h>
+
+// Track the GEM object backing a pixmap, if any. Only pixmaps living in
+// GEM memory can be scanned out, flipped to or shared with clients.
+static DevPrivateKeyRec xengfx_pixmap_key;
+
+// Smaller pixmaps stay in cached system memory
+#define XENGFX_PIXMAP_BO_MIN_SIZE   (256 * 1024)
+
+
+static Bool
+xengfx_pixmap_wants_bo(int width, int height, int depth, unsigned usage)
+{
+    int bpp;
+
+    if (width <= 0 || height <= 0 || depth < 15)
+        return FALSE;
+
+    bpp = BitsPerPixel(depth);
+    if (bpp != 16 && bpp != 32)
+        return FALSE;
+
+    // Composite window pixmaps are candidates for flips and sharing
+    if (usage == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+        return TRUE;
+    if (usage != 0)
+        return FALSE;
+
+    return (uint64_t) width * height * (bpp / 8) >= XENGFX_PIXMAP_BO_MIN_SIZE;
+}
+
+
+static PixmapPtr
+xengfx_create_pixmap(ScreenPtr screen, int width, int height, int depth,
+                     unsigned usage)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    struct xengfx_bo *bo = NULL;
+    PixmapPtr pixmap;
+    int bpp;
+
+    screen->CreatePixmap = xengfx->CreatePixmap;
+
+    if (!xengfx_pixmap_wants_bo(width, height, depth, usage))
+        goto fallback;
+
+    bpp = BitsPerPixel(depth);
+    bo = xengfx_drm_bo_cache_get(&xengfx->mode, width, height, bpp);
+    if (!bo)
+    {
+        // Rendered by fb, and may be flipped to by Present
+        bo = xengfx_drm_create_bo(&xengfx->mode, XENGFX_BO_PIXMAP, width, height, bpp,
+                                  DRM_XENGFX_GEM_CACHED | DRM_XENGFX_GEM_PITCH_64 |
+                                  DRM_XENGFX_GEM_SCANOUT);
+        if (!bo)
+            goto fallback;
+        if (xengfx_drm_map_bo(xengfx->fd, bo))
+        {
+            xengfx_drm_destroy_bo(&xengfx->mode, bo);
+            bo = NULL;
+            goto fallback;
+        }
+    }
+
+    pixmap = screen->CreatePixmap(screen, 0, 0, depth, usage);
+    if (!pixmap)
+        goto fallback;
+
+    if (!screen->ModifyPixmapHeader(pixmap, width, height, 0, bpp, bo->pitch, bo->ptr))
+    {
+        screen->DestroyPixmap(pixmap);
+        goto fallback;
+    }
+
+    xengfx_pixmap_set_bo(pixmap, bo);
+    screen->CreatePixmap = xengfx_create_pixmap;
+    return pixmap;
+
+fallback:
+    if (bo)
+        xengfx_drm_bo_cache_put(&xengfx->mode, bo);
+
+    pixmap = screen->CreatePixmap(screen, width, height, depth, usage);
+    screen->CreatePixmap = xengfx_create_pixmap;
+    return pixmap;
+}
+
+
+static Bool
+xengfx_destroy_pixmap(PixmapPtr pixmap)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    struct xengfx_bo *bo = NULL;
+    Bool ret;
+
+    // The screen pixmap BO is the front buffer, it is not ours to free
+    if (pixmap->refcnt == 1 && pixmap != screen->GetScreenPixmap(screen))
+        bo = xengfx_pixmap_get_bo(pixmap);
+
+    screen->DestroyPixmap = xengfx->DestroyPixmap;
+    ret = screen->DestroyPixmap(pixmap);
+    xengfx->DestroyPixmap = screen->DestroyPixmap;
+    screen->DestroyPixmap = xengfx_destroy_pixmap;
+
+    if (bo)
+        xengfx_drm_bo_cache_put(&xengfx->mode, bo);
+
+    return ret;
+}
+
+
+Bool
+xengfx_pixmap_init(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+
+    if (!dixRegisterPrivateKey(&xengfx_pixmap_key, PRIVATE_PIXMAP, 0))
+        return FALSE;
+
+    xengfx->CreatePixmap = screen->CreatePixmap;
+    screen->CreatePixmap = xengfx_create_pixmap;
+    xengfx->DestroyPixmap = screen->DestroyPixmap;
+    screen->DestroyPixmap = xengfx_destroy_pixmap;
+
+    return TRUE;
+}
+
+
+void
+xengfx_pixmap_fini(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+
+    screen->CreatePixmap = xengfx->CreatePixmap;
+    screen->DestroyPixmap = xengfx->DestroyPixmap;
+
+    xengfx_drm_bo_cache_purge(&xengfx->mode);
+}
+
+
+struct xengfx_bo*
+xengfx_pixmap_get_bo(PixmapPtr pixmap)
+{
+    return dixGetPrivate(&pixmap->devPrivates, &xengfx_pixmap_key);
+}
+
+
+void
+xengfx_pixmap_set_bo(PixmapPtr pixmap, struct xengfx_bo *bo)
+{
+    dixSetPrivate(&pixmap->devPrivates, &xengfx_pixmap_key, bo);
+}
+
@@ -0,0 +1,152 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+
+// Overlay planes composited over the CRTCs by the backend. They are handed
+// out to the video ports one at a time, and only kept when they can show a
+// YUV format.
+static const uint32_t xengfx_plane_video_formats[] = {
+    DRM_FORMAT_YUV420,
+    DRM_FORMAT_YVU420,
+    DRM_FORMAT_YUYV,
+    DRM_FORMAT_UYVY,
+};
+
+
+static Bool
+xengfx_plane_supports(const struct xengfx_plane *plane, uint32_t format)
+{
+    uint32_t i;
+
+    for (i = 0; i < plane->plane->count_formats; ++i)
+        if (plane->plane->formats[i] == format)
+            return TRUE;
+
+    return FALSE;
+}
+
+
+static Bool
+xengfx_plane_shows_video(const struct xengfx_plane *plane)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof (xengfx_plane_video_formats) / sizeof (uint32_t); ++i)
+        if (xengfx_plane_supports(plane, xengfx_plane_video_formats[i]))
+            return TRUE;
+
+    return FALSE;
+}
+
+
+// The planes live as long as mode_res
+void
+xengfx_plane_init(struct xengfx_drm_mode *drm_mode)
+{
+    drmModePlaneResPtr res;
+    struct xengfx_plane *planes;
+    uint32_t i;
+    int n = 0;
+
+    res = drmModeGetPlaneResources(drm_mode->fd);
+    if (!res)
+        return;
+
+    planes = calloc(res->count_planes, sizeof (*planes));
+    if (!planes)
+    {
+        drmModeFreePlaneResources(res);
+        return;
+    }
+
+    for (i = 0; i < res->count_planes; ++i)
+    {
+        planes[n].plane = drmModeGetPlane(drm_mode->fd, res->planes[i]);
+        if (!planes[n].plane)
+            continue;
+
+        if (xengfx_plane_shows_video(&planes[n]))
+            ++n;
+        else
+            drmModeFreePlane(planes[n].plane);
+    }
+    drmModeFreePlaneResources(res);
+
+    if (!n)
+    {
+        free(planes);
+        return;
+    }
+
+    drm_mode->planes = planes;
+    drm_mode->num_planes = n;
+    xf86DrvMsg(drm_mode->scrn->scrnIndex, X_INFO, "%d overlay planes for video\n", n);
+}
+
+
+// A plane on the CRTC at pipe able to show format, preferring the one
+// owner already has.
+struct xengfx_plane*
+xengfx_plane_get(struct xengfx_drm_mode *drm_mode, int pipe, uint32_t format, void *owner)
+{
+    struct xengfx_plane *found = NULL;
+    int i;
+
+    for (i = 0; i < drm_mode->num_planes; ++i)
+    {
+        struct xengfx_plane *plane = &drm_mode->planes[i];
+
+        if ((plane->owner && plane->owner != owner) ||
+            !(plane->plane->possible_crtcs & (1 << pipe)) ||
+            !xengfx_plane_supports(plane, format))
+            continue;
+
+        found = plane;
+        if (plane->owner == owner)
+            break;
+    }
+
+    if (found)
+        found->owner = owner;
+
+    return found;
+}
+
+
+void
+xengfx_plane_put(struct xengfx_drm_mode *drm_mode, struct xengfx_plane *plane)
+{
+    drmModeSetPlane(drm_mode->fd, plane->plane->plane_id, 0, 0, 0,
+                    0, 0, 0, 0, 0, 0, 0, 0);
+    plane->owner = NULL;
+}
@@ -0,0 +1,220 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include "xengfx_driver.h"
+
+#ifdef HAVE_PRESENT_H
+
+#include <present.h>
+
+
+static RRCrtcPtr
+xengfx_present_get_crtc(WindowPtr window)
+{
+    ScreenPtr screen = window->drawable.pScreen;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    xf86CrtcPtr crtc;
+    BoxRec box;
+
+    box.x1 = window->drawable.x;
+    box.y1 = window->drawable.y;
+    box.x2 = box.x1 + window->drawable.width;
+    box.y2 = box.y1 + window->drawable.height;
+
+    crtc = xengfx_covering_crtc(scrn, &box);
+    if (!crtc)
+        return NULL;
+
+    return crtc->randr_crtc;
+}
+
+
+static int
+xengfx_present_get_ust_msc(RRCrtcPtr randr_crtc, CARD64 *ust, CARD64 *msc)
+{
+    xf86CrtcPtr crtc = randr_crtc->devPrivate;
+    uint64_t crtc_ust, crtc_msc;
+
+    if (xengfx_get_crtc_ust_msc(crtc, &crtc_ust, &crtc_msc))
+        return BadMatch;
+
+    *ust = crtc_ust;
+    *msc = crtc_msc;
+    return Success;
+}
+
+
+static void
+xengfx_present_event_handler(xf86CrtcPtr crtc, uint64_t event_id,
+                             uint64_t ust, uint64_t msc)
+{
+    present_event_notify(event_id, ust, msc);
+}
+
+
+static int
+xengfx_present_queue_vblank(RRCrtcPtr randr_crtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = randr_crtc->devPrivate;
+
+    if (!xengfx_queue_vblank(crtc, event_id, msc, xengfx_present_event_handler))
+        return BadAlloc;
+
+    return Success;
+}
+
+
+static void
+xengfx_present_abort_vblank(RRCrtcPtr randr_crtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = randr_crtc->devPrivate;
+
+    xengfx_abort_vblank(crtc->scrn, event_id);
+}
+
+
+static void
+xengfx_present_flush(WindowPtr window)
+{
+    // fb renders synchronously, nothing is ever queued
+}
+
+
+static Bool
+xengfx_present_check_flip(RRCrtcPtr randr_crtc, WindowPtr window,
+                          PixmapPtr pixmap, Bool sync_flip)
+{
+    ScreenPtr screen = window->drawable.pScreen;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    if (!xengfx->page_flip || !scrn->vtSema)
+        return FALSE;
+
+    // The backend has to see the converted copy, with gamma and cursor,
+    // never the client pixmap
+    if (xengfx->mode.scanout_bo)
+        return FALSE;
+
+    // A flip replaces the whole scanout, so every CRTC must read straight
+    // from the framebuffer
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (crtc->enabled &&
+            (crtc->rotation != RR_Rotate_0 || crtc->transformPresent))
+            return FALSE;
+    }
+
+    if (pixmap->drawable.width != scrn->virtualX ||
+        pixmap->drawable.height != scrn->virtualY ||
+        pixmap->drawable.depth != scrn->depth ||
+        pixmap->drawable.bitsPerPixel != scrn->bitsPerPixel)
+        return FALSE;
+
+    // Only pixmaps living in GEM memory can be scanned out
+    return xengfx_pixmap_get_bo(pixmap) != NULL;
+}
+
+
+static Bool
+xengfx_present_flip(RRCrtcPtr randr_crtc, uint64_t event_id,
+                    uint64_t target_msc, PixmapPtr pixmap, Bool sync_flip)
+{
+    xf86CrtcPtr crtc = randr_crtc->devPrivate;
+    ScrnInfoPtr scrn = crtc->scrn;
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_bo *bo = xengfx_pixmap_get_bo(pixmap);
+    int ret;
+
+    if (!bo)
+        return FALSE;
+
+    if (!bo->fb_id)
+    {
+        ret = drmModeAddFB(xengfx->fd,
+                           pixmap->drawable.width, pixmap->drawable.height,
+                           scrn->depth, scrn->bitsPerPixel,
+                           bo->pitch, bo->handle, &bo->fb_id);
+        if (ret)
+        {
+            xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+                       "failed to add flip fb %d\n", ret);
+            bo->fb_id = 0;
+            return FALSE;
+        }
+    }
+
+    return xengfx_page_flip(scrn, crtc, bo->fb_id, event_id,
+                            xengfx_present_event_handler);
+}
+
+
+static void
+xengfx_present_unflip(ScreenPtr screen, uint64_t event_id)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+
+    // A failed flip already put the front buffer back with a modeset
+    if (scrn->vtSema && xengfx_page_flip(scrn, NULL, xengfx->mode.fb_id, event_id,
+                                         xengfx_present_event_handler))
+        return;
+
+    present_event_notify(event_id, 0, 0);
+}
+
+
+static present_screen_info_rec xengfx_present_screen_info = {
+    .version = PRESENT_SCREEN_INFO_VERSION,
+
+    .get_crtc = xengfx_present_get_crtc,
+    .get_ust_msc = xengfx_present_get_ust_msc,
+    .queue_vblank = xengfx_present_queue_vblank,
+    .abort_vblank = xengfx_present_abort_vblank,
+    .flush = xengfx_present_flush,
+
+    .capabilities = PresentCapabilityNone,
+    .check_flip = xengfx_present_check_flip,
+    .flip = xengfx_present_flip,
+    .unflip = xengfx_present_unflip,
+};
+
+
+Bool
+xengfx_present_screen_init(ScreenPtr screen)
+{
+    return present_screen_init(screen, &xengfx_present_screen_info);
+}
+
+#endif /* HAVE_PRESENT_H */
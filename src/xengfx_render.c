@@ -0,0 +1,431 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xengfx_driver.h"
+
+#include <fb.h>
+#include <fbpict.h>
+#include <mipict.h>
+#include <picturestr.h>
+
+// Large Render operations are split in horizontal bands of the destination
+// composited by pixman on worker threads, the server thread taking its
+// share. The server side of the operation, validating the sources and
+// building the pixman images, stays on the server thread.
+
+// Smaller operations stay on the server thread. These are rough guesses,
+// not measurements, one reason the worker threads are opt-in.
+#define XENGFX_RENDER_MIN_AREA      (256 * 256)
+#define XENGFX_RENDER_MIN_BAND      16
+#define XENGFX_RENDER_MAX_THREADS   8
+
+struct xengfx_render_job
+{
+    void (*band)(struct xengfx_render_job *job, int band);
+    int band_height;
+
+    pixman_op_t op;
+    pixman_image_t *src;
+    pixman_image_t *mask;
+    pixman_image_t *dest;
+    int src_x;
+    int src_y;
+    int mask_x;
+    int mask_y;
+    int dst_x;
+    int dst_y;
+    int width;
+    int height;
+
+    // Filled rectangles, in picture coordinates
+    const xRectangle *rects;
+    int num_rects;
+    int dst_xoff;
+    int dst_yoff;
+};
+
+struct xengfx_render
+{
+    CompositeProcPtr Composite;
+    CompositeRectsProcPtr CompositeRects;
+
+    int num_threads;            // workers, not counting the server thread
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    // Current job, bands are handed out in order
+    struct xengfx_render_job *job;
+    int num_bands;
+    int next_band;
+    int pending;
+    unsigned generation;
+    Bool quit;
+};
+
+
+// Runs bands of the current job until none are left, with the lock held
+static void
+xengfx_render_work(struct xengfx_render *render)
+{
+    while (render->next_band < render->num_bands)
+    {
+        struct xengfx_render_job *job = render->job;
+        int band = render->next_band++;
+
+        pthread_mutex_unlock(&render->lock);
+        job->band(job, band);
+        pthread_mutex_lock(&render->lock);
+
+        if (--render->pending == 0)
+            pthread_cond_signal(&render->done);
+    }
+}
+
+
+static void*
+xengfx_render_thread(void *arg)
+{
+    struct xengfx_render *render = arg;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&render->lock);
+    for (;;)
+    {
+        while (!render->quit && render->generation == generation)
+            pthread_cond_wait(&render->start, &render->lock);
+        if (render->quit)
+            break;
+
+        generation = render->generation;
+        xengfx_render_work(render);
+    }
+    pthread_mutex_unlock(&render->lock);
+
+    return NULL;
+}
+
+
+static void
+xengfx_render_run(struct xengfx_render *render, struct xengfx_render_job *job, int rows)
+{
+    int bands = min(rows / XENGFX_RENDER_MIN_BAND, 2 * (render->num_threads + 1));
+
+    job->band_height = (rows + bands - 1) / bands;
+    bands = (rows + job->band_height - 1) / job->band_height;
+
+    // pixman validates images lazily on first use, which writes to them.
+    // An empty composite does it here, the bands only read them.
+    pixman_image_composite32(job->op, job->src, job->mask, job->dest, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    pthread_mutex_lock(&render->lock);
+    render->job = job;
+    render->num_bands = bands;
+    render->next_band = 0;
+    render->pending = bands;
+    render->generation++;
+    pthread_cond_broadcast(&render->start);
+
+    xengfx_render_work(render);
+    while (render->pending)
+        pthread_cond_wait(&render->done, &render->lock);
+    pthread_mutex_unlock(&render->lock);
+}
+
+
+static void
+xengfx_render_composite_band(struct xengfx_render_job *job, int band)
+{
+    int y = band * job->band_height;
+    int height = min(job->band_height, job->height - y);
+
+    pixman_image_composite32(job->op, job->src, job->mask, job->dest,
+                             job->src_x, job->src_y + y, job->mask_x, job->mask_y + y,
+                             job->dst_x, job->dst_y + y, job->width, height);
+}
+
+
+static void
+xengfx_render_rects_band(struct xengfx_render_job *job, int band)
+{
+    int y1 = job->dst_y + band * job->band_height;
+    int y2 = min(y1 + job->band_height, job->dst_y + job->height);
+    int i;
+
+    for (i = 0; i < job->num_rects; ++i)
+    {
+        const xRectangle *rect = &job->rects[i];
+        int top = max(rect->y, y1);
+        int bottom = min(rect->y + rect->height, y2);
+
+        if (top >= bottom)
+            continue;
+
+        pixman_image_composite32(job->op, job->src, NULL, job->dest, 0, 0, 0, 0,
+                                 rect->x + job->dst_xoff, top + job->dst_yoff,
+                                 rect->width, bottom - top);
+    }
+}
+
+
+static PixmapPtr
+xengfx_render_pixmap(DrawablePtr drawable)
+{
+    if (drawable->type == DRAWABLE_WINDOW)
+        return drawable->pScreen->GetWindowPixmap((WindowPtr) drawable);
+
+    return (PixmapPtr) drawable;
+}
+
+
+// Bands are independent unless a source reads what another band writes
+static Bool
+xengfx_render_reads_dest(PicturePtr pict, PicturePtr dst)
+{
+    if (!pict)
+        return FALSE;
+    if (pict->alphaMap)
+        return TRUE;
+
+    return pict->pDrawable &&
+           xengfx_render_pixmap(pict->pDrawable) == xengfx_render_pixmap(dst->pDrawable);
+}
+
+
+static void
+xengfx_render_composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                        INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                        INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    ScreenPtr screen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(screen);
+    struct xengfx_render *render = to_xengfx_private(xf86ScreenToScrn(screen))->render;
+    struct xengfx_render_job job;
+    int src_xoff = 0, src_yoff = 0, mask_xoff = 0, mask_yoff = 0, dst_xoff = 0, dst_yoff = 0;
+
+    if ((int64_t) width * height < XENGFX_RENDER_MIN_AREA || height < 2 * XENGFX_RENDER_MIN_BAND ||
+        pDst->alphaMap || xengfx_render_reads_dest(pSrc, pDst) ||
+        xengfx_render_reads_dest(pMask, pDst))
+    {
+        ps->Composite = render->Composite;
+        ps->Composite(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask, xDst, yDst,
+                      width, height);
+        ps->Composite = xengfx_render_composite;
+        return;
+    }
+
+    // As fbComposite does
+    miCompositeSourceValidate(pSrc);
+    if (pMask)
+        miCompositeSourceValidate(pMask);
+
+    memset(&job, 0, sizeof (job));
+    job.src = image_from_pict(pSrc, FALSE, &src_xoff, &src_yoff);
+    job.mask = image_from_pict(pMask, FALSE, &mask_xoff, &mask_yoff);
+    job.dest = image_from_pict(pDst, TRUE, &dst_xoff, &dst_yoff);
+
+    if (job.src && job.dest && !(pMask && !job.mask))
+    {
+        job.band = xengfx_render_composite_band;
+        job.op = op;
+        job.src_x = xSrc + src_xoff;
+        job.src_y = ySrc + src_yoff;
+        job.mask_x = xMask + mask_xoff;
+        job.mask_y = yMask + mask_yoff;
+        job.dst_x = xDst + dst_xoff;
+        job.dst_y = yDst + dst_yoff;
+        job.width = width;
+        job.height = height;
+        xengfx_render_run(render, &job, height);
+    }
+
+    free_pixman_pict(pSrc, job.src);
+    free_pixman_pict(pMask, job.mask);
+    free_pixman_pict(pDst, job.dest);
+}
+
+
+static void
+xengfx_render_composite_rects(CARD8 op, PicturePtr pDst, xRenderColor *color,
+                              int nRect, xRectangle *rects)
+{
+    ScreenPtr screen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(screen);
+    struct xengfx_render *render = to_xengfx_private(xf86ScreenToScrn(screen))->render;
+    struct xengfx_render_job job;
+    pixman_color_t solid;
+    int i, y1 = MAXSHORT, y2 = MINSHORT;
+    int64_t area = 0;
+
+    for (i = 0; i < nRect && area < XENGFX_RENDER_MIN_AREA; ++i)
+        area += (int64_t) rects[i].width * rects[i].height;
+    for (i = 0; i < nRect; ++i)
+    {
+        y1 = min(y1, rects[i].y);
+        y2 = max(y2, rects[i].y + rects[i].height);
+    }
+
+    if (area < XENGFX_RENDER_MIN_AREA || y2 - y1 < 2 * XENGFX_RENDER_MIN_BAND ||
+        pDst->alphaMap)
+    {
+        ps->CompositeRects = render->CompositeRects;
+        ps->CompositeRects(op, pDst, color, nRect, rects);
+        ps->CompositeRects = xengfx_render_composite_rects;
+        return;
+    }
+
+    // Clear is a fill with transparent black, as miCompositeRects does
+    solid.red = op == PictOpClear ? 0 : color->red;
+    solid.green = op == PictOpClear ? 0 : color->green;
+    solid.blue = op == PictOpClear ? 0 : color->blue;
+    solid.alpha = op == PictOpClear ? 0 : color->alpha;
+
+    memset(&job, 0, sizeof (job));
+    job.src = pixman_image_create_solid_fill(&solid);
+    job.dest = image_from_pict(pDst, TRUE, &job.dst_xoff, &job.dst_yoff);
+
+    if (job.src && job.dest)
+    {
+        job.band = xengfx_render_rects_band;
+        job.op = op == PictOpClear ? PIXMAN_OP_SRC : op;
+        job.rects = rects;
+        job.num_rects = nRect;
+        job.dst_y = y1;
+        job.height = y2 - y1;
+        xengfx_render_run(render, &job, job.height);
+    }
+
+    if (job.src)
+        pixman_image_unref(job.src);
+    free_pixman_pict(pDst, job.dest);
+}
+
+
+// Must run before DamageSetup, so Damage sees the operations before they
+// get split
+Bool
+xengfx_render_init(ScreenPtr screen, int num_threads)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    PictureScreenPtr ps = GetPictureScreen(screen);
+    struct xengfx_render *render;
+    sigset_t all, saved;
+    int i;
+
+    if (!ps)
+        return FALSE;
+
+    if (num_threads <= 0)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = min(num_threads, XENGFX_RENDER_MAX_THREADS);
+    if (num_threads <= 1)
+        return TRUE;
+
+    render = calloc(1, sizeof (*render));
+    if (!render)
+        return FALSE;
+    render->threads = calloc(num_threads - 1, sizeof (*render->threads));
+    if (!render->threads)
+    {
+        free(render);
+        return FALSE;
+    }
+
+    pthread_mutex_init(&render->lock, NULL);
+    pthread_cond_init(&render->start, NULL);
+    pthread_cond_init(&render->done, NULL);
+
+    // Signals are for the server thread only
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    for (i = 0; i < num_threads - 1; ++i)
+    {
+        if (pthread_create(&render->threads[i], NULL, xengfx_render_thread, render))
+            break;
+        render->num_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (!render->num_threads)
+    {
+        xengfx->render = render;
+        xengfx_render_fini(screen);
+        return FALSE;
+    }
+
+    render->Composite = ps->Composite;
+    ps->Composite = xengfx_render_composite;
+    render->CompositeRects = ps->CompositeRects;
+    ps->CompositeRects = xengfx_render_composite_rects;
+    xengfx->render = render;
+
+    xf86DrvMsg(xf86ScreenToScrn(screen)->scrnIndex, X_INFO,
+               "Render operations split over %d threads\n", render->num_threads + 1);
+    return TRUE;
+}
+
+
+void
+xengfx_render_fini(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    struct xengfx_render *render = xengfx->render;
+    PictureScreenPtr ps = GetPictureScreen(screen);
+    int i;
+
+    if (!render)
+        return;
+
+    if (render->Composite)
+    {
+        ps->Composite = render->Composite;
+        ps->CompositeRects = render->CompositeRects;
+    }
+
+    pthread_mutex_lock(&render->lock);
+    render->quit = TRUE;
+    pthread_cond_broadcast(&render->start);
+    pthread_mutex_unlock(&render->lock);
+    for (i = 0; i < render->num_threads; ++i)
+        pthread_join(render->threads[i], NULL);
+
+    pthread_cond_destroy(&render->done);
+    pthread_cond_destroy(&render->start);
+    pthread_mutex_destroy(&render->lock);
+    free(render->threads);
+    free(render);
+    xengfx->render = NULL;
+}
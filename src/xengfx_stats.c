@@ -0,0 +1,111 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xengfx_driver.h"
+
+#include <X11/Xatom.h>
+#include <property.h>
+#include <windowstr.h>
+
+// The counters are published as text in the _XENGFX_STATS property of
+// the root window, one "name value" line each, at most once a period.
+// xprop -root _XENGFX_STATS reads them while the server runs.
+#define XENGFX_STATS_PERIOD     1000    // ms
+#define XENGFX_STATS_MAX_TEXT   1024
+
+
+static int
+xengfx_stats_format(ScrnInfoPtr scrn, char *text, int size)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_stats *stats = &xengfx->stats;
+    int len;
+
+    len = xengfx_drm_budget_format(&xengfx->mode, text, size);
+
+    if (xengfx->tile_table && len < size)
+        len += snprintf(text + len, size - len,
+                        "tiles_hashed %llu\ntiles_dropped %llu\n",
+                        (unsigned long long) stats->tiles_hashed,
+                        (unsigned long long) stats->tiles_dropped);
+
+    if (xengfx->staging_bo && len < size)
+        len += snprintf(text + len, size - len,
+                        "bytes_raw %llu\nbytes_encoded %llu\n",
+                        (unsigned long long) stats->bytes_raw,
+                        (unsigned long long) stats->bytes_encoded);
+
+    return min(len, size - 1);
+}
+
+
+// From the block handler, the root window only exists once every screen
+// has been set up
+void
+xengfx_stats_publish(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    CARD32 now = GetTimeInMillis();
+    char text[XENGFX_STATS_MAX_TEXT];
+    int len;
+
+    if (!screen->root || (CARD32) (now - xengfx->stats_time) < XENGFX_STATS_PERIOD)
+        return;
+    xengfx->stats_time = now;
+
+    len = xengfx_stats_format(scrn, text, sizeof (text));
+
+    // Clients watching the property only hear about changes
+    if (xengfx->stats_text && !strcmp(xengfx->stats_text, text))
+        return;
+
+    free(xengfx->stats_text);
+    xengfx->stats_text = strdup(text);
+
+    if (!xengfx->stats_atom)
+        xengfx->stats_atom = MakeAtom("_XENGFX_STATS", strlen("_XENGFX_STATS"), TRUE);
+
+    dixChangeWindowProperty(serverClient, screen->root, xengfx->stats_atom, XA_STRING, 8,
+                            PropModeReplace, len, text, TRUE);
+}
+
+
+void
+xengfx_stats_fini(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+
+    free(xengfx->stats_text);
+    xengfx->stats_text = NULL;
+}
@@ -0,0 +1,271 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+
+#include <damage.h>
+
+// Damage is filtered per tile: a tile whose content hashes the same as
+// what was last reported did not change, whatever was drawn over it.
+#define XENGFX_TILE_SIZE        64
+
+// 0 marks a tile with no known content, hashes are never 0
+#define XENGFX_TILE_UNKNOWN     0
+
+typedef uint32_t (*xengfx_tile_hash_proc)(uint32_t crc, const uint8_t *data, size_t len);
+
+static uint32_t xengfx_crc32c_table[256];
+static xengfx_tile_hash_proc xengfx_tile_hash_row;
+
+
+static uint32_t
+xengfx_crc32c_generic(uint32_t crc, const uint8_t *data, size_t len)
+{
+    while (len--)
+        crc = xengfx_crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t
+xengfx_crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+
+    for (; len >= 8; len -= 8, data += 8)
+    {
+        uint64_t v;
+
+        memcpy(&v, data, sizeof (v));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+#endif
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        uint32_t v;
+
+        memcpy(&v, data, sizeof (v));
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#endif
+
+
+static void
+xengfx_tile_hash_setup(ScrnInfoPtr scrn)
+{
+    uint32_t i, j, crc;
+
+    if (xengfx_tile_hash_row)
+        return;
+
+    // Castagnoli polynomial, reflected
+    for (i = 0; i < 256; ++i)
+    {
+        crc = i;
+        for (j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        xengfx_crc32c_table[i] = crc;
+    }
+
+    xengfx_tile_hash_row = xengfx_crc32c_generic;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse4.2"))
+        xengfx_tile_hash_row = xengfx_crc32c_sse42;
+#endif
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Tile hashing uses %s CRC32C\n",
+               xengfx_tile_hash_row == xengfx_crc32c_generic ? "generic" : "SSE4.2");
+}
+
+
+Bool
+xengfx_tile_resize(ScrnInfoPtr scrn, int width, int height)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    int cols = (width + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE;
+    int rows = (height + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE;
+    uint32_t *table;
+
+    table = realloc(xengfx->tile_table, cols * rows * sizeof (*table));
+    if (!table)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING, "Tile hashing disabled\n");
+        xengfx_tile_fini(scrn);
+        return FALSE;
+    }
+
+    // The content of every tile is now unknown
+    memset(table, 0, cols * rows * sizeof (*table));
+    xengfx->tile_table = table;
+    xengfx->tile_cols = cols;
+    xengfx->tile_rows = rows;
+
+    return TRUE;
+}
+
+
+Bool
+xengfx_tile_init(ScrnInfoPtr scrn)
+{
+    xengfx_tile_hash_setup(scrn);
+
+    return xengfx_tile_resize(scrn, scrn->virtualX, scrn->virtualY);
+}
+
+
+void
+xengfx_tile_fini(ScrnInfoPtr scrn)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_stats *stats = &xengfx->stats;
+
+    if (!xengfx->tile_table)
+        return;
+
+    if (stats->tiles_hashed)
+        xf86DrvMsg(scrn->scrnIndex, X_INFO,
+                   "Tile hashing dropped %llu of %llu damaged tiles (%llu%%)\n",
+                   (unsigned long long) stats->tiles_dropped,
+                   (unsigned long long) stats->tiles_hashed,
+                   (unsigned long long) (stats->tiles_dropped * 100 / stats->tiles_hashed));
+
+    free(xengfx->tile_table);
+    xengfx->tile_table = NULL;
+    xengfx->tile_cols = 0;
+    xengfx->tile_rows = 0;
+}
+
+
+static uint32_t
+xengfx_tile_hash(PixmapPtr pixmap, BoxPtr box)
+{
+    int cpp = pixmap->drawable.bitsPerPixel / 8;
+    const uint8_t *row = (const uint8_t *) pixmap->devPrivate.ptr +
+                         box->y1 * pixmap->devKind + box->x1 * cpp;
+    size_t len = (box->x2 - box->x1) * cpp;
+    uint32_t crc = ~0;
+    int y;
+
+    for (y = box->y1; y < box->y2; ++y, row += pixmap->devKind)
+        crc = xengfx_tile_hash_row(crc, row, len);
+
+    crc = ~crc;
+    return crc == XENGFX_TILE_UNKNOWN ? 1 : crc;
+}
+
+
+// Remove from region the tiles that hash the same as last time. Only
+// tiles touched by the damage are hashed, in full.
+void
+xengfx_tile_filter(ScrnInfoPtr scrn, RegionPtr region)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    ScreenPtr screen = screenInfo.screens[scrn->scrnIndex];
+    PixmapPtr pixmap = screen->GetScreenPixmap(screen);
+    BoxPtr extents = RegionExtents(region);
+    int x, y, col_start, col_end, row_start, row_end;
+
+    if (!xengfx->tile_table || !pixmap->devPrivate.ptr)
+        return;
+
+    col_start = max(extents->x1, 0) / XENGFX_TILE_SIZE;
+    row_start = max(extents->y1, 0) / XENGFX_TILE_SIZE;
+    col_end = min((extents->x2 + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE, xengfx->tile_cols);
+    row_end = min((extents->y2 + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE, xengfx->tile_rows);
+
+    for (y = row_start; y < row_end; ++y)
+    {
+        for (x = col_start; x < col_end; ++x)
+        {
+            uint32_t *entry = &xengfx->tile_table[y * xengfx->tile_cols + x];
+            uint32_t hash;
+            BoxRec box;
+
+            box.x1 = x * XENGFX_TILE_SIZE;
+            box.y1 = y * XENGFX_TILE_SIZE;
+            box.x2 = min(box.x1 + XENGFX_TILE_SIZE, pixmap->drawable.width);
+            box.y2 = min(box.y1 + XENGFX_TILE_SIZE, pixmap->drawable.height);
+
+            if (RegionContainsRect(region, &box) == rgnOUT)
+                continue;
+
+            hash = xengfx_tile_hash(pixmap, &box);
+            xengfx->stats.tiles_hashed++;
+
+            if (hash == *entry)
+            {
+                RegionRec tile;
+
+                RegionInit(&tile, &box, 1);
+                RegionSubtract(region, region, &tile);
+                RegionUninit(&tile);
+                xengfx->stats.tiles_dropped++;
+            }
+            *entry = hash;
+        }
+    }
+}
+
+
+// The backend changed these pixels on its own (moves, fills), what it
+// holds no longer matches the recorded hashes.
+void
+xengfx_tile_invalidate(ScrnInfoPtr scrn, BoxPtr boxes, int num_boxes)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    int i, x, y;
+
+    if (!xengfx->tile_table)
+        return;
+
+    for (i = 0; i < num_boxes; ++i)
+    {
+        int col_end = min((boxes[i].x2 + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE, xengfx->tile_cols);
+        int row_end = min((boxes[i].y2 + XENGFX_TILE_SIZE - 1) / XENGFX_TILE_SIZE, xengfx->tile_rows);
+
+        for (y = max(boxes[i].y1, 0) / XENGFX_TILE_SIZE; y < row_end; ++y)
+            for (x = max(boxes[i].x1, 0) / XENGFX_TILE_SIZE; x < col_end; ++x)
+                xengfx->tile_table[y * xengfx->tile_cols + x] = XENGFX_TILE_UNKNOWN;
+    }
+}
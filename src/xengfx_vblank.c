@@ -0,0 +1,424 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <poll.h>
+
+#include "xengfx_driver.h"
+
+#include <xf86Modes.h>
+
+// How long closing the screen waits for pending events, in milliseconds
+#define XENGFX_VBLANK_DRAIN_TIMEOUT     100
+
+
+static uint32_t
+xengfx_crtc_pipe_select(xf86CrtcPtr crtc)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+    if (xengfx_crtc->pipe > 1)
+        return (xengfx_crtc->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    else if (xengfx_crtc->pipe > 0)
+        return DRM_VBLANK_SECONDARY;
+    return 0;
+}
+
+
+static uint64_t
+xengfx_crtc_msc_to_64(xf86CrtcPtr crtc, uint32_t sequence)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+
+    // The kernel sequence is only 32 bits, catch it wrapping around
+    if ((int32_t) (sequence - xengfx_crtc->msc_prev) > 0 && sequence < xengfx_crtc->msc_prev)
+        xengfx_crtc->msc_high += 0x100000000ULL;
+    xengfx_crtc->msc_prev = sequence;
+
+    return xengfx_crtc->msc_high + sequence;
+}
+
+
+static struct xengfx_vblank_event*
+xengfx_vblank_event_create(struct xengfx_drm_mode *drm_mode, xf86CrtcPtr crtc,
+                           uint64_t event_id, xengfx_vblank_handler_proc handler)
+{
+    struct xengfx_vblank_event *event;
+
+    event = calloc(1, sizeof (*event));
+    if (!event)
+        return NULL;
+
+    event->drm_mode = drm_mode;
+    event->crtc = crtc;
+    event->event_id = event_id;
+    event->handler = handler;
+    event->ref = event;
+
+    event->next = drm_mode->events;
+    drm_mode->events = event;
+
+    return event;
+}
+
+
+static void
+xengfx_vblank_event_destroy(struct xengfx_vblank_event *event)
+{
+    struct xengfx_vblank_event **p;
+
+    for (p = &event->drm_mode->events; *p; p = &(*p)->next)
+    {
+        if (*p == event)
+        {
+            *p = event->next;
+            break;
+        }
+    }
+
+    free(event);
+}
+
+
+static void
+xengfx_vblank_handler(int fd, unsigned int frame, unsigned int sec,
+                      unsigned int usec, void *user_data)
+{
+    struct xengfx_vblank_event *event = user_data;
+
+    // Aborted events may outlive the CRTC they were queued on
+    if (!event->aborted)
+        event->handler(event->crtc, event->event_id,
+                       (uint64_t) sec * 1000000 + usec,
+                       xengfx_crtc_msc_to_64(event->crtc, frame));
+
+    xengfx_vblank_event_destroy(event);
+}
+
+
+static void
+xengfx_page_flip_handler(int fd, unsigned int frame, unsigned int sec,
+                         unsigned int usec, void *user_data)
+{
+    struct xengfx_vblank_event *event = user_data;
+    struct xengfx_vblank_event *ref = event->ref;
+
+    if (!event->aborted && !ref->aborted)
+    {
+        uint64_t msc = xengfx_crtc_msc_to_64(event->crtc, frame);
+
+        if (event == ref)
+        {
+            ref->ust = (uint64_t) sec * 1000000 + usec;
+            ref->msc = msc;
+        }
+    }
+
+    if (event != ref)
+        xengfx_vblank_event_destroy(event);
+
+    if (--ref->pending > 0)
+        return;
+
+    if (!ref->aborted)
+        ref->handler(ref->crtc, ref->event_id, ref->ust, ref->msc);
+    xengfx_vblank_event_destroy(ref);
+}
+
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+static void
+xengfx_vblank_notify(int fd, int ready, void *data)
+{
+    struct xengfx_drm_mode *drm_mode = data;
+
+    drmHandleEvent(fd, &drm_mode->event_context);
+}
+#else
+static void
+xengfx_vblank_block_handler(pointer data, OSTimePtr timeout, pointer read_mask)
+{
+}
+
+
+static void
+xengfx_vblank_wakeup_handler(pointer data, int err, pointer read_mask)
+{
+    struct xengfx_drm_mode *drm_mode = data;
+
+    if (err < 0)
+        return;
+
+    if (FD_ISSET(drm_mode->fd, (fd_set *) read_mask))
+        drmHandleEvent(drm_mode->fd, &drm_mode->event_context);
+}
+#endif
+
+
+Bool
+xengfx_vblank_init(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+
+    // Version 2 is the last one without the per-CRTC flip handler
+    drm_mode->event_context.version = 2;
+    drm_mode->event_context.vblank_handler = xengfx_vblank_handler;
+    drm_mode->event_context.page_flip_handler = xengfx_page_flip_handler;
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+    return SetNotifyFd(drm_mode->fd, xengfx_vblank_notify, X_NOTIFY_READ, drm_mode);
+#else
+    AddGeneralSocket(drm_mode->fd);
+    return RegisterBlockAndWakeupHandlers(xengfx_vblank_block_handler,
+                                          xengfx_vblank_wakeup_handler,
+                                          drm_mode);
+#endif
+}
+
+
+void
+xengfx_vblank_fini(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+    struct xengfx_vblank_event *event;
+    CARD32 deadline = GetTimeInMillis() + XENGFX_VBLANK_DRAIN_TIMEOUT;
+    struct pollfd pfd;
+    int timeout;
+
+    // The kernel still owns the pending events: they are freed without
+    // notification when they are delivered
+    for (event = drm_mode->events; event; event = event->next)
+        event->aborted = TRUE;
+
+    // Flips complete within a frame, wait for them while the handler is
+    // still there. Vblanks queued further ahead stay on the list and are
+    // freed by the next server generation's handler.
+    pfd.fd = drm_mode->fd;
+    pfd.events = POLLIN;
+    while (drm_mode->events)
+    {
+        timeout = (int) (deadline - GetTimeInMillis());
+        if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0)
+            break;
+        drmHandleEvent(drm_mode->fd, &drm_mode->event_context);
+    }
+
+#ifdef XENGFX_HAVE_NOTIFY_FD
+    RemoveNotifyFd(drm_mode->fd);
+#else
+    RemoveBlockAndWakeupHandlers(xengfx_vblank_block_handler,
+                                 xengfx_vblank_wakeup_handler,
+                                 drm_mode);
+    RemoveGeneralSocket(drm_mode->fd);
+#endif
+}
+
+
+xf86CrtcPtr
+xengfx_covering_crtc(ScrnInfoPtr scrn, BoxPtr box)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    xf86CrtcPtr best = NULL;
+    int best_coverage = 0;
+    int i;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+        int x1, y1, x2, y2, coverage;
+
+        if (!crtc->enabled)
+            continue;
+
+        x1 = max(box->x1, crtc->x);
+        y1 = max(box->y1, crtc->y);
+        x2 = min(box->x2, crtc->x + xf86ModeWidth(&crtc->mode, crtc->rotation));
+        y2 = min(box->y2, crtc->y + xf86ModeHeight(&crtc->mode, crtc->rotation));
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+
+        coverage = (x2 - x1) * (y2 - y1);
+        if (coverage > best_coverage)
+        {
+            best = crtc;
+            best_coverage = coverage;
+        }
+    }
+
+    return best;
+}
+
+
+int
+xengfx_get_crtc_ust_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    drmVBlank vbl;
+
+    memset(&vbl, 0, sizeof (vbl));
+    vbl.request.type = DRM_VBLANK_RELATIVE | xengfx_crtc_pipe_select(crtc);
+    vbl.request.sequence = 0;
+
+    if (drmWaitVBlank(xengfx_crtc->drm_mode->fd, &vbl))
+        return -errno;
+
+    *ust = (uint64_t) vbl.reply.tval_sec * 1000000 + vbl.reply.tval_usec;
+    *msc = xengfx_crtc_msc_to_64(crtc, vbl.reply.sequence);
+    return 0;
+}
+
+
+Bool
+xengfx_queue_vblank(xf86CrtcPtr crtc, uint64_t event_id, uint64_t msc,
+                    xengfx_vblank_handler_proc handler)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    struct xengfx_drm_mode *drm_mode = xengfx_crtc->drm_mode;
+    struct xengfx_vblank_event *event;
+    drmVBlank vbl;
+
+    event = xengfx_vblank_event_create(drm_mode, crtc, event_id, handler);
+    if (!event)
+        return FALSE;
+
+    memset(&vbl, 0, sizeof (vbl));
+    vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+                       xengfx_crtc_pipe_select(crtc);
+    vbl.request.sequence = (uint32_t) msc;
+    vbl.request.signal = (unsigned long) event;
+
+    if (drmWaitVBlank(drm_mode->fd, &vbl))
+    {
+        xengfx_vblank_event_destroy(event);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+void
+xengfx_abort_vblank(ScrnInfoPtr scrn, uint64_t event_id)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_vblank_event *event;
+
+    for (event = xengfx->mode.events; event; event = event->next)
+        if (event->event_id == event_id)
+            event->aborted = TRUE;
+}
+
+
+static Bool
+xengfx_page_flip_crtc(struct xengfx_drm_mode *drm_mode, xf86CrtcPtr crtc,
+                      uint32_t fb_id, struct xengfx_vblank_event *ref,
+                      uint64_t event_id, xengfx_vblank_handler_proc handler)
+{
+    struct xengfx_crtc *xengfx_crtc = crtc->driver_private;
+    struct xengfx_vblank_event *event;
+
+    event = xengfx_vblank_event_create(drm_mode, crtc, event_id, handler);
+    if (!event)
+        return FALSE;
+    if (ref)
+        event->ref = ref;
+    event->ref->pending++;
+
+    if (drmModePageFlip(drm_mode->fd, xengfx_crtc->mode_crtc->crtc_id, fb_id,
+                        DRM_MODE_PAGE_FLIP_EVENT, event))
+    {
+        xf86DrvMsg(crtc->scrn->scrnIndex, X_WARNING,
+                   "page flip failed: %s\n", strerror(errno));
+        event->ref->pending--;
+        xengfx_vblank_event_destroy(event);
+        return FALSE;
+    }
+
+    // A modeset back to the front buffer must not look like a no-op
+    xengfx_crtc->committed.fb_id = fb_id;
+    return TRUE;
+}
+
+
+Bool
+xengfx_page_flip(ScrnInfoPtr scrn, xf86CrtcPtr ref_crtc, uint32_t fb_id,
+                 uint64_t event_id, xengfx_vblank_handler_proc handler)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_drm_mode *drm_mode = &xengfx->mode;
+    struct xengfx_vblank_event *ref, *event;
+    int i;
+
+    if (!ref_crtc || !ref_crtc->enabled)
+    {
+        ref_crtc = NULL;
+        for (i = 0; i < config->num_crtc && !ref_crtc; ++i)
+            if (config->crtc[i]->enabled)
+                ref_crtc = config->crtc[i];
+        if (!ref_crtc)
+            return FALSE;
+    }
+
+    // The reference event is the first one queued and the last one freed.
+    // Only CRTCs not showing the front buffer already get a modeset.
+    if (!xengfx_page_flip_crtc(drm_mode, ref_crtc, fb_id, NULL, event_id, handler))
+    {
+        xengfx_drm_set_desired_modes(scrn, drm_mode);
+        return FALSE;
+    }
+    ref = drm_mode->events;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (!crtc->enabled || crtc == ref_crtc)
+            continue;
+
+        if (!xengfx_page_flip_crtc(drm_mode, crtc, fb_id, ref, event_id, handler))
+            break;
+    }
+    if (i == config->num_crtc)
+        return TRUE;
+
+    // The CRTCs would show different buffers: drop the flip and put the
+    // front buffer back on those already flipped. The caller copies instead.
+    ref->aborted = TRUE;
+    for (event = drm_mode->events; event; event = event->next)
+        if (event->ref == ref)
+            xengfx_crtc_invalidate(event->crtc);
+    xengfx_drm_set_desired_modes(scrn, drm_mode);
+
+    return FALSE;
+}
@@ -0,0 +1,970 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+
+#include "xengfx_driver.h"
+#include "xengfx_drm.h"
+
+#include <X11/extensions/Xv.h>
+#include <fourcc.h>
+#include <damage.h>
+
+// Frames go to an overlay plane when the backend has one, otherwise they
+// are converted and scaled on the CPU straight into the drawable, like a
+// textured video adaptor without the texture unit.
+#define XENGFX_VIDEO_NUM_PORTS      16
+#define XENGFX_VIDEO_MAX_SIZE       4096
+
+struct xengfx_video_port
+{
+    // Row buffers, grown on demand
+    uint8_t *rows;
+    size_t rows_size;
+
+    // Overlay plane showing the frames, double buffered
+    struct xengfx_plane *plane;
+    struct xengfx_bo *overlay_bo[2];
+    int overlay_cur;
+    uint32_t overlay_format;
+    int overlay_width;
+    int overlay_height;
+};
+
+// Source image of a PutImage, chroma positions are in luma samples
+struct xengfx_video_frame
+{
+    int id;
+    int width;
+    int height;
+    const uint8_t *planes[3];
+    int pitches[3];
+    Bool packed;
+    int chroma_shift_y;
+
+    // Source position of the drawable origin and steps, in 16.16
+    int drw_x;
+    int drw_y;
+    int src_x;
+    int src_y;
+    int dx;
+    int dy;
+};
+
+typedef void (*xengfx_video_lerp_proc)(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                                       int f, int n);
+typedef void (*xengfx_video_convert_proc)(uint32_t *dst, const uint8_t *y,
+                                          const uint8_t *u, const uint8_t *v, int n);
+
+static xengfx_video_lerp_proc xengfx_video_lerp;
+static xengfx_video_convert_proc xengfx_video_convert;
+
+
+// dst = (a * (256 - f) + b * f) / 256, with 0 <= f < 256
+static void
+xengfx_video_lerp_generic(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        dst[i] = (a[i] * (256 - f) + b[i] * f) >> 8;
+}
+
+
+static inline int
+xengfx_video_mulhi(int a, int k)
+{
+    return (a * k) >> 16;
+}
+
+
+static inline uint32_t
+xengfx_video_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+// BT.601 limited range to x8r8g8b8. The arithmetic is the one of the SIMD
+// kernels: components scaled by 64 and multiplied by 4 times the usual
+// 8 bits coefficients, keeping the high 16 bits. The luma one is rounded
+// up so nominal white reaches 255 despite the truncation.
+static void
+xengfx_video_convert_generic(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                             const uint8_t *v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+    {
+        int c = (y[i] - 16) * 64;
+        int d = (u[i] - 128) * 64;
+        int e = (v[i] - 128) * 64;
+        int l = xengfx_video_mulhi(c, 1196);
+        int r = l + xengfx_video_mulhi(e, 1636);
+        int g = l - xengfx_video_mulhi(d, 400) - xengfx_video_mulhi(e, 832);
+        int b = l + xengfx_video_mulhi(d, 2064);
+
+        dst[i] = 0xff000000 | xengfx_video_clamp(r) << 16 |
+                 xengfx_video_clamp(g) << 8 | xengfx_video_clamp(b);
+    }
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void
+xengfx_video_lerp_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i fa = _mm_set1_epi16(256 - f);
+    __m128i fb = _mm_set1_epi16(f);
+    int i;
+
+    // Sums stay below 65536, unsigned 16 bits are enough
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), fa),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), fb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), fa),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), fb));
+
+        lo = _mm_srli_epi16(lo, 8);
+        hi = _mm_srli_epi16(hi, 8);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    xengfx_video_lerp_generic(dst + i, a + i, b + i, f, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static inline void
+xengfx_video_yuv_sse2(__m128i y, __m128i u, __m128i v, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i c = _mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), 6);
+    __m128i d = _mm_slli_epi16(_mm_sub_epi16(u, _mm_set1_epi16(128)), 6);
+    __m128i e = _mm_slli_epi16(_mm_sub_epi16(v, _mm_set1_epi16(128)), 6);
+    __m128i l = _mm_mulhi_epi16(c, _mm_set1_epi16(1196));
+
+    *r = _mm_add_epi16(l, _mm_mulhi_epi16(e, _mm_set1_epi16(1636)));
+    *g = _mm_sub_epi16(_mm_sub_epi16(l, _mm_mulhi_epi16(d, _mm_set1_epi16(400))),
+                       _mm_mulhi_epi16(e, _mm_set1_epi16(832)));
+    *b = _mm_add_epi16(l, _mm_mulhi_epi16(d, _mm_set1_epi16(2064)));
+}
+
+
+// Saturate 8 pixels worth of 16 bits components and store them as x8r8g8b8
+__attribute__((target("sse2")))
+static inline void
+xengfx_video_store_sse2(uint32_t *dst, __m128i r, __m128i g, __m128i b)
+{
+    __m128i r8 = _mm_packus_epi16(r, r);
+    __m128i g8 = _mm_packus_epi16(g, g);
+    __m128i b8 = _mm_packus_epi16(b, b);
+    __m128i bg = _mm_unpacklo_epi8(b8, g8);
+    __m128i ra = _mm_unpacklo_epi8(r8, _mm_set1_epi8(-1));
+
+    _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *) (dst + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+
+__attribute__((target("sse2")))
+static void
+xengfx_video_convert_sse2(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                          const uint8_t *v, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m128i vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y + i)), zero);
+        __m128i vu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (u + i)), zero);
+        __m128i vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (v + i)), zero);
+        __m128i r, g, b;
+
+        xengfx_video_yuv_sse2(vy, vu, vv, &r, &g, &b);
+        xengfx_video_store_sse2(dst + i, r, g, b);
+    }
+
+    xengfx_video_convert_generic(dst + i, y + i, u + i, v + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void
+xengfx_video_lerp_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i fa = _mm256_set1_epi16(256 - f);
+    __m256i fb = _mm256_set1_epi16(f);
+    int i;
+
+    // Unpacking and packing both work per lane, the byte order is kept
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), fa),
+                                      _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), fb));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), fa),
+                                      _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), fb));
+
+        lo = _mm256_srli_epi16(lo, 8);
+        hi = _mm256_srli_epi16(hi, 8);
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    xengfx_video_lerp_sse2(dst + i, a + i, b + i, f, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void
+xengfx_video_convert_avx2(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                          const uint8_t *v, int n)
+{
+    __m256i y16 = _mm256_set1_epi16(16);
+    __m256i c128 = _mm256_set1_epi16(128);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m256i vy = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y + i)));
+        __m256i vu = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (u + i)));
+        __m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (v + i)));
+        __m256i c = _mm256_slli_epi16(_mm256_sub_epi16(vy, y16), 6);
+        __m256i d = _mm256_slli_epi16(_mm256_sub_epi16(vu, c128), 6);
+        __m256i e = _mm256_slli_epi16(_mm256_sub_epi16(vv, c128), 6);
+        __m256i l = _mm256_mulhi_epi16(c, _mm256_set1_epi16(1196));
+        __m256i r, g, b;
+
+        r = _mm256_add_epi16(l, _mm256_mulhi_epi16(e, _mm256_set1_epi16(1636)));
+        g = _mm256_sub_epi16(_mm256_sub_epi16(l, _mm256_mulhi_epi16(d, _mm256_set1_epi16(400))),
+                             _mm256_mulhi_epi16(e, _mm256_set1_epi16(832)));
+        b = _mm256_add_epi16(l, _mm256_mulhi_epi16(d, _mm256_set1_epi16(2064)));
+
+        xengfx_video_store_sse2(dst + i, _mm256_castsi256_si128(r),
+                                _mm256_castsi256_si128(g), _mm256_castsi256_si128(b));
+        xengfx_video_store_sse2(dst + i + 8, _mm256_extracti128_si256(r, 1),
+                                _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1));
+    }
+
+    xengfx_video_convert_sse2(dst + i, y + i, u + i, v + i, n - i);
+}
+#endif
+
+
+static void
+xengfx_video_select(ScrnInfoPtr scrn)
+{
+    const char *name = "generic";
+
+    xengfx_video_lerp = xengfx_video_lerp_generic;
+    xengfx_video_convert = xengfx_video_convert_generic;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("avx2"))
+    {
+        xengfx_video_lerp = xengfx_video_lerp_avx2;
+        xengfx_video_convert = xengfx_video_convert_avx2;
+        name = "AVX2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        xengfx_video_lerp = xengfx_video_lerp_sse2;
+        xengfx_video_convert = xengfx_video_convert_sse2;
+        name = "SSE2";
+    }
+#endif
+
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Video conversion uses %s kernels\n", name);
+}
+
+
+// n samples of a bilinear resampling of src, from the 16.16 position x
+static void
+xengfx_video_scale_row(uint8_t *dst, const uint8_t *src, int width, int x, int dx, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i, x += dx)
+    {
+        int x0 = min(x >> 16, width - 1);
+        int x1 = min(x0 + 1, width - 1);
+        int f = (x >> 8) & 0xff;
+
+        dst[i] = (src[x0] * (256 - f) + src[x1] * f) >> 8;
+    }
+}
+
+
+static void
+xengfx_video_unpack_row(const struct xengfx_video_frame *frame, int row,
+                        uint8_t *y, uint8_t *u, uint8_t *v)
+{
+    const uint8_t *p = frame->planes[0] + row * frame->pitches[0];
+    int i;
+
+    if (frame->id == FOURCC_UYVY)
+    {
+        for (i = 0; i < frame->width / 2; ++i, p += 4)
+        {
+            u[i] = p[0];
+            y[2 * i] = p[1];
+            v[i] = p[2];
+            y[2 * i + 1] = p[3];
+        }
+    }
+    else
+    {
+        for (i = 0; i < frame->width / 2; ++i, p += 4)
+        {
+            y[2 * i] = p[0];
+            u[i] = p[1];
+            y[2 * i + 1] = p[2];
+            v[i] = p[3];
+        }
+    }
+}
+
+
+static Bool
+xengfx_video_grow(struct xengfx_video_port *port, size_t size)
+{
+    uint8_t *rows;
+
+    if (port->rows_size >= size)
+        return TRUE;
+
+    rows = realloc(port->rows, size);
+    if (!rows)
+        return FALSE;
+
+    port->rows = rows;
+    port->rows_size = size;
+    return TRUE;
+}
+
+
+// Convert the part of the frame covered by box, in screen coordinates,
+// into the pixmap at offset (xoff, yoff).
+static Bool
+xengfx_video_draw_box(struct xengfx_video_port *port, const struct xengfx_video_frame *frame,
+                      PixmapPtr pixmap, int xoff, int yoff, const BoxRec *box)
+{
+    int width = frame->width;
+    int cwidth = frame->width / 2;
+    int bw = box->x2 - box->x1;
+    const uint8_t *l0, *l1, *u0, *u1, *v0, *v1;
+    uint8_t *vy, *vu, *vv, *hy, *hu, *hv, *py[2], *pu[2], *pv[2];
+    int sx, yy;
+
+    // Vertically filtered rows, two unpacked rows and scaled rows
+    if (!xengfx_video_grow(port, 2 * width + 2 * 2 * width + 3 * bw))
+        return FALSE;
+
+    vy = port->rows;
+    vu = vy + width;
+    vv = vu + cwidth;
+    py[0] = vv + cwidth;
+    py[1] = py[0] + width;
+    pu[0] = py[1] + width;
+    pu[1] = pu[0] + cwidth;
+    pv[0] = pu[1] + cwidth;
+    pv[1] = pv[0] + cwidth;
+    hy = pv[1] + cwidth;
+    hu = hy + bw;
+    hv = hu + bw;
+
+    sx = frame->src_x + (box->x1 - frame->drw_x) * frame->dx;
+
+    for (yy = box->y1; yy < box->y2; ++yy)
+    {
+        uint32_t *dst = (uint32_t *) ((uint8_t *) pixmap->devPrivate.ptr +
+                                      (yy + yoff) * pixmap->devKind) + box->x1 + xoff;
+        int sy = frame->src_y + (yy - frame->drw_y) * frame->dy;
+        int csy = sy >> frame->chroma_shift_y;
+        int crows = frame->height >> frame->chroma_shift_y;
+        int r0 = min(sy >> 16, frame->height - 1);
+        int r1 = min(r0 + 1, frame->height - 1);
+        int c0 = min(csy >> 16, crows - 1);
+        int c1 = min(c0 + 1, crows - 1);
+        int f = (sy >> 8) & 0xff;
+        int cf = (csy >> 8) & 0xff;
+
+        if (frame->packed)
+        {
+            xengfx_video_unpack_row(frame, r0, py[0], pu[0], pv[0]);
+            if (f)
+                xengfx_video_unpack_row(frame, r1, py[1], pu[1], pv[1]);
+            l0 = py[0];
+            l1 = py[1];
+            u0 = pu[0];
+            u1 = pu[1];
+            v0 = pv[0];
+            v1 = pv[1];
+        }
+        else
+        {
+            l0 = frame->planes[0] + r0 * frame->pitches[0];
+            l1 = frame->planes[0] + r1 * frame->pitches[0];
+            u0 = frame->planes[1] + c0 * frame->pitches[1];
+            u1 = frame->planes[1] + c1 * frame->pitches[1];
+            v0 = frame->planes[2] + c0 * frame->pitches[2];
+            v1 = frame->planes[2] + c1 * frame->pitches[2];
+        }
+
+        // Rows landing on a source row are used as they are
+        if (f)
+        {
+            xengfx_video_lerp(vy, l0, l1, f, width);
+            l0 = vy;
+        }
+        if (cf)
+        {
+            xengfx_video_lerp(vu, u0, u1, cf, cwidth);
+            xengfx_video_lerp(vv, v0, v1, cf, cwidth);
+            u0 = vu;
+            v0 = vv;
+        }
+
+        xengfx_video_scale_row(hy, l0, width, sx, frame->dx, bw);
+        xengfx_video_scale_row(hu, u0, cwidth, sx / 2, frame->dx / 2, bw);
+        xengfx_video_scale_row(hv, v0, cwidth, sx / 2, frame->dx / 2, bw);
+        xengfx_video_convert(dst, hy, hu, hv, bw);
+    }
+
+    return TRUE;
+}
+
+
+static void
+xengfx_video_overlay_stop(ScrnInfoPtr scrn, struct xengfx_video_port *port, Bool free_bos)
+{
+    struct xengfx_drm_mode *drm_mode = &to_xengfx_private(scrn)->mode;
+    int i;
+
+    if (port->plane)
+    {
+        xengfx_plane_put(drm_mode, port->plane);
+        port->plane = NULL;
+    }
+
+    if (!free_bos)
+        return;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (port->overlay_bo[i])
+            xengfx_drm_destroy_bo(drm_mode, port->overlay_bo[i]);
+        port->overlay_bo[i] = NULL;
+    }
+}
+
+
+// Planar formats keep their chroma planes after the luma one, at half its
+// pitch, in a single BO.
+static struct xengfx_bo*
+xengfx_video_overlay_bo(struct xengfx_drm_mode *drm_mode, const struct xengfx_video_frame *frame,
+                        uint32_t format)
+{
+    uint32_t flags = DRM_XENGFX_GEM_WC | DRM_XENGFX_GEM_PITCH_64 | DRM_XENGFX_GEM_SCANOUT;
+    uint32_t handles[4], pitches[4], offsets[4];
+    struct xengfx_bo *bo;
+
+    if (frame->packed)
+        bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_OVERLAY, frame->width, frame->height,
+                                  16, flags);
+    else
+        bo = xengfx_drm_create_bo(drm_mode, XENGFX_BO_OVERLAY, frame->width,
+                                  frame->height * 3 / 2, 8, flags);
+    if (!bo)
+        return NULL;
+
+    if (xengfx_drm_map_bo(drm_mode->fd, bo))
+        goto err;
+
+    memset(handles, 0, sizeof (handles));
+    memset(pitches, 0, sizeof (pitches));
+    memset(offsets, 0, sizeof (offsets));
+    handles[0] = bo->handle;
+    pitches[0] = bo->pitch;
+    if (!frame->packed)
+    {
+        handles[1] = handles[2] = bo->handle;
+        pitches[1] = pitches[2] = bo->pitch / 2;
+        offsets[1] = bo->pitch * frame->height;
+        offsets[2] = offsets[1] + bo->pitch / 2 * (frame->height / 2);
+    }
+
+    if (drmModeAddFB2(drm_mode->fd, frame->width, frame->height, format,
+                      handles, pitches, offsets, &bo->fb_id, 0))
+        goto err;
+
+    return bo;
+
+err:
+    xengfx_drm_destroy_bo(drm_mode, bo);
+    return NULL;
+}
+
+
+static void
+xengfx_video_overlay_copy(struct xengfx_bo *bo, const struct xengfx_video_frame *frame,
+                          uint32_t format)
+{
+    uint8_t *dst = bo->ptr;
+    int row, i;
+
+    if (frame->packed)
+    {
+        for (row = 0; row < frame->height; ++row)
+            memcpy(dst + row * bo->pitch, frame->planes[0] + row * frame->pitches[0],
+                   frame->width * 2);
+        return;
+    }
+
+    for (row = 0; row < frame->height; ++row)
+        memcpy(dst + row * bo->pitch, frame->planes[0] + row * frame->pitches[0],
+               frame->width);
+
+    for (i = 0; i < 2; ++i)
+    {
+        // frame planes are always Y, U, V
+        int src = format == DRM_FORMAT_YVU420 ? 2 - i : 1 + i;
+        uint8_t *chroma = dst + bo->pitch * frame->height + i * (bo->pitch / 2) * (frame->height / 2);
+
+        for (row = 0; row < frame->height / 2; ++row)
+            memcpy(chroma + row * (bo->pitch / 2),
+                   frame->planes[src] + row * frame->pitches[src], frame->width / 2);
+    }
+}
+
+
+// Hand the frame to the backend on an overlay plane. Planes are not
+// clipped, so this is only done for unobscured windows of the front buffer
+// lying on a single CRTC. The source rectangle is in 16.16.
+static Bool
+xengfx_video_put_overlay(ScrnInfoPtr scrn, struct xengfx_video_port *port,
+                         const struct xengfx_video_frame *frame, DrawablePtr drawable,
+                         const BoxRec *dst, RegionPtr clip,
+                         int src_x, int src_y, int src_w, int src_h)
+{
+    struct xengfx_drm_mode *drm_mode = &to_xengfx_private(scrn)->mode;
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    ScreenPtr screen = drawable->pScreen;
+    BoxPtr extents = RegionExtents(clip);
+    struct xengfx_crtc *xengfx_crtc;
+    struct xengfx_plane *plane;
+    struct xengfx_bo *bo;
+    xf86CrtcPtr crtc = NULL;
+    uint32_t format;
+    int i, next;
+
+    if (!drm_mode->num_planes || !scrn->vtSema)
+        return FALSE;
+
+    if (drawable->type != DRAWABLE_WINDOW ||
+        screen->GetWindowPixmap((WindowPtr) drawable) != screen->GetScreenPixmap(screen) ||
+        RegionNumRects(clip) != 1 ||
+        extents->x1 != dst->x1 || extents->y1 != dst->y1 ||
+        extents->x2 != dst->x2 || extents->y2 != dst->y2)
+        return FALSE;
+
+    for (i = 0; i < config->num_crtc; ++i)
+    {
+        xf86CrtcPtr c = config->crtc[i];
+
+        // Planes are positioned in the mode, not through the transform
+        if (c->enabled && c->rotation == RR_Rotate_0 && !c->transformPresent &&
+            dst->x1 >= c->x && dst->y1 >= c->y &&
+            dst->x2 <= c->x + c->mode.HDisplay && dst->y2 <= c->y + c->mode.VDisplay)
+        {
+            crtc = c;
+            break;
+        }
+    }
+    if (!crtc)
+        return FALSE;
+    xengfx_crtc = crtc->driver_private;
+
+    format = frame->packed ? (frame->id == FOURCC_UYVY ? DRM_FORMAT_UYVY : DRM_FORMAT_YUYV) :
+                             DRM_FORMAT_YUV420;
+    plane = xengfx_plane_get(drm_mode, xengfx_crtc->pipe, format, port);
+    if (!plane && format == DRM_FORMAT_YUV420)
+    {
+        format = DRM_FORMAT_YVU420;
+        plane = xengfx_plane_get(drm_mode, xengfx_crtc->pipe, format, port);
+    }
+    if (!plane)
+        return FALSE;
+
+    if (port->plane != plane)
+        xengfx_video_overlay_stop(scrn, port, FALSE);
+    port->plane = plane;
+
+    if (port->overlay_format != format || port->overlay_width != frame->width ||
+        port->overlay_height != frame->height)
+    {
+        xengfx_video_overlay_stop(scrn, port, TRUE);
+        port->plane = xengfx_plane_get(drm_mode, xengfx_crtc->pipe, format, port);
+        port->overlay_format = format;
+        port->overlay_width = frame->width;
+        port->overlay_height = frame->height;
+        if (!port->plane)
+            return FALSE;
+    }
+
+    // Fill the buffer the plane is not showing
+    next = port->overlay_cur ^ 1;
+    if (!port->overlay_bo[next])
+        port->overlay_bo[next] = xengfx_video_overlay_bo(drm_mode, frame, format);
+    bo = port->overlay_bo[next];
+    if (!bo)
+        return FALSE;
+
+    xengfx_video_overlay_copy(bo, frame, format);
+
+    if (drmModeSetPlane(drm_mode->fd, port->plane->plane->plane_id,
+                        xengfx_crtc->mode_crtc->crtc_id, bo->fb_id, 0,
+                        dst->x1 - crtc->x, dst->y1 - crtc->y,
+                        dst->x2 - dst->x1, dst->y2 - dst->y1,
+                        src_x, src_y, src_w, src_h))
+        return FALSE;
+
+    port->overlay_cur = next;
+    return TRUE;
+}
+
+
+static int
+xengfx_video_put_image(ScrnInfoPtr scrn,
+                       short src_x, short src_y, short drw_x, short drw_y,
+                       short src_w, short src_h, short drw_w, short drw_h,
+                       int id, unsigned char *buf, short width, short height,
+                       Bool synchronous, RegionPtr clip_boxes, pointer data,
+                       DrawablePtr drawable)
+{
+    struct xengfx_video_port *port = data;
+    ScreenPtr screen = drawable->pScreen;
+    struct xengfx_video_frame frame;
+    PixmapPtr pixmap;
+    RegionRec clip;
+    BoxRec extents;
+    BoxPtr box;
+    INT32 x1, x2, y1, y2;
+    int xoff = 0, yoff = 0;
+    int pitch, cpitch, i, n;
+
+    if (src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0)
+        return Success;
+    // Past that the 16.16 source coordinates overflow
+    if (src_x + src_w > MAXSHORT || src_y + src_h > MAXSHORT)
+        return BadValue;
+    if (drawable->bitsPerPixel != 32)
+        return BadMatch;
+
+    if (drawable->type == DRAWABLE_WINDOW)
+        pixmap = screen->GetWindowPixmap((WindowPtr) drawable);
+    else
+        pixmap = (PixmapPtr) drawable;
+#ifdef COMPOSITE
+    // Redirected windows live at an offset in their backing pixmap
+    xoff = -pixmap->screen_x;
+    yoff = -pixmap->screen_y;
+#endif
+
+    // Same layout as xengfx_video_query_image_attributes
+    memset(&frame, 0, sizeof (frame));
+    frame.id = id;
+    frame.width = (width + 1) & ~1;
+    frame.height = height;
+    switch (id)
+    {
+        case FOURCC_YV12:
+        case FOURCC_I420:
+            frame.height = (height + 1) & ~1;
+            pitch = (frame.width + 3) & ~3;
+            cpitch = ((frame.width >> 1) + 3) & ~3;
+            frame.planes[0] = buf;
+            frame.pitches[0] = pitch;
+            frame.planes[id == FOURCC_I420 ? 1 : 2] = buf + pitch * frame.height;
+            frame.planes[id == FOURCC_I420 ? 2 : 1] = buf + pitch * frame.height +
+                                                      cpitch * (frame.height >> 1);
+            frame.pitches[1] = frame.pitches[2] = cpitch;
+            frame.chroma_shift_y = 1;
+            break;
+        case FOURCC_YUY2:
+        case FOURCC_UYVY:
+            frame.planes[0] = buf;
+            frame.pitches[0] = frame.width * 2;
+            frame.packed = TRUE;
+            break;
+        default:
+            return BadMatch;
+    }
+
+    // Clients may ask for a source rectangle outside the image, keep the
+    // part inside it and the matching part of the destination
+    x1 = src_x;
+    x2 = src_x + src_w;
+    y1 = src_y;
+    y2 = src_y + src_h;
+    extents.x1 = drw_x;
+    extents.y1 = drw_y;
+    extents.x2 = drw_x + drw_w;
+    extents.y2 = drw_y + drw_h;
+    if (!xf86XVClipVideoHelper(&extents, &x1, &x2, &y1, &y2, clip_boxes,
+                               frame.width, frame.height))
+        return Success;
+    if (extents.x1 >= extents.x2 || extents.y1 >= extents.y2)
+        return Success;
+
+    frame.drw_x = extents.x1;
+    frame.drw_y = extents.y1;
+    frame.src_x = x1;
+    frame.src_y = y1;
+    frame.dx = (x2 - x1) / (extents.x2 - extents.x1);
+    frame.dy = (y2 - y1) / (extents.y2 - extents.y1);
+
+    RegionInit(&clip, &extents, 1);
+    RegionIntersect(&clip, &clip, clip_boxes);
+
+    // The backend converts and scales, nothing is drawn on the front buffer
+    if (xengfx_video_put_overlay(scrn, port, &frame, drawable, &extents, &clip,
+                                 x1, y1, x2 - x1, y2 - y1))
+    {
+        RegionUninit(&clip);
+        return Success;
+    }
+    xengfx_video_overlay_stop(scrn, port, FALSE);
+
+    box = RegionRects(&clip);
+    n = RegionNumRects(&clip);
+    for (i = 0; i < n; ++i)
+    {
+        if (!xengfx_video_draw_box(port, &frame, pixmap, xoff, yoff, &box[i]))
+        {
+            RegionUninit(&clip);
+            return BadAlloc;
+        }
+    }
+
+    // Only the video rectangle was written
+    DamageDamageRegion(drawable, &clip);
+    RegionUninit(&clip);
+
+    return Success;
+}
+
+
+static int
+xengfx_video_query_image_attributes(ScrnInfoPtr scrn, int id,
+                                    unsigned short *w, unsigned short *h,
+                                    int *pitches, int *offsets)
+{
+    int pitch, cpitch, size;
+
+    *w = min((*w + 1) & ~1, XENGFX_VIDEO_MAX_SIZE);
+    *h = min(*h, XENGFX_VIDEO_MAX_SIZE);
+
+    if (offsets)
+        offsets[0] = 0;
+
+    switch (id)
+    {
+        case FOURCC_YV12:
+        case FOURCC_I420:
+            *h = (*h + 1) & ~1;
+            pitch = (*w + 3) & ~3;
+            cpitch = ((*w >> 1) + 3) & ~3;
+            size = pitch * *h + 2 * cpitch * (*h >> 1);
+            if (pitches)
+            {
+                pitches[0] = pitch;
+                pitches[1] = pitches[2] = cpitch;
+            }
+            if (offsets)
+            {
+                offsets[1] = pitch * *h;
+                offsets[2] = offsets[1] + cpitch * (*h >> 1);
+            }
+            break;
+        case FOURCC_YUY2:
+        case FOURCC_UYVY:
+        default:
+            size = *w * 2;
+            if (pitches)
+                pitches[0] = size;
+            size *= *h;
+            break;
+    }
+
+    return size;
+}
+
+
+// With VIDEO_OVERLAID_IMAGES, Xv calls this when the window is moved,
+// clipped, unmapped or destroyed. There is no ReputImage, so the frame stays
+// off the overlay plane until the client's next PutImage.
+static void
+xengfx_video_stop_video(ScrnInfoPtr scrn, pointer data, Bool shutdown)
+{
+    xengfx_video_overlay_stop(scrn, data, shutdown);
+}
+
+
+static int
+xengfx_video_set_port_attribute(ScrnInfoPtr scrn, Atom attribute, INT32 value, pointer data)
+{
+    return BadMatch;
+}
+
+
+static int
+xengfx_video_get_port_attribute(ScrnInfoPtr scrn, Atom attribute, INT32 *value, pointer data)
+{
+    return BadMatch;
+}
+
+
+static void
+xengfx_video_query_best_size(ScrnInfoPtr scrn, Bool motion,
+                             short vid_w, short vid_h, short drw_w, short drw_h,
+                             unsigned int *p_w, unsigned int *p_h, pointer data)
+{
+    // Any scaling is done
+    *p_w = drw_w;
+    *p_h = drw_h;
+}
+
+
+static XF86VideoEncodingRec xengfx_video_encodings[] = {
+    { 0, "XV_IMAGE", XENGFX_VIDEO_MAX_SIZE, XENGFX_VIDEO_MAX_SIZE, { 1, 1 } }
+};
+
+static XF86VideoFormatRec xengfx_video_formats[] = {
+    { 24, TrueColor }
+};
+
+static XF86ImageRec xengfx_video_images[] = {
+    XVIMAGE_YUY2,
+    XVIMAGE_YV12,
+    XVIMAGE_I420,
+    XVIMAGE_UYVY
+};
+
+
+Bool
+xengfx_video_init(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    struct xengfx_private *xengfx = to_xengfx_private(scrn);
+    struct xengfx_video_port *ports;
+    XF86VideoAdaptorPtr adaptor;
+    int i;
+
+    // The kernels only write x8r8g8b8
+    if (scrn->bitsPerPixel != 32 || scrn->depth != 24)
+    {
+        xf86DrvMsg(scrn->scrnIndex, X_INFO, "XVideo needs depth 24\n");
+        return FALSE;
+    }
+
+    adaptor = calloc(1, sizeof (XF86VideoAdaptorRec) +
+                     XENGFX_VIDEO_NUM_PORTS * (sizeof (DevUnion) + sizeof (*ports)));
+    if (!adaptor)
+        return FALSE;
+
+    adaptor->type = XvWindowMask | XvInputMask | XvImageMask;
+    adaptor->flags = VIDEO_OVERLAID_IMAGES;
+    adaptor->name = "xengfx Video";
+    adaptor->nEncodings = sizeof (xengfx_video_encodings) / sizeof (xengfx_video_encodings[0]);
+    adaptor->pEncodings = xengfx_video_encodings;
+    adaptor->nFormats = sizeof (xengfx_video_formats) / sizeof (xengfx_video_formats[0]);
+    adaptor->pFormats = xengfx_video_formats;
+    adaptor->nPorts = XENGFX_VIDEO_NUM_PORTS;
+    adaptor->pPortPrivates = (DevUnion *) &adaptor[1];
+    adaptor->nAttributes = 0;
+    adaptor->pAttributes = NULL;
+    adaptor->nImages = sizeof (xengfx_video_images) / sizeof (xengfx_video_images[0]);
+    adaptor->pImages = xengfx_video_images;
+
+    ports = (struct xengfx_video_port *) &adaptor->pPortPrivates[XENGFX_VIDEO_NUM_PORTS];
+    for (i = 0; i < XENGFX_VIDEO_NUM_PORTS; ++i)
+        adaptor->pPortPrivates[i].ptr = &ports[i];
+
+    adaptor->StopVideo = xengfx_video_stop_video;
+    adaptor->SetPortAttribute = xengfx_video_set_port_attribute;
+    adaptor->GetPortAttribute = xengfx_video_get_port_attribute;
+    adaptor->QueryBestSize = xengfx_video_query_best_size;
+    adaptor->PutImage = xengfx_video_put_image;
+    adaptor->QueryImageAttributes = xengfx_video_query_image_attributes;
+
+    if (!xf86XVScreenInit(screen, &adaptor, 1))
+    {
+        free(adaptor);
+        return FALSE;
+    }
+
+    xengfx_video_select(scrn);
+    xengfx->video_adaptor = adaptor;
+
+    return TRUE;
+}
+
+
+void
+xengfx_video_fini(ScreenPtr screen)
+{
+    struct xengfx_private *xengfx = to_xengfx_private(xf86ScreenToScrn(screen));
+    XF86VideoAdaptorPtr adaptor = xengfx->video_adaptor;
+    int i;
+
+    if (!adaptor)
+        return;
+
+    for (i = 0; i < adaptor->nPorts; ++i)
+    {
+        struct xengfx_video_port *port = adaptor->pPortPrivates[i].ptr;
+
+        xengfx_video_overlay_stop(xf86ScreenToScrn(screen), port, TRUE);
+        free(port->rows);
+    }
+
+    free(adaptor);
+    xengfx->video_adaptor = NULL;
+}
@@ -0,0 +1,877 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_device.h"
+
+#define MOCK_PAGE_SIZE      4096
+#define MOCK_FD_BASE        1000
+
+#define MOCK_MIN(a, b)      ((a) < (b) ? (a) : (b))
+#define MOCK_MAX(a, b)      ((a) > (b) ? (a) : (b))
+
+struct mock_object
+{
+    int refs;           // handles and dma-bufs
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+    uint32_t flags;
+    uint32_t pitch;
+    uint64_t size;
+    void *data;
+};
+
+struct mock_dmabuf
+{
+    struct mock_object *object;
+    int writable;
+};
+
+struct mock_fb
+{
+    struct mock_file *owner;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    int num_planes;
+    struct mock_object *objects[3];
+    uint32_t pitches[3];
+    uint32_t offsets[3];
+};
+
+struct mock_device
+{
+    int objects;
+    struct mock_dmabuf dmabufs[MOCK_MAX_DMABUFS];     // fd - MOCK_FD_BASE
+    struct mock_fb fbs[MOCK_MAX_FBS];                 // fb_id - 1
+    struct mock_crtc crtcs[MOCK_NUM_CRTCS];
+    struct mock_plane planes[MOCK_NUM_PLANES];
+    uint64_t dirty_area;
+    int dirty_boxes;
+};
+
+
+struct mock_device *
+mock_device_create(void)
+{
+    return calloc(1, sizeof (struct mock_device));
+}
+
+
+void
+mock_device_destroy(struct mock_device *device)
+{
+    free(device);
+}
+
+
+struct mock_file *
+mock_open(struct mock_device *device)
+{
+    struct mock_file *file = calloc(1, sizeof (*file));
+
+    if (file)
+        file->device = device;
+
+    return file;
+}
+
+
+static void
+mock_object_unref(struct mock_device *device, struct mock_object *object)
+{
+    if (--object->refs > 0)
+        return;
+
+    free(object->data);
+    free(object);
+    device->objects--;
+}
+
+
+void
+mock_close(struct mock_file *file)
+{
+    int i;
+
+    // Framebuffers go away with the file that added them
+    for (i = 0; i < MOCK_MAX_FBS; ++i)
+        if (file->device->fbs[i].owner == file && file->device->fbs[i].num_planes)
+            mock_rm_fb(file, i + 1);
+
+    for (i = 0; i < MOCK_MAX_HANDLES; ++i)
+        if (file->handles[i])
+            mock_object_unref(file->device, file->handles[i]);
+
+    free(file);
+}
+
+
+static struct mock_object *
+mock_lookup(struct mock_file *file, uint32_t handle)
+{
+    if (handle == 0 || handle > MOCK_MAX_HANDLES)
+        return NULL;
+
+    return file->handles[handle - 1];
+}
+
+
+static int
+mock_add_handle(struct mock_file *file, struct mock_object *object, uint32_t *handle)
+{
+    int i;
+
+    for (i = 0; i < MOCK_MAX_HANDLES; ++i)
+    {
+        if (!file->handles[i])
+        {
+            file->handles[i] = object;
+            object->refs++;
+            *handle = i + 1;
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+
+// Only 64 bytes pitch alignment is honoured, other flags are dropped
+int
+mock_gem_create(struct mock_file *file, struct drm_xengfx_gem_create *arg)
+{
+    struct mock_object *object;
+    uint32_t granted = arg->flags & (DRM_XENGFX_GEM_CACHE_MASK | DRM_XENGFX_GEM_SCANOUT);
+    uint64_t pitch;
+    int ret;
+
+    if (!arg->width || !arg->height || !arg->bpp || arg->bpp > 32)
+        return -EINVAL;
+
+    pitch = ((uint64_t) arg->width * arg->bpp + 7) / 8;
+    if ((arg->flags & DRM_XENGFX_GEM_PITCH_MASK) == DRM_XENGFX_GEM_PITCH_64)
+    {
+        pitch = (pitch + 63) & ~63ULL;
+        granted |= DRM_XENGFX_GEM_PITCH_64;
+    }
+    else
+        pitch = (pitch + 3) & ~3ULL;
+
+    if (pitch > UINT32_MAX)
+        return -EINVAL;
+
+    object = calloc(1, sizeof (*object));
+    if (!object)
+        return -ENOMEM;
+
+    object->width = arg->width;
+    object->height = arg->height;
+    object->bpp = arg->bpp;
+    object->flags = granted;
+    object->pitch = pitch;
+    object->size = (pitch * arg->height + MOCK_PAGE_SIZE - 1) & ~(uint64_t) (MOCK_PAGE_SIZE - 1);
+    object->data = calloc(1, object->size);
+    if (!object->data)
+    {
+        free(object);
+        return -ENOMEM;
+    }
+    file->device->objects++;
+
+    ret = mock_add_handle(file, object, &arg->handle);
+    if (ret)
+    {
+        object->refs = 1;
+        mock_object_unref(file->device, object);
+        return ret;
+    }
+
+    arg->pitch = object->pitch;
+    arg->size = object->size;
+    arg->flags = granted | DRM_XENGFX_GEM_GRANTED;
+
+    return 0;
+}
+
+
+int
+mock_gem_close(struct mock_file *file, uint32_t handle)
+{
+    struct mock_object *object = mock_lookup(file, handle);
+
+    if (!object)
+        return -EINVAL;
+
+    file->handles[handle - 1] = NULL;
+    mock_object_unref(file->device, object);
+
+    return 0;
+}
+
+
+void *
+mock_gem_map(struct mock_file *file, uint32_t handle)
+{
+    struct mock_object *object = mock_lookup(file, handle);
+
+    return object ? object->data : NULL;
+}
+
+
+int
+mock_live_objects(struct mock_device *device)
+{
+    return device->objects;
+}
+
+
+static struct mock_dmabuf *
+mock_dmabuf_lookup(struct mock_device *device, int fd)
+{
+    if (fd < MOCK_FD_BASE || fd >= MOCK_FD_BASE + MOCK_MAX_DMABUFS ||
+        !device->dmabufs[fd - MOCK_FD_BASE].object)
+        return NULL;
+
+    return &device->dmabufs[fd - MOCK_FD_BASE];
+}
+
+
+int
+mock_prime_handle_to_fd(struct mock_file *file, uint32_t handle, uint32_t flags, int *fd)
+{
+    struct mock_object *object = mock_lookup(file, handle);
+    int i;
+
+    if (!object)
+        return -ENOENT;
+
+    for (i = 0; i < MOCK_MAX_DMABUFS; ++i)
+    {
+        if (!file->device->dmabufs[i].object)
+        {
+            file->device->dmabufs[i].object = object;
+            file->device->dmabufs[i].writable = !!(flags & MOCK_PRIME_RDWR);
+            object->refs++;
+            *fd = MOCK_FD_BASE + i;
+            return 0;
+        }
+    }
+
+    return -EMFILE;
+}
+
+
+int
+mock_prime_fd_to_handle(struct mock_file *file, int fd, uint32_t *handle)
+{
+    struct mock_dmabuf *dmabuf = mock_dmabuf_lookup(file->device, fd);
+    int i;
+
+    if (!dmabuf)
+        return -EBADF;
+
+    // Like the kernel, one object has one handle per file
+    for (i = 0; i < MOCK_MAX_HANDLES; ++i)
+    {
+        if (file->handles[i] == dmabuf->object)
+        {
+            *handle = i + 1;
+            return 0;
+        }
+    }
+
+    return mock_add_handle(file, dmabuf->object, handle);
+}
+
+
+int
+mock_dmabuf_close(struct mock_device *device, int fd)
+{
+    struct mock_dmabuf *dmabuf = mock_dmabuf_lookup(device, fd);
+
+    if (!dmabuf)
+        return -EBADF;
+
+    mock_object_unref(device, dmabuf->object);
+    dmabuf->object = NULL;
+
+    return 0;
+}
+
+
+int64_t
+mock_dmabuf_size(struct mock_device *device, int fd)
+{
+    struct mock_dmabuf *dmabuf = mock_dmabuf_lookup(device, fd);
+
+    return dmabuf ? (int64_t) dmabuf->object->size : -EBADF;
+}
+
+
+int
+mock_dmabuf_writable(struct mock_device *device, int fd)
+{
+    struct mock_dmabuf *dmabuf = mock_dmabuf_lookup(device, fd);
+
+    return dmabuf ? dmabuf->writable : -EBADF;
+}
+
+
+static uint8_t *
+mock_fb_data(const struct mock_fb *fb, int plane)
+{
+    return (uint8_t *) fb->objects[plane]->data + fb->offsets[plane];
+}
+
+
+// Planes of a format, with their bytes per pixel and subsampling
+static int
+mock_format_layout(uint32_t format, int cpp[3], int sub[3])
+{
+    switch (format)
+    {
+    case DRM_FORMAT_XRGB8888:
+        cpp[0] = 4;
+        sub[0] = 1;
+        return 1;
+    case DRM_FORMAT_YUYV:
+    case DRM_FORMAT_UYVY:
+        cpp[0] = 2;
+        sub[0] = 1;
+        return 1;
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        cpp[0] = cpp[1] = cpp[2] = 1;
+        sub[0] = 1;
+        sub[1] = sub[2] = 2;
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+
+int
+mock_add_fb2(struct mock_file *file, uint32_t width, uint32_t height, uint32_t format,
+             const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+             uint32_t *fb_id)
+{
+    struct mock_object *objects[3];
+    int cpp[3], sub[3];
+    int num_planes = mock_format_layout(format, cpp, sub);
+    int i;
+
+    if (!num_planes || !width || !height)
+        return -EINVAL;
+
+    for (i = 0; i < num_planes; ++i)
+    {
+        uint64_t w = (width + sub[i] - 1) / sub[i];
+        uint64_t h = (height + sub[i] - 1) / sub[i];
+
+        objects[i] = mock_lookup(file, handles[i]);
+        if (!objects[i])
+            return -ENOENT;
+        if (pitches[i] < w * cpp[i] ||
+            offsets[i] + (h - 1) * pitches[i] + w * cpp[i] > objects[i]->size)
+            return -EINVAL;
+    }
+
+    for (i = 0; i < MOCK_MAX_FBS; ++i)
+    {
+        struct mock_fb *fb = &file->device->fbs[i];
+        int j;
+
+        if (fb->num_planes)
+            continue;
+
+        fb->owner = file;
+        fb->format = format;
+        fb->width = width;
+        fb->height = height;
+        fb->num_planes = num_planes;
+        for (j = 0; j < num_planes; ++j)
+        {
+            fb->objects[j] = objects[j];
+            fb->pitches[j] = pitches[j];
+            fb->offsets[j] = offsets[j];
+            objects[j]->refs++;
+        }
+        *fb_id = i + 1;
+        return 0;
+    }
+
+    return -ENOSPC;
+}
+
+
+int
+mock_add_fb(struct mock_file *file, uint32_t width, uint32_t height, uint32_t pitch,
+            uint32_t handle, uint32_t *fb_id)
+{
+    uint32_t handles[4] = { handle }, pitches[4] = { pitch }, offsets[4] = { 0 };
+
+    return mock_add_fb2(file, width, height, DRM_FORMAT_XRGB8888, handles, pitches, offsets,
+                        fb_id);
+}
+
+
+static struct mock_fb *
+mock_fb_lookup(struct mock_device *device, uint32_t fb_id)
+{
+    if (fb_id == 0 || fb_id > MOCK_MAX_FBS || !device->fbs[fb_id - 1].num_planes)
+        return NULL;
+
+    return &device->fbs[fb_id - 1];
+}
+
+
+// Like the kernel, whatever shows the framebuffer is turned off
+int
+mock_rm_fb(struct mock_file *file, uint32_t fb_id)
+{
+    struct mock_fb *fb = mock_fb_lookup(file->device, fb_id);
+    int i;
+
+    if (!fb)
+        return -ENOENT;
+
+    for (i = 0; i < MOCK_NUM_CRTCS; ++i)
+        if (file->device->crtcs[i].fb_id == fb_id)
+            file->device->crtcs[i].fb_id = 0;
+    for (i = 0; i < MOCK_NUM_PLANES; ++i)
+        if (file->device->planes[i].fb_id == fb_id)
+            memset(&file->device->planes[i], 0, sizeof (struct mock_plane));
+
+    for (i = 0; i < fb->num_planes; ++i)
+        mock_object_unref(file->device, fb->objects[i]);
+    fb->num_planes = 0;
+
+    return 0;
+}
+
+
+struct mock_crtc *
+mock_get_crtc(struct mock_device *device, uint32_t crtc_id)
+{
+    if (crtc_id < MOCK_CRTC_ID_BASE || crtc_id >= MOCK_CRTC_ID_BASE + MOCK_NUM_CRTCS)
+        return NULL;
+
+    return &device->crtcs[crtc_id - MOCK_CRTC_ID_BASE];
+}
+
+
+int
+mock_set_crtc(struct mock_device *device, uint32_t crtc_id, uint32_t fb_id)
+{
+    struct mock_crtc *crtc = mock_get_crtc(device, crtc_id);
+
+    if (!crtc || (fb_id && !mock_fb_lookup(device, fb_id)))
+        return -EINVAL;
+
+    crtc->fb_id = fb_id;
+
+    return 0;
+}
+
+
+int
+mock_move_cursor(struct mock_device *device, uint32_t crtc_id, int x, int y)
+{
+    struct mock_crtc *crtc = mock_get_crtc(device, crtc_id);
+
+    if (!crtc)
+        return -EINVAL;
+
+    crtc->cursor_x = x;
+    crtc->cursor_y = y;
+
+    return 0;
+}
+
+
+uint64_t
+mock_dirty_area(struct mock_device *device)
+{
+    return device->dirty_area;
+}
+
+
+int
+mock_dirty_boxes(struct mock_device *device)
+{
+    return device->dirty_boxes;
+}
+
+
+// Size of the fixed part of each command, before its boxes
+static uint32_t
+mock_cmd_size(uint16_t type)
+{
+    switch (type)
+    {
+    case DRM_XENGFX_CMD_DIRTY:
+        return sizeof (struct drm_xengfx_cmd_dirty);
+    case DRM_XENGFX_CMD_FILL:
+        return sizeof (struct drm_xengfx_cmd_fill);
+    case DRM_XENGFX_CMD_COPY:
+        return sizeof (struct drm_xengfx_cmd_copy);
+    case DRM_XENGFX_CMD_CURSOR_MOVE:
+        return sizeof (struct drm_xengfx_cmd_cursor_move);
+    default:
+        return 0;
+    }
+}
+
+
+static int
+mock_box_valid(const struct mock_fb *fb, const struct drm_xengfx_box *box, int dx, int dy)
+{
+    if (box->x1 >= box->x2 || box->y1 >= box->y2 ||
+        box->x1 < 0 || box->y1 < 0 || box->x2 > (int) fb->width || box->y2 > (int) fb->height)
+        return 0;
+
+    // Copies also read from the framebuffer
+    return box->x1 - dx >= 0 && box->y1 - dy >= 0 &&
+           box->x2 - dx <= (int) fb->width && box->y2 - dy <= (int) fb->height;
+}
+
+
+static int
+mock_submit_check(struct mock_device *device, const struct mock_fb *fb,
+                  const uint8_t *ptr, uint32_t length)
+{
+    uint32_t offset = 0;
+    uint32_t i;
+
+    while (offset < length)
+    {
+        const struct drm_xengfx_cmd_header *header = (const void *) (ptr + offset);
+        uint32_t size;
+        int dx = 0, dy = 0;
+
+        if (length - offset < sizeof (*header))
+            return -EINVAL;
+
+        size = mock_cmd_size(header->type);
+        if (!size || header->length % 8 || header->length > length - offset ||
+            header->length != size + (uint64_t) header->count * sizeof (struct drm_xengfx_box))
+            return -EINVAL;
+
+        if (header->type == DRM_XENGFX_CMD_COPY)
+        {
+            const struct drm_xengfx_cmd_copy *copy = (const void *) header;
+
+            dx = copy->dx;
+            dy = copy->dy;
+        }
+        else if (header->type == DRM_XENGFX_CMD_CURSOR_MOVE)
+        {
+            const struct drm_xengfx_cmd_cursor_move *move = (const void *) header;
+
+            if (header->count || !mock_get_crtc(device, move->crtc_id))
+                return -EINVAL;
+        }
+
+        for (i = 0; i < header->count; ++i)
+        {
+            const struct drm_xengfx_box *box = (const void *) (ptr + offset + size);
+
+            if (!mock_box_valid(fb, &box[i], dx, dy))
+                return -EINVAL;
+        }
+
+        offset += header->length;
+    }
+
+    return 0;
+}
+
+
+static void
+mock_fill(const struct mock_fb *fb, uint32_t pixel, const struct drm_xengfx_box *box)
+{
+    uint8_t *data = mock_fb_data(fb, 0);
+    int x, y;
+
+    for (y = box->y1; y < box->y2; ++y)
+        for (x = box->x1; x < box->x2; ++x)
+            ((uint32_t *) (data + (size_t) y * fb->pitches[0]))[x] = pixel;
+}
+
+
+// All the boxes of a copy read the framebuffer as it was before it
+static int
+mock_copy(const struct mock_fb *fb, const struct drm_xengfx_cmd_copy *copy)
+{
+    uint8_t *data = mock_fb_data(fb, 0);
+    uint32_t pitch = fb->pitches[0];
+    uint8_t *old = malloc((size_t) pitch * fb->height);
+    uint32_t i;
+    int y;
+
+    if (!old)
+        return -ENOMEM;
+    memcpy(old, data, (size_t) pitch * fb->height);
+
+    for (i = 0; i < copy->header.count; ++i)
+    {
+        const struct drm_xengfx_box *box = &copy->boxes[i];
+
+        for (y = box->y1; y < box->y2; ++y)
+            memcpy(data + (size_t) y * pitch + box->x1 * 4,
+                   old + (size_t) (y - copy->dy) * pitch + (box->x1 - copy->dx) * 4,
+                   (box->x2 - box->x1) * 4);
+    }
+
+    free(old);
+
+    return 0;
+}
+
+
+int
+mock_submit(struct mock_file *file, const struct drm_xengfx_submit *arg)
+{
+    struct mock_object *object = mock_lookup(file, arg->handle);
+    struct mock_fb *fb = mock_fb_lookup(file->device, arg->fb_id);
+    const uint8_t *ptr;
+    uint32_t offset = 0;
+    uint32_t i;
+    int ret;
+
+    if (!object || !fb)
+        return -ENOENT;
+    if (fb->format != DRM_FORMAT_XRGB8888)
+        return -EINVAL;
+    if (arg->offset % 8 || arg->offset > object->size ||
+        arg->length > object->size - arg->offset)
+        return -EINVAL;
+
+    ptr = (const uint8_t *) object->data + arg->offset;
+    ret = mock_submit_check(file->device, fb, ptr, arg->length);
+    if (ret)
+        return ret;
+
+    while (offset < arg->length)
+    {
+        const struct drm_xengfx_cmd_header *header = (const void *) (ptr + offset);
+
+        switch (header->type)
+        {
+        case DRM_XENGFX_CMD_DIRTY:
+        {
+            const struct drm_xengfx_cmd_dirty *dirty = (const void *) header;
+
+            for (i = 0; i < header->count; ++i)
+                file->device->dirty_area +=
+                    (uint64_t) (dirty->boxes[i].x2 - dirty->boxes[i].x1) *
+                    (dirty->boxes[i].y2 - dirty->boxes[i].y1);
+            file->device->dirty_boxes += header->count;
+            break;
+        }
+        case DRM_XENGFX_CMD_FILL:
+        {
+            const struct drm_xengfx_cmd_fill *fill = (const void *) header;
+
+            for (i = 0; i < header->count; ++i)
+                mock_fill(fb, fill->pixel, &fill->boxes[i]);
+            break;
+        }
+        case DRM_XENGFX_CMD_COPY:
+            ret = mock_copy(fb, (const void *) header);
+            if (ret)
+                return ret;
+            break;
+        case DRM_XENGFX_CMD_CURSOR_MOVE:
+        {
+            const struct drm_xengfx_cmd_cursor_move *move = (const void *) header;
+
+            mock_move_cursor(file->device, move->crtc_id, move->x, move->y);
+            break;
+        }
+        }
+
+        offset += header->length;
+    }
+
+    return 0;
+}
+
+
+struct mock_plane *
+mock_get_plane(struct mock_device *device, uint32_t plane_id)
+{
+    if (plane_id < MOCK_PLANE_ID_BASE || plane_id >= MOCK_PLANE_ID_BASE + MOCK_NUM_PLANES)
+        return NULL;
+
+    return &device->planes[plane_id - MOCK_PLANE_ID_BASE];
+}
+
+
+int
+mock_set_plane(struct mock_device *device, uint32_t plane_id, uint32_t crtc_id,
+               uint32_t fb_id, int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+               uint32_t crtc_h, uint32_t src_x, uint32_t src_y, uint32_t src_w,
+               uint32_t src_h)
+{
+    struct mock_plane *plane = mock_get_plane(device, plane_id);
+    struct mock_fb *fb;
+
+    if (!plane)
+        return -ENOENT;
+
+    if (!fb_id)
+    {
+        memset(plane, 0, sizeof (*plane));
+        return 0;
+    }
+
+    fb = mock_fb_lookup(device, fb_id);
+    if (!fb || !mock_get_crtc(device, crtc_id))
+        return -ENOENT;
+
+    // Overlays only take YUV
+    if (fb->format == DRM_FORMAT_XRGB8888 || !crtc_w || !crtc_h || !src_w || !src_h ||
+        (uint64_t) src_x + src_w > (uint64_t) fb->width << 16 ||
+        (uint64_t) src_y + src_h > (uint64_t) fb->height << 16)
+        return -EINVAL;
+
+    plane->crtc_id = crtc_id;
+    plane->fb_id = fb_id;
+    plane->crtc_x = crtc_x;
+    plane->crtc_y = crtc_y;
+    plane->crtc_w = crtc_w;
+    plane->crtc_h = crtc_h;
+    plane->src_x = src_x;
+    plane->src_y = src_y;
+    plane->src_w = src_w;
+    plane->src_h = src_h;
+
+    return 0;
+}
+
+
+static uint32_t
+mock_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+static uint32_t
+mock_yuv_to_rgb(int y, int u, int v)
+{
+    int c = y - 16, d = u - 128, e = v - 128;
+
+    return mock_clamp((298 * c + 409 * e + 128) >> 8) << 16 |
+           mock_clamp((298 * c - 100 * d - 208 * e + 128) >> 8) << 8 |
+           mock_clamp((298 * c + 516 * d + 128) >> 8);
+}
+
+
+static uint32_t
+mock_fb_sample(const struct mock_fb *fb, uint32_t x, uint32_t y)
+{
+    const uint8_t *row = mock_fb_data(fb, 0) + (size_t) y * fb->pitches[0];
+    const uint8_t *u, *v;
+
+    switch (fb->format)
+    {
+    case DRM_FORMAT_YUYV:
+        return mock_yuv_to_rgb(row[x * 2], row[(x & ~1) * 2 + 1], row[(x & ~1) * 2 + 3]);
+    case DRM_FORMAT_UYVY:
+        return mock_yuv_to_rgb(row[x * 2 + 1], row[(x & ~1) * 2], row[(x & ~1) * 2 + 2]);
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+        u = mock_fb_data(fb, 1) + (size_t) (y / 2) * fb->pitches[1] + x / 2;
+        v = mock_fb_data(fb, 2) + (size_t) (y / 2) * fb->pitches[2] + x / 2;
+        return fb->format == DRM_FORMAT_YUV420 ? mock_yuv_to_rgb(row[x], *u, *v) :
+                                                 mock_yuv_to_rgb(row[x], *v, *u);
+    default:
+        return ((const uint32_t *) row)[x] & 0xffffff;
+    }
+}
+
+
+int
+mock_compose(struct mock_device *device, uint32_t crtc_id, uint32_t width, uint32_t height,
+             uint32_t *out)
+{
+    struct mock_crtc *crtc = mock_get_crtc(device, crtc_id);
+    struct mock_fb *fb;
+    uint32_t x, y;
+    int i;
+
+    if (!crtc || !crtc->fb_id)
+        return -EINVAL;
+
+    fb = mock_fb_lookup(device, crtc->fb_id);
+    if (width > fb->width || height > fb->height)
+        return -EINVAL;
+
+    for (y = 0; y < height; ++y)
+        for (x = 0; x < width; ++x)
+            out[y * width + x] = mock_fb_sample(fb, x, y);
+
+    for (i = 0; i < MOCK_NUM_PLANES; ++i)
+    {
+        struct mock_plane *plane = &device->planes[i];
+        int64_t dx, dy;
+
+        if (!plane->fb_id || plane->crtc_id != crtc_id)
+            continue;
+        fb = mock_fb_lookup(device, plane->fb_id);
+
+        for (dy = MOCK_MAX(plane->crtc_y, 0);
+             dy < MOCK_MIN(plane->crtc_y + (int64_t) plane->crtc_h, height); ++dy)
+        {
+            // Source pixel centers, in 16.16
+            uint64_t sy = plane->src_y +
+                          ((2 * (dy - plane->crtc_y) + 1) * plane->src_h) / (2 * plane->crtc_h);
+
+            for (dx = MOCK_MAX(plane->crtc_x, 0);
+                 dx < MOCK_MIN(plane->crtc_x + (int64_t) plane->crtc_w, width); ++dx)
+            {
+                uint64_t sx = plane->src_x +
+                              ((2 * (dx - plane->crtc_x) + 1) * plane->src_w) / (2 * plane->crtc_w);
+
+                out[dy * width + dx] = mock_fb_sample(fb, sx >> 16, sy >> 16);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#ifndef MOCK_DEVICE_H_
+#define MOCK_DEVICE_H_
+
+#include <stdint.h>
+
+#include "xengfx_drm.h"
+
+// From drm_fourcc.h, which the tests do not need libdrm for
+#ifndef DRM_FORMAT_XRGB8888
+#define MOCK_FOURCC(a, b, c, d) \
+    ((uint32_t) (a) | ((uint32_t) (b) << 8) | ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+#define DRM_FORMAT_XRGB8888     MOCK_FOURCC('X', 'R', '2', '4')
+#define DRM_FORMAT_YUYV         MOCK_FOURCC('Y', 'U', 'Y', 'V')
+#define DRM_FORMAT_UYVY         MOCK_FOURCC('U', 'Y', 'V', 'Y')
+#define DRM_FORMAT_YUV420       MOCK_FOURCC('Y', 'U', '1', '2')
+#define DRM_FORMAT_YVU420       MOCK_FOURCC('Y', 'V', '1', '2')
+#endif
+
+// A userspace stand-in for the xengfx kernel driver and its backend. It
+// keeps GEM objects in memory and implements the ABI of xengfx_drm.h on
+// them, so the protocol can be exercised without a device. Calls return 0
+// or a negative errno, like the ioctls they stand for.
+
+#define MOCK_MAX_HANDLES        256
+#define MOCK_MAX_DMABUFS        64
+#define MOCK_MAX_FBS            16
+#define MOCK_NUM_CRTCS          2
+#define MOCK_CRTC_ID_BASE       100     // CRTC i has id MOCK_CRTC_ID_BASE + i
+#define MOCK_NUM_PLANES         2
+#define MOCK_PLANE_ID_BASE      200     // YUV overlays, on any CRTC
+
+struct mock_object;
+struct mock_device;
+
+// What the backend shows on a CRTC
+struct mock_crtc
+{
+    uint32_t fb_id;
+    int cursor_x;
+    int cursor_y;
+};
+
+// An overlay plane, off when fb_id is 0. The source is in 16.16.
+struct mock_plane
+{
+    uint32_t crtc_id;
+    uint32_t fb_id;
+    int32_t crtc_x;
+    int32_t crtc_y;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_w;
+    uint32_t src_h;
+};
+
+// One open DRM file, with its own handle namespace
+struct mock_file
+{
+    struct mock_device *device;
+    struct mock_object *handles[MOCK_MAX_HANDLES];  // handle - 1
+};
+
+struct mock_device *mock_device_create(void);
+void mock_device_destroy(struct mock_device *device);
+struct mock_file *mock_open(struct mock_device *device);
+void mock_close(struct mock_file *file);
+
+// GEM
+int mock_gem_create(struct mock_file *file, struct drm_xengfx_gem_create *arg);
+int mock_gem_close(struct mock_file *file, uint32_t handle);
+void *mock_gem_map(struct mock_file *file, uint32_t handle);
+int mock_live_objects(struct mock_device *device);
+
+// PRIME. A dma-buf stands for its object, whichever file imports it;
+// importing one the file already has a handle for returns that handle.
+#define MOCK_PRIME_RDWR         (1 << 0)
+
+int mock_prime_handle_to_fd(struct mock_file *file, uint32_t handle, uint32_t flags,
+                            int *fd);
+int mock_prime_fd_to_handle(struct mock_file *file, int fd, uint32_t *handle);
+int mock_dmabuf_close(struct mock_device *device, int fd);
+int64_t mock_dmabuf_size(struct mock_device *device, int fd);
+int mock_dmabuf_writable(struct mock_device *device, int fd);
+
+// KMS, as much of it as the backend sees. mock_add_fb adds an XRGB8888
+// framebuffer, the only format CRTCs and submissions take.
+int mock_add_fb(struct mock_file *file, uint32_t width, uint32_t height, uint32_t pitch,
+                uint32_t handle, uint32_t *fb_id);
+int mock_add_fb2(struct mock_file *file, uint32_t width, uint32_t height, uint32_t format,
+                 const uint32_t handles[4], const uint32_t pitches[4],
+                 const uint32_t offsets[4], uint32_t *fb_id);
+int mock_rm_fb(struct mock_file *file, uint32_t fb_id);
+int mock_set_crtc(struct mock_device *device, uint32_t crtc_id, uint32_t fb_id);
+int mock_move_cursor(struct mock_device *device, uint32_t crtc_id, int x, int y);
+struct mock_crtc *mock_get_crtc(struct mock_device *device, uint32_t crtc_id);
+int mock_set_plane(struct mock_device *device, uint32_t plane_id, uint32_t crtc_id,
+                   uint32_t fb_id, int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+                   uint32_t crtc_h, uint32_t src_x, uint32_t src_y, uint32_t src_w,
+                   uint32_t src_h);
+struct mock_plane *mock_get_plane(struct mock_device *device, uint32_t plane_id);
+
+// What the backend would show on a width x height mode of the CRTC: its
+// framebuffer from (0, 0), then the overlays, scaled to the nearest pixel
+// and converted from BT.601 limited range. Returns 0 or a negative errno.
+int mock_compose(struct mock_device *device, uint32_t crtc_id, uint32_t width,
+                 uint32_t height, uint32_t *out);
+
+// The reference consumer of DRM_XENGFX_SUBMIT: it checks every record
+// before running any, then applies them in order. DIRTY boxes are added
+// up in the dirty counters, the backend would read their pixels back.
+int mock_submit(struct mock_file *file, const struct drm_xengfx_submit *arg);
+uint64_t mock_dirty_area(struct mock_device *device);
+int mock_dirty_boxes(struct mock_device *device);
+
+#endif /* MOCK_DEVICE_H_ */
@@ -0,0 +1,262 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_device.h"
+
+// Puts frames on an overlay plane laid out the way xengfx_video.c does,
+// and checks what the backend composes on the CRTC.
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+#define MODE_WIDTH      128
+#define MODE_HEIGHT     96
+#define FRAME_WIDTH     32
+#define FRAME_HEIGHT    24
+
+#define BACKGROUND      0x336699
+
+// BT.601 limited range, close to pure colors
+#define RED_Y   81
+#define RED_U   90
+#define RED_V   240
+#define BLUE_Y  41
+#define BLUE_U  240
+#define BLUE_V  110
+
+
+// Same layout as xengfx_video_overlay_bo and xengfx_video_overlay_copy:
+// one 8 bpp object of 3/2 the height, chroma planes at half the pitch,
+// U then V for YUV420 and V then U for YVU420. The left half of the frame
+// is red, the right half blue.
+static uint32_t
+add_planar_frame(struct mock_file *file, uint32_t format)
+{
+    struct drm_xengfx_gem_create arg = { .width = FRAME_WIDTH, .height = FRAME_HEIGHT * 3 / 2,
+                                         .bpp = 8, .flags = DRM_XENGFX_GEM_PITCH_64 };
+    uint32_t handles[4], pitches[4], offsets[4];
+    uint8_t *data, *first, *second;
+    uint32_t fb_id;
+    int x, y;
+
+    CHECK(mock_gem_create(file, &arg) == 0);
+    data = mock_gem_map(file, arg.handle);
+
+    memset(handles, 0, sizeof (handles));
+    memset(pitches, 0, sizeof (pitches));
+    memset(offsets, 0, sizeof (offsets));
+    handles[0] = handles[1] = handles[2] = arg.handle;
+    pitches[0] = arg.pitch;
+    pitches[1] = pitches[2] = arg.pitch / 2;
+    offsets[1] = arg.pitch * FRAME_HEIGHT;
+    offsets[2] = offsets[1] + arg.pitch / 2 * (FRAME_HEIGHT / 2);
+
+    first = data + offsets[1];
+    second = data + offsets[2];
+    for (y = 0; y < FRAME_HEIGHT; ++y)
+        for (x = 0; x < FRAME_WIDTH; ++x)
+            data[y * pitches[0] + x] = x < FRAME_WIDTH / 2 ? RED_Y : BLUE_Y;
+    for (y = 0; y < FRAME_HEIGHT / 2; ++y)
+    {
+        for (x = 0; x < FRAME_WIDTH / 2; ++x)
+        {
+            int u = x < FRAME_WIDTH / 4 ? RED_U : BLUE_U;
+            int v = x < FRAME_WIDTH / 4 ? RED_V : BLUE_V;
+
+            first[y * pitches[1] + x] = format == DRM_FORMAT_YUV420 ? u : v;
+            second[y * pitches[2] + x] = format == DRM_FORMAT_YUV420 ? v : u;
+        }
+    }
+
+    CHECK(mock_add_fb2(file, FRAME_WIDTH, FRAME_HEIGHT, format, handles, pitches, offsets,
+                       &fb_id) == 0);
+    CHECK(mock_gem_close(file, arg.handle) == 0);
+
+    return fb_id;
+}
+
+
+// Packed frames are a 16 bpp object, all red
+static uint32_t
+add_packed_frame(struct mock_file *file, uint32_t format)
+{
+    struct drm_xengfx_gem_create arg = { .width = FRAME_WIDTH, .height = FRAME_HEIGHT,
+                                         .bpp = 16, .flags = DRM_XENGFX_GEM_PITCH_64 };
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    uint8_t *data;
+    uint32_t fb_id;
+    int x, y;
+
+    CHECK(mock_gem_create(file, &arg) == 0);
+    data = mock_gem_map(file, arg.handle);
+
+    for (y = 0; y < FRAME_HEIGHT; ++y)
+    {
+        for (x = 0; x < FRAME_WIDTH; x += 2)
+        {
+            uint8_t *p = data + y * arg.pitch + x * 2;
+
+            if (format == DRM_FORMAT_YUYV)
+            {
+                p[0] = p[2] = RED_Y;
+                p[1] = RED_U;
+                p[3] = RED_V;
+            }
+            else
+            {
+                p[1] = p[3] = RED_Y;
+                p[0] = RED_U;
+                p[2] = RED_V;
+            }
+        }
+    }
+
+    handles[0] = arg.handle;
+    pitches[0] = arg.pitch;
+    CHECK(mock_add_fb2(file, FRAME_WIDTH, FRAME_HEIGHT, format, handles, pitches, offsets,
+                       &fb_id) == 0);
+    CHECK(mock_gem_close(file, arg.handle) == 0);
+
+    return fb_id;
+}
+
+
+static int
+is_red(uint32_t pixel)
+{
+    return (pixel >> 16) >= 0xf0 && ((pixel >> 8) & 0xff) <= 0x10 && (pixel & 0xff) <= 0x10;
+}
+
+
+static int
+is_blue(uint32_t pixel)
+{
+    return (pixel >> 16) <= 0x10 && ((pixel >> 8) & 0xff) <= 0x20 && (pixel & 0xff) >= 0xf0;
+}
+
+
+int
+main(void)
+{
+    static const uint32_t planar[2] = { DRM_FORMAT_YUV420, DRM_FORMAT_YVU420 };
+    static const uint32_t packed[2] = { DRM_FORMAT_YUYV, DRM_FORMAT_UYVY };
+    struct mock_device *device = mock_device_create();
+    struct mock_file *file = mock_open(device);
+    struct drm_xengfx_gem_create front = { .width = MODE_WIDTH, .height = MODE_HEIGHT, .bpp = 32,
+                                           .flags = DRM_XENGFX_GEM_PITCH_64 };
+    uint32_t out[MODE_WIDTH * MODE_HEIGHT];
+    uint32_t crtc_id = MOCK_CRTC_ID_BASE;
+    uint32_t plane_id = MOCK_PLANE_ID_BASE;
+    uint32_t front_fb, fb_id;
+    uint8_t *data;
+    int i, x, y;
+
+    CHECK(mock_gem_create(file, &front) == 0);
+    CHECK(mock_add_fb(file, MODE_WIDTH, MODE_HEIGHT, front.pitch, front.handle, &front_fb) == 0);
+    CHECK(mock_set_crtc(device, crtc_id, front_fb) == 0);
+    data = mock_gem_map(file, front.handle);
+    for (y = 0; y < MODE_HEIGHT; ++y)
+        for (x = 0; x < MODE_WIDTH; ++x)
+            ((uint32_t *) (data + y * front.pitch))[x] = BACKGROUND;
+
+    // Scanout formats are not overlay formats
+    CHECK(mock_set_plane(device, plane_id, crtc_id, front_fb, 0, 0, 16, 16,
+                         0, 0, 16 << 16, 16 << 16) != 0);
+
+    for (i = 0; i < 2; ++i)
+    {
+        // Scaled twice, at (10, 20) in the mode
+        fb_id = add_planar_frame(file, planar[i]);
+        CHECK(mock_set_plane(device, plane_id, crtc_id, fb_id, 10, 20,
+                             FRAME_WIDTH * 2, FRAME_HEIGHT * 2,
+                             0, 0, FRAME_WIDTH << 16, FRAME_HEIGHT << 16) == 0);
+        CHECK(mock_compose(device, crtc_id, MODE_WIDTH, MODE_HEIGHT, out) == 0);
+
+        CHECK(out[19 * MODE_WIDTH + 10] == BACKGROUND);
+        CHECK(out[20 * MODE_WIDTH + 9] == BACKGROUND);
+        CHECK(is_red(out[20 * MODE_WIDTH + 10]));
+        CHECK(is_red(out[(20 + FRAME_HEIGHT * 2 - 1) * MODE_WIDTH + 10 + FRAME_WIDTH - 1]));
+        CHECK(is_blue(out[20 * MODE_WIDTH + 10 + FRAME_WIDTH]));
+        CHECK(is_blue(out[(20 + FRAME_HEIGHT * 2 - 1) * MODE_WIDTH + 10 + FRAME_WIDTH * 2 - 1]));
+        CHECK(out[(20 + FRAME_HEIGHT * 2) * MODE_WIDTH + 10] == BACKGROUND);
+        CHECK(out[20 * MODE_WIDTH + 10 + FRAME_WIDTH * 2] == BACKGROUND);
+
+        // Only the right half of the source, cropped in 16.16
+        CHECK(mock_set_plane(device, plane_id, crtc_id, fb_id, 0, 0,
+                             FRAME_WIDTH / 2, FRAME_HEIGHT,
+                             FRAME_WIDTH / 2 << 16, 0,
+                             FRAME_WIDTH / 2 << 16, FRAME_HEIGHT << 16) == 0);
+        CHECK(mock_compose(device, crtc_id, MODE_WIDTH, MODE_HEIGHT, out) == 0);
+        CHECK(is_blue(out[0]));
+        CHECK(out[FRAME_WIDTH / 2] == BACKGROUND);
+
+        // Past the frame
+        CHECK(mock_set_plane(device, plane_id, crtc_id, fb_id, 0, 0, 16, 16,
+                             1 << 16, 0, FRAME_WIDTH << 16, FRAME_HEIGHT << 16) != 0);
+
+        // Removing the framebuffer takes it off the plane
+        CHECK(mock_rm_fb(file, fb_id) == 0);
+        CHECK(mock_get_plane(device, plane_id)->fb_id == 0);
+        CHECK(mock_compose(device, crtc_id, MODE_WIDTH, MODE_HEIGHT, out) == 0);
+        CHECK(out[0] == BACKGROUND);
+    }
+
+    for (i = 0; i < 2; ++i)
+    {
+        fb_id = add_packed_frame(file, packed[i]);
+        CHECK(mock_set_plane(device, plane_id + 1, crtc_id, fb_id, MODE_WIDTH - 8, 0,
+                             FRAME_WIDTH, FRAME_HEIGHT,
+                             0, 0, FRAME_WIDTH << 16, FRAME_HEIGHT << 16) == 0);
+        CHECK(mock_compose(device, crtc_id, MODE_WIDTH, MODE_HEIGHT, out) == 0);
+        CHECK(is_red(out[MODE_WIDTH - 8]));
+        CHECK(is_red(out[(FRAME_HEIGHT - 1) * MODE_WIDTH + MODE_WIDTH - 1]));
+        CHECK(out[MODE_WIDTH - 9] == BACKGROUND);
+
+        CHECK(mock_set_plane(device, plane_id + 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0) == 0);
+        CHECK(mock_rm_fb(file, fb_id) == 0);
+    }
+
+    mock_close(file);
+    CHECK(mock_live_objects(device) == 0);
+    mock_device_destroy(device);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mock_device.h"
+
+// The PRIME contract xengfx_drm_import_bo relies on: importing a buffer
+// the file already has a handle for returns that same handle, so the
+// driver must share one BO per handle and close it once.
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+
+int
+main(void)
+{
+    struct mock_device *device = mock_device_create();
+    struct mock_file *server = mock_open(device);
+    struct mock_file *client = mock_open(device);
+    struct drm_xengfx_gem_create arg = { .width = 100, .height = 50, .bpp = 32,
+                                         .flags = DRM_XENGFX_GEM_PITCH_64 };
+    uint32_t first, second, own;
+    int fd, fd2;
+
+    CHECK(mock_gem_create(client, &arg) == 0);
+    CHECK(arg.flags & DRM_XENGFX_GEM_GRANTED);
+    CHECK(arg.pitch == 448);
+    CHECK(arg.size >= (uint64_t) arg.pitch * arg.height);
+
+    // The client shares its buffer twice, as two DRI3 pixmaps
+    CHECK(mock_prime_handle_to_fd(client, arg.handle, MOCK_PRIME_RDWR, &fd) == 0);
+    CHECK(mock_prime_handle_to_fd(client, arg.handle, MOCK_PRIME_RDWR, &fd2) == 0);
+    CHECK(mock_dmabuf_size(device, fd) == (int64_t) arg.size);
+
+    CHECK(mock_prime_fd_to_handle(server, fd, &first) == 0);
+    CHECK(mock_prime_fd_to_handle(server, fd2, &second) == 0);
+    CHECK(first == second);
+    CHECK(mock_dmabuf_close(device, fd) == 0);
+    CHECK(mock_dmabuf_close(device, fd2) == 0);
+    CHECK(mock_gem_close(client, arg.handle) == 0);
+
+    // A single close drops the only reference, whoever else uses the handle
+    CHECK(mock_gem_map(server, first) != NULL);
+    CHECK(mock_gem_close(server, first) == 0);
+    CHECK(mock_gem_map(server, second) == NULL);
+    CHECK(mock_gem_close(server, second) != 0);
+    CHECK(mock_live_objects(device) == 0);
+
+    // Re-importing a buffer the server exported gives its own handle back
+    CHECK(mock_gem_create(server, &arg) == 0);
+    own = arg.handle;
+    CHECK(mock_prime_handle_to_fd(server, own, 0, &fd) == 0);
+    CHECK(!mock_dmabuf_writable(device, fd));
+    CHECK(mock_prime_fd_to_handle(server, fd, &first) == 0);
+    CHECK(first == own);
+    CHECK(mock_dmabuf_close(device, fd) == 0);
+    CHECK(mock_live_objects(device) == 1);
+    CHECK(mock_gem_close(server, own) == 0);
+    CHECK(mock_live_objects(device) == 0);
+
+    mock_close(client);
+    mock_close(server);
+    mock_device_destroy(device);
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Aurelien Chartier <chartier.aurelien@gmail.com>
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_device.h"
+
+// Runs a command buffer encoded the way xengfx_cmd.c does through the
+// reference consumer, and checks what reaches the framebuffer and the
+// cursor.
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+#define WIDTH   256
+#define HEIGHT  128
+
+struct cmd_buffer
+{
+    uint8_t *ptr;
+    uint32_t used;
+};
+
+
+static void *
+cmd_reserve(struct cmd_buffer *cmd, uint32_t size)
+{
+    void *ptr = cmd->ptr + cmd->used;
+
+    memset(ptr, 0, size);
+    cmd->used += size;
+
+    return ptr;
+}
+
+
+// Same layout as xengfx_cmd_emit_boxes
+static void
+cmd_emit_boxes(struct cmd_buffer *cmd, const void *fixed, uint32_t size,
+               const struct drm_xengfx_box *boxes, uint32_t count)
+{
+    uint32_t length = size + count * sizeof (struct drm_xengfx_box);
+    uint8_t *ptr = cmd_reserve(cmd, length);
+    struct drm_xengfx_cmd_header *header = (struct drm_xengfx_cmd_header *) ptr;
+
+    memcpy(ptr, fixed, size);
+    header->length = length;
+    header->count = count;
+    memcpy(ptr + size, boxes, count * sizeof (struct drm_xengfx_box));
+}
+
+
+static void
+cmd_fill(struct cmd_buffer *cmd, uint32_t pixel, const struct drm_xengfx_box *boxes,
+         uint32_t count)
+{
+    struct drm_xengfx_cmd_fill fill;
+
+    memset(&fill, 0, sizeof (fill));
+    fill.header.type = DRM_XENGFX_CMD_FILL;
+    fill.pixel = pixel;
+    cmd_emit_boxes(cmd, &fill, sizeof (fill), boxes, count);
+}
+
+
+static void
+cmd_copy(struct cmd_buffer *cmd, int dx, int dy, const struct drm_xengfx_box *boxes,
+         uint32_t count)
+{
+    struct drm_xengfx_cmd_copy copy;
+
+    memset(&copy, 0, sizeof (copy));
+    copy.header.type = DRM_XENGFX_CMD_COPY;
+    copy.dx = dx;
+    copy.dy = dy;
+    cmd_emit_boxes(cmd, &copy, sizeof (copy), boxes, count);
+}
+
+
+static void
+cmd_dirty(struct cmd_buffer *cmd, const struct drm_xengfx_box *boxes, uint32_t count)
+{
+    struct drm_xengfx_cmd_dirty dirty;
+
+    memset(&dirty, 0, sizeof (dirty));
+    dirty.header.type = DRM_XENGFX_CMD_DIRTY;
+    cmd_emit_boxes(cmd, &dirty, sizeof (dirty), boxes, count);
+}
+
+
+// Same record as xengfx_cmd_cursor
+static void
+cmd_cursor(struct cmd_buffer *cmd, uint32_t crtc_id, int x, int y)
+{
+    struct drm_xengfx_cmd_cursor_move *move = cmd_reserve(cmd, sizeof (*move));
+
+    move->header.type = DRM_XENGFX_CMD_CURSOR_MOVE;
+    move->header.length = sizeof (*move);
+    move->crtc_id = crtc_id;
+    move->x = x;
+    move->y = y;
+}
+
+
+static uint32_t
+pixel_at(const uint8_t *data, uint32_t pitch, int x, int y)
+{
+    return ((const uint32_t *) (data + (size_t) y * pitch))[x];
+}
+
+
+int
+main(void)
+{
+    struct mock_device *device = mock_device_create();
+    struct mock_file *file = mock_open(device);
+    struct drm_xengfx_gem_create front = { .width = WIDTH, .height = HEIGHT, .bpp = 32,
+                                           .flags = DRM_XENGFX_GEM_PITCH_64 };
+    struct drm_xengfx_gem_create cmd_bo = { .width = 4096, .height = 1, .bpp = 8 };
+    struct drm_xengfx_box top = { 0, 0, WIDTH, 32 };
+    struct drm_xengfx_box bottom = { 0, 32, WIDTH, HEIGHT };
+    // Scroll everything up by 16 lines
+    struct drm_xengfx_box scroll = { 0, 0, WIDTH, HEIGHT - 16 };
+    struct drm_xengfx_box swap[2] = { { 0, 0, 8, 8 }, { 8, 0, 16, 8 } };
+    struct drm_xengfx_box outside = { WIDTH - 8, 0, WIDTH + 8, 8 };
+    struct drm_xengfx_submit submit;
+    struct cmd_buffer cmd;
+    struct mock_crtc *crtc;
+    uint8_t *data;
+    uint32_t fb_id;
+
+    CHECK(mock_gem_create(file, &front) == 0);
+    CHECK(mock_gem_create(file, &cmd_bo) == 0);
+    CHECK(mock_add_fb(file, WIDTH, HEIGHT, front.pitch, front.handle, &fb_id) == 0);
+    CHECK(mock_set_crtc(device, MOCK_CRTC_ID_BASE, fb_id) == 0);
+    data = mock_gem_map(file, front.handle);
+    cmd.ptr = mock_gem_map(file, cmd_bo.handle);
+
+    memset(&submit, 0, sizeof (submit));
+    submit.handle = cmd_bo.handle;
+    submit.fb_id = fb_id;
+
+    // Fills, then a scroll reading what the fills left, in one submission
+    cmd.used = 0;
+    cmd_fill(&cmd, 0xff0000, &top, 1);
+    cmd_fill(&cmd, 0x00ff00, &bottom, 1);
+    cmd_copy(&cmd, 0, -16, &scroll, 1);
+    cmd_dirty(&cmd, &bottom, 1);
+    cmd_cursor(&cmd, MOCK_CRTC_ID_BASE + 1, 40, -3);
+    submit.length = cmd.used;
+    CHECK(mock_submit(file, &submit) == 0);
+
+    CHECK(pixel_at(data, front.pitch, 0, 0) == 0xff0000);
+    CHECK(pixel_at(data, front.pitch, 0, 15) == 0xff0000);
+    CHECK(pixel_at(data, front.pitch, 0, 16) == 0x00ff00);
+    CHECK(pixel_at(data, front.pitch, WIDTH - 1, HEIGHT - 1) == 0x00ff00);
+    CHECK(mock_dirty_boxes(device) == 1);
+    CHECK(mock_dirty_area(device) == (uint64_t) WIDTH * (HEIGHT - 32));
+    crtc = mock_get_crtc(device, MOCK_CRTC_ID_BASE + 1);
+    CHECK(crtc->cursor_x == 40 && crtc->cursor_y == -3);
+    CHECK(mock_get_crtc(device, MOCK_CRTC_ID_BASE)->cursor_x == 0);
+
+    // The boxes of one copy move at once, two of them can swap
+    cmd.used = 0;
+    cmd_fill(&cmd, 1, &swap[0], 1);
+    cmd_fill(&cmd, 2, &swap[1], 1);
+    submit.length = cmd.used;
+    CHECK(mock_submit(file, &submit) == 0);
+    cmd.used = 0;
+    cmd_copy(&cmd, 8, 0, &swap[1], 1);
+    submit.length = cmd.used;
+    CHECK(mock_submit(file, &submit) == 0);
+    CHECK(pixel_at(data, front.pitch, 8, 0) == 1);
+
+    // A bad record rejects the whole submission
+    cmd.used = 0;
+    cmd_fill(&cmd, 3, &swap[0], 1);
+    cmd_fill(&cmd, 3, &outside, 1);
+    submit.length = cmd.used;
+    CHECK(mock_submit(file, &submit) != 0);
+    CHECK(pixel_at(data, front.pitch, 0, 0) == 1);
+
+    cmd.used = 0;
+    cmd_cursor(&cmd, MOCK_CRTC_ID_BASE + MOCK_NUM_CRTCS, 0, 0);
+    submit.length = cmd.used;
+    CHECK(mock_submit(file, &submit) != 0);
+
+    cmd.used = 0;
+    cmd_cursor(&cmd, MOCK_CRTC_ID_BASE, 0, 0);
+    submit.length = cmd.used - 8;
+    CHECK(mock_submit(file, &submit) != 0);
+
+    mock_close(file);
+    CHECK(mock_live_objects(device) == 0);
+    mock_device_destroy(device);
+
+    return 0;
+}